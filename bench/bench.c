@@ -0,0 +1,101 @@
+#include "bench.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int bench_iterations(int argc, char *argv[], int def) {
+	if (argc < 2) {
+		return def;
+	}
+	int n = atoi(argv[1]);
+	return n > 0 ? n : def;
+}
+
+void bench_quiet(bool quiet) {
+	static int stdout_fd = -1;
+
+	fflush(stdout);
+	if (quiet && stdout_fd < 0) {
+		stdout_fd = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	} else if (!quiet && stdout_fd >= 0) {
+		dup2(stdout_fd, STDOUT_FILENO);
+		close(stdout_fd);
+		stdout_fd = -1;
+	}
+}
+
+void bench_init(struct bench *bench, const char *suite, const char *name,
+		int iterations) {
+	*bench = (struct bench) {
+		.suite = suite,
+		.name = name,
+		.max_samples = iterations,
+		.samples = calloc(iterations, sizeof(uint64_t)),
+	};
+	assert(bench->samples != NULL);
+}
+
+void bench_sample(struct bench *bench, uint64_t ns) {
+	if (bench->nsamples < bench->max_samples) {
+		bench->samples[bench->nsamples++] = ns;
+	}
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct bench *bench, int p) {
+	return bench->samples[(uint64_t) (bench->nsamples - 1) * p / 100];
+}
+
+/* one object per line, so the output of several runs can simply be
+ * concatenated and compared */
+void bench_report(struct bench *bench) {
+	if (bench->nsamples == 0) {
+		fprintf(stderr, "%s/%s: no samples\n", bench->suite,
+				bench->name);
+		free(bench->samples);
+		return;
+	}
+
+	qsort(bench->samples, bench->nsamples, sizeof(uint64_t),
+			compare_samples);
+	uint64_t total = 0;
+	for (int i = 0; i < bench->nsamples; i++) {
+		total += bench->samples[i];
+	}
+	uint64_t mean = total / bench->nsamples;
+
+	printf("{\"suite\": \"%s\", \"name\": \"%s\", \"iterations\": %d, "
+			"\"mean_ns\": %llu, \"min_ns\": %llu, "
+			"\"p50_ns\": %llu, \"p99_ns\": %llu, "
+			"\"max_ns\": %llu", bench->suite, bench->name,
+			bench->nsamples, (unsigned long long) mean,
+			(unsigned long long) bench->samples[0],
+			(unsigned long long) percentile(bench, 50),
+			(unsigned long long) percentile(bench, 99),
+			(unsigned long long)
+			bench->samples[bench->nsamples - 1]);
+	if (bench->bytes > 0 && total > 0) {
+		printf(", \"bytes_per_s\": %.0f", (double) bench->bytes
+				* bench->nsamples * 1e9 / total);
+	}
+	printf("}\n");
+	fflush(stdout);
+
+	free(bench->samples);
+	bench->samples = NULL;
+}
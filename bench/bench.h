@@ -0,0 +1,32 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* the timings of one benchmark case, one sample per iteration */
+struct bench {
+	const char *suite;
+	const char *name;
+	int nsamples;
+	int max_samples;
+	uint64_t *samples;
+	/* bytes touched per iteration, for throughput. 0 if meaningless */
+	uint64_t bytes;
+};
+
+uint64_t bench_now_ns(void);
+/* iterations comes from the command line, or def if there's none */
+int bench_iterations(int argc, char *argv[], int def);
+
+/* sends stdout to stderr while quiet, so it only has the results */
+void bench_quiet(bool quiet);
+
+void bench_init(struct bench *bench, const char *suite, const char *name,
+		int iterations);
+void bench_sample(struct bench *bench, uint64_t ns);
+/* prints the statistics as one line of JSON on stdout and frees the
+ * samples */
+void bench_report(struct bench *bench);
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "shared/dumb_fb.h"
+#include "shared/helper.h"
+
+/* what meson counts as a skipped test */
+#define BENCH_SKIP 77
+
+#define FB_WIDTH 1920
+#define FB_HEIGHT 1080
+
+int main(int argc, char *argv[]) {
+	int iterations = bench_iterations(argc, argv, 500);
+
+	/* dumb buffers need a real device, vkms will do */
+	bench_quiet(true);
+	int drm_fd = open_drm_device();
+	bench_quiet(false);
+	if (drm_fd < 0) {
+		return BENCH_SKIP;
+	}
+
+	struct dumb_fb fb;
+	if (dumb_fb_init(&fb, drm_fd, DRM_FORMAT_XRGB8888, FB_WIDTH,
+				FB_HEIGHT) < 0) {
+		fprintf(stderr, "could not create dumb buffer\n");
+		close(drm_fd);
+		return BENCH_SKIP;
+	}
+
+	struct bench bench;
+	bench_init(&bench, "dumb_fb", "fill_1920x1080", iterations);
+	bench.bytes = (uint64_t) FB_WIDTH * FB_HEIGHT * 4;
+	for (int i = 0; i < iterations; i++) {
+		uint64_t start = bench_now_ns();
+		dumb_fb_fill(&fb, drm_fd, 0xFF000000 | i);
+		bench_sample(&bench, bench_now_ns() - start);
+	}
+	bench_report(&bench);
+
+	/* the sizes a client typically redraws, from a cursor to the screen */
+	const int sizes[][2] = {
+		{ 64, 64 },
+		{ 256, 256 },
+		{ 1280, 720 },
+		{ FB_WIDTH, FB_HEIGHT },
+	};
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int width = sizes[s][0];
+		int height = sizes[s][1];
+		char name[32];
+		snprintf(name, sizeof(name), "draw_rect_%dx%d", width, height);
+
+		bench_init(&bench, "dumb_fb", name, iterations);
+		bench.bytes = (uint64_t) width * height * 4;
+		for (int i = 0; i < iterations; i++) {
+			int x = (i * 16) % (FB_WIDTH - width + 1);
+			int y = (i * 16) % (FB_HEIGHT - height + 1);
+			uint64_t start = bench_now_ns();
+			dumb_fb_draw_rect(&fb, drm_fd, 0xFFFFFFFF, x, y,
+					width, height);
+			bench_sample(&bench, bench_now_ns() - start);
+		}
+		bench_report(&bench);
+	}
+
+	close(drm_fd);
+	return 0;
+}
@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <poll.h>
+#include <stdio.h>
+
+#include "bench.h"
+#include "compositor.h"
+#include "kms_backend.h"
+
+/* flips are due as soon as they're committed, so only our side of the
+ * frame is measured */
+#define FAKE_CONFIG "unpaced=1,planes=6"
+
+struct frame_bench {
+	struct compositor *compositor;
+	struct output *output;
+	/* two fbs per plane to alternate between */
+	uint32_t fbs[COMPOSITOR_MAX_PLANES][2];
+	int iterations;
+};
+
+static void wait_flip(struct frame_bench *fb) {
+	struct pollfd pfd = {
+		.fd = fb->compositor->backend->fd,
+		.events = POLLIN,
+	};
+	while (fb->output->flip_pending) {
+		poll(&pfd, 1, -1);
+		compositor_handle_event(fb->compositor);
+	}
+}
+
+/* shows nplanes fullscreen planes and nothing on the others */
+static void setup_planes(struct frame_bench *fb, int nplanes) {
+	drmModeModeInfo *mode = fb->output->mode;
+	/* in pixels, the compositor turns src into 16.16 fixed point */
+	const struct plane_layout layout = {
+		.src_w = mode->hdisplay,
+		.src_h = mode->vdisplay,
+		.crtc_w = mode->hdisplay,
+		.crtc_h = mode->vdisplay,
+	};
+	for (int i = 0; i < fb->output->nplanes; i++) {
+		if (i >= nplanes) {
+			output_plane_disable(fb->output, i);
+			continue;
+		}
+		output_plane_set_layout(fb->output, i, &layout, false, 0,
+				0xFFFF);
+		output_plane_set_fb(fb->output, i, fb->fbs[i][0], -1);
+		output_plane_enable(fb->output, i);
+	}
+	int ret = output_draw(fb->output, false);
+	assert(ret == 0);
+	wait_flip(fb);
+}
+
+/* a new fb on each of nplanes planes every frame, with a small damage
+ * rectangle if damage is set */
+static void run_draw(struct frame_bench *fb, const char *name, int nplanes,
+		bool damage) {
+	struct output *output = fb->output;
+	const struct drm_mode_rect rect = { 64, 64, 128, 128 };
+
+	setup_planes(fb, nplanes);
+
+	struct bench bench;
+	bench_init(&bench, "frame", name, fb->iterations);
+	for (int i = 0; i < fb->iterations; i++) {
+		for (int j = 0; j < nplanes; j++) {
+			output_plane_set_fb(output, j, fb->fbs[j][i % 2], -1);
+			if (damage) {
+				output_plane_set_damage(output, j, &rect, 1);
+			}
+		}
+
+		uint64_t start = bench_now_ns();
+		int ret = output_draw(output, false);
+		bench_sample(&bench, bench_now_ns() - start);
+		assert(ret == 0);
+		wait_flip(fb);
+	}
+	bench_report(&bench);
+}
+
+/* the test commits the plane allocator makes while looking for a layout */
+static void run_test(struct frame_bench *fb, const char *name,
+		int nplanes) {
+	struct output *output = fb->output;
+
+	setup_planes(fb, nplanes);
+
+	struct bench bench;
+	bench_init(&bench, "frame", name, fb->iterations);
+	for (int i = 0; i < fb->iterations; i++) {
+		for (int j = 0; j < nplanes; j++) {
+			output_plane_set_fb(output, j, fb->fbs[j][i % 2], -1);
+		}
+
+		uint64_t start = bench_now_ns();
+		int ret = output_test(output);
+		bench_sample(&bench, bench_now_ns() - start);
+		assert(ret == 0);
+	}
+	bench_report(&bench);
+}
+
+int main(int argc, char *argv[]) {
+	struct frame_bench fb = {
+		.iterations = bench_iterations(argc, argv, 20000),
+	};
+
+	/* keep stdout to the results */
+	bench_quiet(true);
+	struct kms_backend *backend = kms_fake_create(FAKE_CONFIG);
+	assert(backend != NULL);
+	fb.compositor = compositor_create(backend);
+	fb.output = &fb.compositor->outputs[0];
+	bench_quiet(false);
+
+	drmModeModeInfo *mode = fb.output->mode;
+	uint32_t handles[4] = { 1 };
+	uint32_t strides[4] = { mode->hdisplay * 4 };
+	uint32_t offsets[4] = { 0 };
+	for (int i = 0; i < fb.output->nplanes; i++) {
+		for (int j = 0; j < 2; j++) {
+			int ret = backend->impl->add_fb(backend,
+					mode->hdisplay, mode->vdisplay,
+					DRM_FORMAT_ARGB8888, handles, strides,
+					offsets, &fb.fbs[i][j]);
+			assert(ret == 0);
+		}
+	}
+
+	int ret = output_draw(fb.output, true);
+	assert(ret == 0);
+	wait_flip(&fb);
+
+	/* nothing changed, only a vblank is waited for */
+	run_draw(&fb, "draw_idle", 0, false);
+
+	char name[32];
+	for (int n = 1; n <= fb.output->nplanes; n++) {
+		snprintf(name, sizeof(name), "draw_%d_planes", n);
+		run_draw(&fb, name, n, false);
+	}
+	snprintf(name, sizeof(name), "draw_%d_planes_damage",
+			fb.output->nplanes);
+	run_draw(&fb, name, fb.output->nplanes, true);
+	snprintf(name, sizeof(name), "test_%d_planes", fb.output->nplanes);
+	run_test(&fb, name, fb.output->nplanes);
+
+	return 0;
+}
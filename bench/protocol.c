@@ -0,0 +1,129 @@
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "libmpc-client.h"
+#include "protocol.h"
+
+/* stands in for the commit thread: every submission is presented as soon
+ * as it's latched, so a round trip is only protocol and scheduling */
+struct server_loop {
+	struct protocol_server server;
+	pthread_t thread;
+	bool stop;
+};
+
+static int import_buffer(void *data, uint32_t output,
+		const struct wire_import_dmabuf *dmabuf, const int *fds,
+		uint32_t *fb_id) {
+	return -1;
+}
+
+static void destroy_buffer(void *data, uint32_t output, uint32_t fb_id) {
+}
+
+static void present(struct protocol_server *server, uint32_t *sequence) {
+	bool latched = false;
+	int nclients = protocol_server_nclients(server);
+	for (int i = 0; i < nclients; i++) {
+		struct protocol_client_state *client =
+			protocol_server_client(server, i);
+		struct protocol_latch latch;
+		if (protocol_client_connected(client)
+				&& protocol_client_latch(client, &latch)) {
+			latched |= latch.submitted;
+		}
+	}
+	if (!latched) {
+		return;
+	}
+
+	struct wire_presentation presentation = {
+		.sequence = ++*sequence,
+		.timestamp_ns = bench_now_ns(),
+		.refresh_ns = 16666666,
+	};
+	protocol_server_frame_queued(server, 0, -1);
+	protocol_server_broadcast(server, 0, &presentation);
+}
+
+static void *server_thread(void *data) {
+	struct server_loop *loop = data;
+	struct protocol_server *server = &loop->server;
+	struct pollfd pfd = {
+		.fd = server->notify_fd,
+		.events = POLLIN,
+	};
+	uint32_t sequence = 0;
+
+	while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, 100) <= 0) {
+			continue;
+		}
+		protocol_server_dispatch(server);
+		present(server, &sequence);
+	}
+	return NULL;
+}
+
+/* set_framebuffer until the presentation of it came back */
+static void run_roundtrip(const char *path, const char *name, bool ring,
+		int iterations) {
+	struct mpc_display *display = ring
+		? mpc_display_connect_ring(path, 0)
+		: mpc_display_connect(path);
+	assert(display != NULL);
+
+	struct bench bench;
+	bench_init(&bench, "protocol", name, iterations);
+	for (int i = 0; i < iterations; i++) {
+		struct mpc_presentation presentation;
+		uint64_t start = bench_now_ns();
+		int ret = mpc_display_set_framebuffer(display, 1 + i % 2);
+		if (ret >= 0) {
+			ret = mpc_display_wait_presentation(display,
+					&presentation);
+		}
+		bench_sample(&bench, bench_now_ns() - start);
+		assert(ret >= 0);
+	}
+	bench_report(&bench);
+	/* there's no disconnect, the display stays idle until we exit */
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = bench_iterations(argc, argv, 20000);
+
+	char dir[] = "/tmp/mpc-bench-XXXXXX";
+	assert(mkdtemp(dir) != NULL);
+	char path[64];
+	snprintf(path, sizeof(path), "%s/mpc.sock", dir);
+
+	struct server_loop loop = { 0 };
+	const struct protocol_buffer_handler buffer_handler = {
+		.import = import_buffer,
+		.destroy = destroy_buffer,
+	};
+	bench_quiet(true);
+	int ret = protocol_server_init(&loop.server, path, 1,
+			&buffer_handler);
+	assert(ret != -1);
+	ret = protocol_server_start(&loop.server);
+	assert(ret != -1);
+	bench_quiet(false);
+	ret = pthread_create(&loop.thread, NULL, server_thread, &loop);
+	assert(ret == 0);
+
+	run_roundtrip(path, "roundtrip_socket", false, iterations);
+	run_roundtrip(path, "roundtrip_ring", true, iterations);
+
+	__atomic_store_n(&loop.stop, true, __ATOMIC_RELEASE);
+	pthread_join(loop.thread, NULL);
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
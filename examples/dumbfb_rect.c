@@ -13,7 +13,7 @@
 int main(int argc, char *argv[]) {
 	if (argc != 7) {
 		fprintf(stderr, "usage: %s <color> <x> <y> <width> <height> "
-				"<client_id>\n",
+				"<output>\n",
 				argv[0]);
 		return 1;
 	}
@@ -21,19 +21,30 @@ int main(int argc, char *argv[]) {
 	int drm_fd = open_drm_device();
 	assert(drm_fd != -1);
 
-	uint32_t client_id = strtoul(argv[6], NULL, 10);
-	struct mpc_display *display = mpc_display_connect("/home/pi/mpc.sock",
-			client_id);
+	int output = atoi(argv[6]);
+	struct mpc_display *display = mpc_display_connect_output(
+			"/home/pi/mpc.sock", output);
 	assert(display != NULL);
 
 	uint32_t color = strtoul(argv[1], NULL, 16);
 
+	/* only allocate the rectangle and let the plane position it */
+	struct mpc_rect src = {
+		.width = atol(argv[4]),
+		.height = atol(argv[5]),
+	};
+	struct mpc_rect dst = {
+		.x = atol(argv[2]),
+		.y = atol(argv[3]),
+		.width = src.width,
+		.height = src.height,
+	};
+	assert(mpc_display_set_geometry(display, &src, &dst) != -1);
+
 	struct dumb_fb fb;
-	dumb_fb_init(&fb, drm_fd, DRM_FORMAT_ARGB8888, 720, 576);
-	dumb_fb_fill(&fb, drm_fd, 0x00000000);
+	dumb_fb_init(&fb, drm_fd, DRM_FORMAT_ARGB8888, src.width, src.height);
 	printf("%x\n", color);
-	dumb_fb_draw_rect(&fb, drm_fd, color, atol(argv[2]), atol(argv[3]),
-			atol(argv[4]), atol(argv[5]));
+	dumb_fb_fill(&fb, drm_fd, color);
 
 	while (true) {
 		assert(mpc_display_set_framebuffer(display, fb.fb_id) != -1);
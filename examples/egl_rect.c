@@ -2,9 +2,11 @@
 #include <gbm.h>
 #include <inttypes.h>
 #include <libmpc-client.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <xf86drmMode.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
@@ -38,56 +40,82 @@ static void init_gbm(int drm_fd, int w, int h, uint32_t format) {
 	}
 }
 
-void drm_fb_destroy_callback(struct gbm_bo *bo, void *fb) {
-	uint32_t fb_id = *((uint32_t *) fb);
-	drmModeRmFB(gbm_device_get_fd(gbm.dev), fb_id);
-	free(fb);
-}
+static struct mpc_display *mpc;
+
+struct bo_buffer {
+	uint32_t buffer_id;
+};
 
-uint32_t drm_fb_get_from_bo(struct gbm_bo *bo) {
-	int drm_fd = gbm_device_get_fd(gbm_bo_get_device(bo));
-	uint32_t *bo_fb = gbm_bo_get_user_data(bo);
-	uint32_t width, height, format,
-		 strides[4] = {0}, handles[4] = {0},
-		 offsets[4] = {0}, flags = 0;
-	int ret = -1;
+void bo_buffer_destroy_callback(struct gbm_bo *bo, void *data) {
+	struct bo_buffer *buffer = data;
+	mpc_display_destroy_buffer(mpc, buffer->buffer_id);
+	free(buffer);
+}
 
-	if (bo_fb) {
-		return *bo_fb;
+/* imports the bo into the compositor the first time it is seen, gbm
+ * surfaces cycle through the same few bos so this happens once each */
+uint32_t buffer_get_from_bo(struct gbm_bo *bo) {
+	struct bo_buffer *buffer = gbm_bo_get_user_data(bo);
+	if (buffer) {
+		return buffer->buffer_id;
 	}
-	bo_fb = malloc(sizeof(uint32_t));
-
-	width = gbm_bo_get_width(bo);
-	height = gbm_bo_get_height(bo);
-	format = gbm_bo_get_format(bo);
-
-	uint64_t modifiers[4] = {0};
-	modifiers[0] = gbm_bo_get_modifier(bo);
-	const int num_planes = gbm_bo_get_plane_count(bo);
-	for (int i = 0; i < num_planes; i++) {
-		handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
-		strides[i] = gbm_bo_get_stride_for_plane(bo, i);
-		offsets[i] = gbm_bo_get_offset(bo, i);
-		modifiers[i] = modifiers[0];
+
+	struct mpc_dmabuf dmabuf = {
+		.width = gbm_bo_get_width(bo),
+		.height = gbm_bo_get_height(bo),
+		.format = gbm_bo_get_format(bo),
+		.modifier = gbm_bo_get_modifier(bo),
+		.num_planes = gbm_bo_get_plane_count(bo),
+	};
+	for (int i = 0; i < dmabuf.num_planes; i++) {
+		dmabuf.fds[i] = gbm_bo_get_fd_for_plane(bo, i);
+		dmabuf.strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+		dmabuf.offsets[i] = gbm_bo_get_offset(bo, i);
 	}
+	printf("Using modifier %" PRIx64 "\n", dmabuf.modifier);
 
-	if (modifiers[0]) {
-		flags = DRM_MODE_FB_MODIFIERS;
-		printf("Using modifier %" PRIx64 "\n", modifiers[0]);
+	int buffer_id = mpc_display_import_dmabuf(mpc, &dmabuf);
+	for (int i = 0; i < dmabuf.num_planes; i++) {
+		close(dmabuf.fds[i]);
+	}
+	if (buffer_id < 0) {
+		fprintf(stderr, "failed to import buffer\n");
+		exit(EXIT_FAILURE);
 	}
 
-	ret = drmModeAddFB2WithModifiers(drm_fd, width, height,
-			format, handles, strides, offsets,
-			modifiers, bo_fb, flags);
+	buffer = malloc(sizeof(struct bo_buffer));
+	buffer->buffer_id = buffer_id;
+	gbm_bo_set_user_data(bo, buffer, bo_buffer_destroy_callback);
 
-	if (ret) {
-		perror("failed to create fb: %s\n");
-		return -1;
+	return buffer->buffer_id;
+}
+
+/* bos locked from the gbm surface until the compositor releases them */
+#define MAX_LOCKED_BOS 4
+static struct gbm_bo *locked_bos[MAX_LOCKED_BOS];
+
+static void lock_bo(struct gbm_bo *bo) {
+	for (int i = 0; i < MAX_LOCKED_BOS; i++) {
+		if (locked_bos[i] == NULL || locked_bos[i] == bo) {
+			locked_bos[i] = bo;
+			return;
+		}
 	}
+	assert(!"too many locked bos");
+}
 
-	gbm_bo_set_user_data(bo, bo_fb, drm_fb_destroy_callback);
+static void release_bo(void *data, uint32_t buffer_id) {
+	for (int i = 0; i < MAX_LOCKED_BOS; i++) {
+		if (locked_bos[i] == NULL) {
+			continue;
+		}
 
-	return *bo_fb;
+		struct bo_buffer *buffer = gbm_bo_get_user_data(locked_bos[i]);
+		if (buffer->buffer_id == buffer_id) {
+			gbm_surface_release_buffer(gbm.surface, locked_bos[i]);
+			locked_bos[i] = NULL;
+		}
+	}
 }
 
 static struct egl {
@@ -95,6 +123,10 @@ static struct egl {
 	EGLConfig config;
 	EGLContext context;
 	EGLSurface surface;
+
+	PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+	PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+	PFNEGLDUPNATIVEFENCEFDANDROIDPROC eglDupNativeFenceFDANDROID;
 } egl;
 
 static void init_egl() {
@@ -137,6 +169,46 @@ static void init_egl() {
 	egl.surface = eglCreateWindowSurface(egl.display, egl.config,
 			gbm.surface, NULL);
 	assert(egl.surface != EGL_NO_SURFACE);
+
+	const char *extensions = eglQueryString(egl.display, EGL_EXTENSIONS);
+	if (strstr(extensions, "EGL_ANDROID_native_fence_sync")) {
+		egl.eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)
+			eglGetProcAddress("eglCreateSyncKHR");
+		egl.eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)
+			eglGetProcAddress("eglDestroySyncKHR");
+		egl.eglDupNativeFenceFDANDROID =
+			(PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
+			eglGetProcAddress("eglDupNativeFenceFDANDROID");
+	} else {
+		printf("no native fence support, the compositor may show "
+				"unfinished frames\n");
+	}
+}
+
+/* inserts a native fence after the commands submitted so far, returns
+ * EGL_NO_SYNC_KHR if unsupported */
+static EGLSyncKHR create_fence(void) {
+	if (egl.eglCreateSyncKHR == NULL) {
+		return EGL_NO_SYNC_KHR;
+	}
+
+	static const EGLint attribs[] = {
+		EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+		EGL_NONE,
+	};
+	return egl.eglCreateSyncKHR(egl.display, EGL_SYNC_NATIVE_FENCE_ANDROID,
+			attribs);
+}
+
+static int fence_to_fd(EGLSyncKHR sync) {
+	if (sync == EGL_NO_SYNC_KHR) {
+		return -1;
+	}
+
+	/* the fence fd only exists once the commands have been flushed */
+	int fd = egl.eglDupNativeFenceFDANDROID(egl.display, sync);
+	egl.eglDestroySyncKHR(egl.display, sync);
+	return fd;
 }
 
 static const char *vert_shader_text =
@@ -250,14 +322,15 @@ void gl_render_draw(void) {
 
 int main(int argc, char *argv[]) {
 	if (argc != 2) {
-		fprintf(stderr, "usage: %s <client_id>\n", argv[0]);
+		fprintf(stderr, "usage: %s <output>\n", argv[0]);
 		return 1;
 	}
 
-	uint32_t client_id = strtoul(argv[6], NULL, 10);
+	int output = atoi(argv[1]);
 
-	struct mpc_display *mpc = mpc_display_connect("/home/pi/mpc.sock", client_id);
-	int drmfd = open_drm_device();
+	mpc = mpc_display_connect_output("/home/pi/mpc.sock", output);
+	assert(mpc != NULL);
+	int drmfd = open_render_device();
 	init_gbm(drmfd, 720, 576, GBM_FORMAT_ARGB8888);
 
 	eglBindAPI(EGL_OPENGL_ES2_BIT);
@@ -266,19 +339,37 @@ int main(int argc, char *argv[]) {
 	eglMakeCurrent(egl.display, egl.surface, egl.surface, egl.context);
 	gl_render_init();
 
-	struct gbm_bo *bo = NULL;
+	mpc_display_set_release_handler(mpc, release_bo, NULL);
+
+	bool frame_queued = false;
 	while (1) {
+		/* render ahead into a free buffer while one frame is queued
+		 * and another one is on screen */
+		while (!gbm_surface_has_free_buffers(gbm.surface)) {
+			mpc_display_dispatch(mpc);
+		}
+
 		gl_render_draw();
 
+		/* submit as soon as the commands are queued, the compositor
+		 * waits for the gpu through the fence instead of us */
+		EGLSyncKHR sync = create_fence();
 		eglSwapBuffers(egl.display, egl.surface);
+		int fence = fence_to_fd(sync);
 
-		struct gbm_bo *next_bo = gbm_surface_lock_front_buffer(gbm.surface);
-		mpc_display_set_framebuffer(mpc, drm_fb_get_from_bo(next_bo));
-		mpc_display_wait_sync(mpc);
+		struct gbm_bo *bo = gbm_surface_lock_front_buffer(gbm.surface);
+		uint32_t buffer_id = buffer_get_from_bo(bo);
+		lock_bo(bo);
 
-		if (bo) {
-			gbm_surface_release_buffer(gbm.surface, bo);
+		/* keep at most one frame queued, so we don't render frames
+		 * that replace each other before ever being shown */
+		if (frame_queued) {
+			mpc_display_wait_sync(mpc);
+		}
+		mpc_display_attach_buffer(mpc, buffer_id, fence);
+		frame_queued = true;
+		if (fence >= 0) {
+			close(fence);
 		}
-		bo = next_bo;
 	}
 }
@@ -0,0 +1,31 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* blends a row of premultiplied ARGB8888 pixels over dst, after scaling
+ * them by alpha. opaque sources (XRGB8888) have their alpha byte ignored.
+ * all kernels round the same way and produce identical results */
+typedef void (*blend_row_func)(uint32_t *dst, const uint32_t *src,
+		int width, uint8_t alpha, bool opaque);
+
+void blend_row_scalar(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque);
+#if defined(__x86_64__) || defined(__i386__)
+#define BLEND_HAVE_X86
+void blend_row_sse2(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque);
+void blend_row_avx2(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque);
+#endif
+#if defined(__ARM_NEON)
+#define BLEND_HAVE_NEON
+void blend_row_neon(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque);
+#endif
+
+/* the fastest kernel the cpu we're running on supports */
+blend_row_func blend_row_select(void);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "compositor.h"
+
+#define CAPTURE_BUFFERS 3
+
+/* a framebuffer the writeback connector copies a frame into */
+struct capture_buffer {
+	uint32_t handle;
+	uint32_t fb_id;
+	void *map;
+	size_t size;
+
+	/* where the planes are, written out as rows of row_size bytes */
+	int nplanes;
+	uint32_t offsets[4];
+	uint32_t strides[4];
+	uint32_t row_sizes[3];
+	uint32_t rows[3];
+
+	/* signalled once the frame is complete, or -1 */
+	int fence;
+};
+
+/* streams what an output shows into a file or pipe. the kernel copies every
+ * commit into one of a few rotating buffers through the output's writeback
+ * connector and a thread of ours writes them out, so the commit thread never
+ * touches the pixels. frames are raw XRGB8888, or YUV 4:2:0 in a y4m stream
+ * if the path ends in .y4m, and there's one per commit */
+struct capture {
+	struct kms_backend *backend;
+	struct output *output;
+	FILE *file;
+	bool y4m;
+
+	struct capture_buffer buffers[CAPTURE_BUFFERS];
+	/* the buffer the next commit is written into, or -1 */
+	int attached;
+
+	pthread_t thread;
+	/* protects everything below */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* bit n is set if buffer n can take another frame */
+	uint32_t free_buffers;
+	/* the buffers waiting to be written out, oldest first */
+	int queue[CAPTURE_BUFFERS];
+	int queue_start;
+	int queue_len;
+	/* writing failed, nothing more is captured */
+	bool failed;
+
+	uint64_t frames;
+	/* commits that went by while every buffer was busy */
+	uint64_t dropped;
+};
+
+struct capture *capture_create(struct output *output, const char *path);
+
+void capture_prepare(struct capture *capture);
+void capture_frame_queued(struct capture *capture);
+
+#endif
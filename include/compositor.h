@@ -1,39 +1,247 @@
 #ifndef COMPOSITOR_H
 #define COMPOSITOR_H
 
+#include <stdbool.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "kms_backend.h"
+
+#define COMPOSITOR_MAX_OUTPUTS 4
 #define COMPOSITOR_MAX_PLANES 8
 #define COMPOSITOR_MAX_LAYERS COMPOSITOR_MAX_PLANES
 
+enum plane_prop {
+	PLANE_PROP_FB_ID,
+	PLANE_PROP_CRTC_ID,
+	PLANE_PROP_SRC_X,
+	PLANE_PROP_SRC_Y,
+	PLANE_PROP_SRC_W,
+	PLANE_PROP_SRC_H,
+	PLANE_PROP_CRTC_X,
+	PLANE_PROP_CRTC_Y,
+	PLANE_PROP_CRTC_W,
+	PLANE_PROP_CRTC_H,
+	PLANE_PROP_ZPOS,
+	PLANE_PROP_ALPHA,
+	PLANE_PROP_IN_FENCE_FD,
+	PLANE_PROP_FB_DAMAGE_CLIPS,
+	/* immutable, only read at startup */
+	PLANE_PROP_TYPE,
+	PLANE_PROP_IN_FORMATS,
+	PLANE_PROP_COUNT,
+};
+
+#define PLANE_INFO_PROPS ((1 << PLANE_PROP_TYPE) | (1 << PLANE_PROP_IN_FORMATS))
+
+enum crtc_prop {
+	CRTC_PROP_MODE_ID,
+	CRTC_PROP_ACTIVE,
+	CRTC_PROP_OUT_FENCE_PTR,
+	CRTC_PROP_VRR_ENABLED,
+	CRTC_PROP_COUNT,
+};
+
+enum connector_prop {
+	CONNECTOR_PROP_CRTC_ID,
+	/* immutable, only read at startup */
+	CONNECTOR_PROP_VRR_CAPABLE,
+	CONNECTOR_PROP_COUNT,
+};
+
+enum writeback_prop {
+	WRITEBACK_PROP_CRTC_ID,
+	WRITEBACK_PROP_FB_ID,
+	WRITEBACK_PROP_OUT_FENCE_PTR,
+	/* immutable, only read at startup */
+	WRITEBACK_PROP_PIXEL_FORMATS,
+	WRITEBACK_PROP_COUNT,
+};
+
+/* names of the properties on the device, indexed by the enums above */
+extern const char *const plane_prop_names[PLANE_PROP_COUNT];
+extern const char *const crtc_prop_names[CRTC_PROP_COUNT];
+extern const char *const connector_prop_names[CONNECTOR_PROP_COUNT];
+extern const char *const writeback_prop_names[WRITEBACK_PROP_COUNT];
+
+struct compositor_dmabuf {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+
+	int num_planes;
+	int fds[4];
+	uint32_t strides[4];
+	uint32_t offsets[4];
+};
+
+/* where a plane shows its framebuffer, in pixels. a zero src or crtc size
+ * means the size of the mode */
+struct plane_layout {
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+
+	int32_t crtc_x;
+	int32_t crtc_y;
+	uint32_t crtc_w;
+	uint32_t crtc_h;
+};
+
+struct plane_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+struct plane_state {
+	uint64_t values[PLANE_PROP_COUNT];
+};
+
 struct plane {
-	drmModePlane *plane;
-	drmModeObjectProperties *props;
-	drmModePropertyRes **props_info;
+	uint32_t plane_id;
+	/* DRM_PLANE_TYPE_* */
+	uint32_t type;
+	int nformats;
+	struct plane_format *formats;
+
+	/* property ids resolved at startup, indexed by enum plane_prop.
+	 * bit n of missing_props is set if property n doesn't exist */
+	uint32_t prop_ids[PLANE_PROP_COUNT];
+	uint32_t missing_props;
 
 	int fb;
+	struct plane_layout layout;
 	int zpos;
+	int default_zpos;
+	int zpos_min;
+	int zpos_max;
+	uint16_t alpha;
+	/* sync_file the commit has to wait for before scanning out fb, owned
+	 * by the plane and closed once committed. -1 if none. it goes to the
+	 * kernel as IN_FENCE_FD, a plane without that property never holds
+	 * one: output_plane_set_fb waits for the fence instead */
+	int in_fence;
+	/* blob of the drm_mode_rects of fb that changed since the plane was
+	 * last committed, destroyed once committed. 0 if all of it did */
+	uint32_t damage_blob;
+
+	/* what the next commit should contain, and what the kernel accepted
+	 * last. bit n of stale_props is set if committed value n is unknown */
+	struct plane_state pending;
+	struct plane_state committed;
+	uint32_t stale_props;
 };
 
-struct compositor {
-	int fd;
+/* a writeback connector, which copies what a crtc scans out into a
+ * framebuffer of ours */
+struct writeback {
+	uint32_t connector_id;
+	uint32_t prop_ids[WRITEBACK_PROP_COUNT];
+	uint32_t missing_props;
+	/* the formats it can write */
+	int nformats;
+	uint32_t *formats;
+
+	/* attached to the crtc by the initial modeset */
+	bool enabled;
+	/* written by the next commit and reset once that went through, 0 if
+	 * nothing is to be captured */
+	uint32_t fb;
+	/* sync_file signalled when the last capture is complete, filled in by
+	 * the kernel through WRITEBACK_OUT_FENCE_PTR. -1 if none */
+	int32_t out_fence;
+};
+
+/* a connector and the crtc driving it. every output has its own planes and
+ * commits on its own vblank */
+struct output {
+	/* the device, shared by all outputs */
+	struct kms_backend *backend;
+	int index;
 
 	uint32_t connector_id;
 	drmModeModeInfo *mode;
 	uint32_t crtc_id;
 
 	uint32_t crtc_index;
+	/* the same for every crtc of the device */
+	uint32_t cursor_width;
+	uint32_t cursor_height;
+
+	uint32_t crtc_prop_ids[CRTC_PROP_COUNT];
+	uint32_t crtc_missing_props;
+	uint32_t connector_prop_ids[CONNECTOR_PROP_COUNT];
+	uint32_t connector_missing_props;
+
+	/* the display can vary its refresh rate. if vrr is set before the
+	 * initial modeset it does, and a flip comes as soon as its commit
+	 * instead of on the next vblank, but never sooner than refresh_ns
+	 * after the last one */
+	bool vrr_capable;
+	bool vrr;
+
+	/* set while waiting for the page-flip (or vblank, if nothing was
+	 * committed) event of the last frame */
+	bool flip_pending;
+	/* vblank sequence and CLOCK_MONOTONIC time of the last flip */
+	uint32_t flip_sequence;
+	uint64_t flip_time_ns;
+	uint32_t refresh_ns;
+	/* CLOCK_MONOTONIC time the last commit call started and returned,
+	 * both 0 if the last frame needed no commit */
+	uint64_t commit_start_ns;
+	uint64_t commit_end_ns;
+
+	/* sync_file signalled when the last commit hits the screen, filled
+	 * in by the kernel through OUT_FENCE_PTR. -1 if none */
+	int32_t out_fence;
+
+	/* NULL if there's no writeback connector for the crtc */
+	struct writeback *writeback;
 
 	uint32_t enabled_planes;
 	int nplanes;
 	struct plane planes[COMPOSITOR_MAX_PLANES];
 };
 
-struct compositor *compositor_create();
-void compositor_draw(struct compositor *compositor, bool modeset);
+struct compositor {
+	struct kms_backend *backend;
+
+	int noutputs;
+	struct output outputs[COMPOSITOR_MAX_OUTPUTS];
+};
+
+struct compositor *compositor_create(struct kms_backend *backend);
+uint32_t compositor_handle_event(struct compositor *compositor);
+
+int compositor_import_dmabuf(struct compositor *compositor,
+		const struct compositor_dmabuf *dmabuf, uint32_t *fb_id);
+void compositor_destroy_fb(struct compositor *compositor, uint32_t fb_id);
+
+bool plane_supports_format(const struct plane *plane, uint32_t format,
+		uint64_t modifier);
+
+int output_draw(struct output *output, bool modeset);
+int output_test(struct output *output);
+
+bool writeback_supports_format(const struct writeback *writeback,
+		uint32_t format);
+int output_enable_writeback(struct output *output);
+int output_enable_vrr(struct output *output);
+void output_set_writeback_fb(struct output *output, uint32_t fb);
 
-void compositor_plane_enable(struct compositor *compositor, uint32_t idx);
-void compositor_plane_disable(struct compositor *compositor, uint32_t idx);
+void output_plane_set_fb(struct output *output, uint32_t idx, uint32_t fb,
+		int in_fence);
+int output_plane_take_fence(struct output *output, uint32_t idx);
+void output_plane_set_damage(struct output *output, uint32_t idx,
+		const struct drm_mode_rect *rects, int nrects);
+void output_plane_set_layout(struct output *output, uint32_t idx,
+		const struct plane_layout *layout, bool has_zpos, int zpos,
+		uint16_t alpha);
+void output_plane_enable(struct output *output, uint32_t idx);
+void output_plane_disable(struct output *output, uint32_t idx);
+void output_revert(struct output *output);
 
 #endif
@@ -0,0 +1,80 @@
+#ifndef CPU_COMPOSITE_H
+#define CPU_COMPOSITE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blend.h"
+#include "compositor.h"
+#include "kms_backend.h"
+
+/* a client buffer mapped for reading by the cpu */
+struct cpu_buffer {
+	uint32_t fb_id;
+	/* dmabuf the mapping belongs to, for cache syncs */
+	int fd;
+	void *map;
+	size_t size;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t offset;
+	bool opaque;
+};
+
+/* one client to blend, in the same terms a plane would show it */
+struct cpu_layer {
+	uint32_t fb_id;
+	struct plane_layout layout;
+	uint16_t alpha;
+};
+
+/* blends the clients that didn't get a hardware plane into buffers of the
+ * compositor's own, shown on a single plane instead */
+struct cpu_composite {
+	struct kms_backend *backend;
+	uint32_t width;
+	uint32_t height;
+	blend_row_func blend_row;
+
+	/* double buffered, one is scanned out while the other is drawn */
+	struct kms_dumb fbs[2];
+	uint32_t fb_ids[2];
+	int back;
+	/* what the last draw updated, in the current front buffer */
+	struct drm_mode_rect last_damage;
+
+	/* what's being drawn, copied to the back buffer when done */
+	uint32_t *shadow;
+	/* a row of scaled source pixels */
+	uint32_t *scratch;
+
+	/* buffers are mapped on the protocol thread, which may move the
+	 * array, and unmapped on the commit thread. a draw only takes the
+	 * lock to copy out the buffers of its layers, the mappings stay
+	 * until the draw's own thread unmaps them */
+	pthread_mutex_t lock;
+	int nbuffers;
+	struct cpu_buffer *buffers;
+	/* the buffers of the layers being drawn, map NULL if one isn't
+	 * mapped */
+	int nresolved;
+	struct cpu_buffer *resolved;
+};
+
+struct cpu_composite *cpu_composite_create(struct kms_backend *backend,
+		uint32_t width, uint32_t height);
+uint32_t cpu_composite_front(struct cpu_composite *composite);
+void cpu_composite_discard(struct cpu_composite *composite);
+
+int cpu_composite_map(struct cpu_composite *composite, uint32_t fb_id,
+		const struct compositor_dmabuf *dmabuf);
+void cpu_composite_unmap(struct cpu_composite *composite, uint32_t fb_id);
+
+uint32_t cpu_composite_draw(struct cpu_composite *composite,
+		struct cpu_layer *layers, int nlayers,
+		struct drm_mode_rect *damage);
+
+#endif
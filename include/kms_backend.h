@@ -0,0 +1,102 @@
+#ifndef KMS_BACKEND_H
+#define KMS_BACKEND_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* enough for every property of a crtc, its connectors and all its planes */
+#define KMS_REQUEST_MAX_PROPS 256
+
+struct compositor;
+struct compositor_dmabuf;
+
+struct kms_prop_value {
+	uint32_t object_id;
+	uint32_t prop_id;
+	uint64_t value;
+};
+
+/* an atomic request, built by the compositor and read by the backends */
+struct kms_request {
+	int nprops;
+	struct kms_prop_value props[KMS_REQUEST_MAX_PROPS];
+};
+
+/* a mapped dumb buffer */
+struct kms_dumb {
+	uint32_t handle;
+	uint32_t pitch;
+	uint64_t size;
+	void *map;
+};
+
+struct kms_backend;
+
+/* everything the compositor asks of the display device. the calls work
+ * like their libdrm counterparts and return negative errnos. all of them
+ * come from the commit thread, except import_dmabuf */
+struct kms_backend_impl {
+	/* finds the outputs and planes of the device and fills them into
+	 * the compositor */
+	int (*discover)(struct kms_backend *backend,
+			struct compositor *compositor);
+
+	/* DRM_MODE_PAGE_FLIP_EVENT and vblank events carry user_data and
+	 * are delivered by handle_event */
+	int (*commit)(struct kms_backend *backend,
+			const struct kms_request *req, uint32_t flags,
+			void *user_data);
+	int (*wait_vblank)(struct kms_backend *backend, uint32_t crtc_index,
+			void *user_data);
+	int (*handle_event)(struct kms_backend *backend,
+			drmEventContext *context);
+
+	int (*create_blob)(struct kms_backend *backend, const void *data,
+			size_t size, uint32_t *blob_id);
+	void (*destroy_blob)(struct kms_backend *backend, uint32_t blob_id);
+
+	/* the fds stay owned by the caller. called from the protocol thread
+	 * while the commit thread may be committing, so the fbs it adds
+	 * have to be safe to look up concurrently */
+	int (*import_dmabuf)(struct kms_backend *backend,
+			const struct compositor_dmabuf *dmabuf,
+			uint32_t *fb_id);
+	int (*create_dumb)(struct kms_backend *backend, uint32_t width,
+			uint32_t height, uint32_t bpp, struct kms_dumb *dumb);
+	/* unmaps it too */
+	void (*destroy_dumb)(struct kms_backend *backend,
+			const struct kms_dumb *dumb);
+	int (*add_fb)(struct kms_backend *backend, uint32_t width,
+			uint32_t height, uint32_t format,
+			const uint32_t handles[4], const uint32_t strides[4],
+			const uint32_t offsets[4], uint32_t *fb_id);
+	void (*destroy_fb)(struct kms_backend *backend, uint32_t fb_id);
+};
+
+struct kms_backend {
+	const struct kms_backend_impl *impl;
+	/* polled, readable when handle_event has something to deliver */
+	int fd;
+};
+
+/* returns -ENOSPC if the request is full */
+static inline int kms_request_add(struct kms_request *req,
+		uint32_t object_id, uint32_t prop_id, uint64_t value) {
+	if (req->nprops == KMS_REQUEST_MAX_PROPS) {
+		return -ENOSPC;
+	}
+	req->props[req->nprops++] = (struct kms_prop_value) {
+		.object_id = object_id,
+		.prop_id = prop_id,
+		.value = value,
+	};
+	return 0;
+}
+
+struct kms_backend *kms_drm_create(void);
+struct kms_backend *kms_fake_create(const char *config);
+
+#endif
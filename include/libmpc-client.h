@@ -1,10 +1,174 @@
 #ifndef LIBMPC_CLIENT_H
 #define LIBMPC_CLIENT_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MPC_BUFFER_POOL_MAX 8
+
 struct mpc_display;
+struct mpc_buffer_pool;
+
+/* called when the compositor stops using buffer_id */
+typedef void (*mpc_release_handler)(void *data, uint32_t buffer_id);
+
+/* a dmabuf to be shown by the compositor, one fd per plane (they may all
+ * be the same fd). modifier is DRM_FORMAT_MOD_INVALID for implicit ones */
+struct mpc_dmabuf {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+
+	int num_planes;
+	int fds[4];
+	uint32_t strides[4];
+	uint32_t offsets[4];
+};
+
+/* a zero width or height means the size of the display */
+struct mpc_rect {
+	int32_t x;
+	int32_t y;
+	uint32_t width;
+	uint32_t height;
+};
 
-struct mpc_display *mpc_display_connect(const char *path, int client_id);
+struct mpc_vblank {
+	/* vblank sequence number and CLOCK_MONOTONIC time */
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+	uint32_t refresh_ns;
+	/* the compositor didn't see this vblank, because nothing changed on
+	 * the output. its time is extrapolated from the last one it saw */
+	bool predicted;
+};
+
+#define MPC_COMMIT_BUFFER (1 << 0)
+#define MPC_COMMIT_FRAMEBUFFER (1 << 1)
+#define MPC_COMMIT_GEOMETRY (1 << 2)
+#define MPC_COMMIT_ZPOS (1 << 3)
+#define MPC_COMMIT_ALPHA (1 << 4)
+
+/* changes to make together, picked by flags. the rest stays as it is */
+struct mpc_commit {
+	uint32_t flags;
+	/* an imported buffer for MPC_COMMIT_BUFFER, a kms fb_id for
+	 * MPC_COMMIT_FRAMEBUFFER (not both). see the framebuffer calls for
+	 * fence_fd (-1 if none) and damage */
+	uint32_t buffer_id;
+	int fence_fd;
+	const struct mpc_rect *damage;
+	int ndamage;
+	/* MPC_COMMIT_GEOMETRY, see mpc_display_set_geometry */
+	struct mpc_rect src;
+	struct mpc_rect dst;
+	/* MPC_COMMIT_ZPOS and MPC_COMMIT_ALPHA, see mpc_display_set_zpos and
+	 * mpc_display_set_alpha */
+	int zpos;
+	uint16_t alpha;
+};
+
+struct mpc_presentation {
+	/* the buffer of this client that was shown, an fb_id for buffers
+	 * passed to mpc_display_set_framebuffer */
+	uint32_t buffer_id;
+	/* vblank sequence number and CLOCK_MONOTONIC time of the flip */
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+	/* duration of one refresh cycle, the next vblank is expected at
+	 * timestamp_ns + refresh_ns. on a display with variable refresh
+	 * it's the shortest one */
+	uint32_t refresh_ns;
+	/* the frame was dropped and never reached the screen */
+	bool discarded;
+};
+
+struct mpc_display *mpc_display_connect(const char *path);
+/* like mpc_display_connect, but shows the client on the given output (in
+ * the order the compositor found them) instead of the first one */
+struct mpc_display *mpc_display_connect_output(const char *path, int output);
+/* like mpc_display_connect_output, but requests and events go through
+ * rings in memory shared with the compositor. each side only makes a
+ * syscall to wake the other one up if it sleeps. requests fail with EAGAIN
+ * while the compositor is too far behind to take more */
+struct mpc_display *mpc_display_connect_ring(const char *path, int output);
+/* the id the compositor assigned to the client when it connected */
+uint32_t mpc_display_get_client_id(struct mpc_display *display);
 int mpc_display_set_framebuffer(struct mpc_display *display, int fb_id);
+/* like mpc_display_set_framebuffer, but the compositor won't scan fb_id out
+ * before the sync_file fence_fd signals. fence_fd stays owned by the caller */
+int mpc_display_set_framebuffer_fenced(struct mpc_display *display, int fb_id,
+		int fence_fd);
+/* like mpc_display_set_framebuffer_fenced, damage lists the parts of the
+ * framebuffer that changed since the last one was set, in its pixels. the
+ * compositor and the display can skip updating anything else. no damage
+ * means all of it changed */
+int mpc_display_set_framebuffer_damage(struct mpc_display *display,
+		int fb_id, int fence_fd, const struct mpc_rect *damage,
+		int ndamage);
+/* registers a dmabuf with the compositor, which imports it once. returns
+ * the buffer id to pass to mpc_display_attach_buffer or -1. the fds stay
+ * owned by the caller */
+int mpc_display_import_dmabuf(struct mpc_display *display,
+		const struct mpc_dmabuf *dmabuf);
+/* shows an imported buffer from the next frame on, see
+ * mpc_display_set_framebuffer_fenced for fence_fd */
+int mpc_display_attach_buffer(struct mpc_display *display, uint32_t buffer_id,
+		int fence_fd);
+/* like mpc_display_attach_buffer, see mpc_display_set_framebuffer_damage
+ * for damage */
+int mpc_display_attach_buffer_damage(struct mpc_display *display,
+		uint32_t buffer_id, int fence_fd, const struct mpc_rect *damage,
+		int ndamage);
+int mpc_display_destroy_buffer(struct mpc_display *display,
+		uint32_t buffer_id);
+/* shows the src part of the client's buffers at dst on the display, so
+ * buffers only need to be as large as what they show. src must not be
+ * negative. takes effect with the next frame */
+int mpc_display_set_geometry(struct mpc_display *display,
+		const struct mpc_rect *src, const struct mpc_rect *dst);
+/* stacking order relative to other clients, clamped to what the plane
+ * supports */
+int mpc_display_set_zpos(struct mpc_display *display, int zpos);
+/* plane opacity from 0 (transparent) to 0xffff (opaque), ignored if the
+ * plane has no alpha property */
+int mpc_display_set_alpha(struct mpc_display *display, uint16_t alpha);
+/* sends everything in commit as one message. the compositor shows all of
+ * it from the same frame on, or none of it if it is malformed. the calls
+ * above are each a commit of a single change */
+int mpc_display_commit(struct mpc_display *display,
+		const struct mpc_commit *commit);
+/* the latest vblank of the client's output, read from memory the
+ * compositor updates after every flip. costs no syscall */
+void mpc_display_get_vblank(struct mpc_display *display,
+		struct mpc_vblank *vblank);
+/* sleeps on a futex in that memory until the vblank after the one
+ * numbered sequence, for clients that only need pacing. if the compositor
+ * doesn't see it, returns the first vblank after the call predicted from
+ * the last one, once it is due */
+int mpc_display_wait_vblank(struct mpc_display *display, uint32_t sequence,
+		struct mpc_vblank *vblank);
+/* waits until the last submitted framebuffer was presented */
+int mpc_display_wait_presentation(struct mpc_display *display,
+		struct mpc_presentation *presentation);
 int mpc_display_wait_sync(struct mpc_display *display);
+/* returns the newest out fence (a sync_file signalled when the commit that
+ * latched this client's framebuffer is on screen) and transfers its ownership
+ * to the caller, or -1 if none arrived since the last call */
+int mpc_display_take_out_fence(struct mpc_display *display);
+/* blocks until one event from the compositor was read and handled */
+int mpc_display_dispatch(struct mpc_display *display);
+void mpc_display_set_release_handler(struct mpc_display *display,
+		mpc_release_handler handler, void *data);
+
+/* tracks which of a client's buffers it may render into, using the
+ * compositor's release events. it installs its own release handler */
+struct mpc_buffer_pool *mpc_buffer_pool_create(struct mpc_display *display);
+void mpc_buffer_pool_destroy(struct mpc_buffer_pool *pool);
+int mpc_buffer_pool_add(struct mpc_buffer_pool *pool, uint32_t buffer_id);
+/* returns a buffer that is neither queued nor on screen, blocking until one
+ * is released if needed, or -1. the buffer must be submitted afterwards */
+int64_t mpc_buffer_pool_acquire(struct mpc_buffer_pool *pool);
 
 #endif
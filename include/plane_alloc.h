@@ -0,0 +1,60 @@
+#ifndef PLANE_ALLOC_H
+#define PLANE_ALLOC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compositor.h"
+
+#define PLANE_ALLOC_CACHE_SIZE 8
+/* upper bound of TEST_ONLY commits a single search may issue */
+#define PLANE_ALLOC_MAX_TESTS 32
+
+/* what a client wants on screen, as far as choosing a plane is concerned */
+struct plane_alloc_client {
+	/* the client has a framebuffer to show */
+	bool active;
+	uint32_t fb;
+	/* fourcc and modifier of fb, format 0 if unknown */
+	uint32_t format;
+	uint64_t modifier;
+
+	struct plane_layout layout;
+	bool has_zpos;
+	int zpos;
+	uint16_t alpha;
+	/* sync_file for fb not handed to a plane yet, or -1. left alone by the
+	 * allocator */
+	int in_fence;
+
+	/* index of the plane the client was given, -1 if none */
+	int plane;
+};
+
+struct plane_alloc_entry {
+	/* 0 marks a free entry */
+	uint64_t key;
+	uint32_t last_used;
+	/* clients that got a plane, and whether the composite layer got the
+	 * one after them */
+	int placed;
+	bool composited;
+	int planes[COMPOSITOR_MAX_LAYERS];
+};
+
+/* remembers which plane assignments the kernel accepted for recently seen
+ * client configurations, so the search only runs when something new shows
+ * up */
+struct plane_alloc {
+	uint32_t clock;
+	struct plane_alloc_entry cache[PLANE_ALLOC_CACHE_SIZE];
+};
+
+int plane_alloc_order(struct plane_alloc_client *clients, int nclients,
+		struct plane_alloc_client **order);
+int plane_alloc_assign(struct plane_alloc *alloc,
+		struct output *output,
+		struct plane_alloc_client *clients, int nclients,
+		struct plane_alloc_client *composite);
+
+#endif
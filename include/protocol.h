@@ -1,25 +1,263 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "shared/wire.h"
+#include "triple_buffer.h"
+
+#define PROTOCOL_MAX_BUFFERS 8
+/* the client table grows by this many slots at a time */
+#define PROTOCOL_CLIENT_CHUNK 16
+#define PROTOCOL_MAX_CHUNKS 64
+/* events held for a client that doesn't read them before it is
+ * disconnected */
+#define PROTOCOL_MAX_BACKLOG 4096
+
+/* turns client dmabufs into kms framebuffers and back, implemented by
+ * whoever owns the drm device. output is the one the client is shown on.
+ * an fb passed to destroy may still be on screen and has to stay until it
+ * isn't. called from the protocol thread */
+struct protocol_buffer_handler {
+	int (*import)(void *data, uint32_t output,
+			const struct wire_import_dmabuf *dmabuf,
+			const int *fds, uint32_t *fb_id);
+	void (*destroy)(void *data, uint32_t output, uint32_t fb_id);
+	void *data;
+};
+
+/* an imported buffer, id 0 marks a free slot */
+struct protocol_buffer {
+	uint32_t id;
+	uint32_t fb_id;
+	uint32_t format;
+	uint64_t modifier;
+};
+
+struct protocol_submission {
+	/* the client's name for the buffer and the fb it resolved to */
+	uint32_t buffer_id;
+	uint32_t fb_id;
+	/* fourcc and modifier of the buffer, format 0 if unknown */
+	uint32_t format;
+	uint64_t modifier;
+	/* sync_file signalled when rendering into fb_id is done, or -1. if
+	 * the server waits for fences, it only reaches the commit thread if
+	 * it couldn't be watched */
+	int fence_fd;
+	/* CLOCK_MONOTONIC time the protocol thread read it */
+	uint64_t received_ns;
+	/* what changed since the submission before, all of it if ndamage
+	 * is 0 */
+	int ndamage;
+	struct wire_rect damage[WIRE_MAX_DAMAGE];
+};
+
+/* how the client wants its buffers shown, see wire_op_geometry and
+ * wire_op_layer */
+struct protocol_layer {
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+	int32_t dst_x;
+	int32_t dst_y;
+	uint32_t dst_w;
+	uint32_t dst_h;
+
+	bool has_zpos;
+	int32_t zpos;
+	uint16_t alpha;
+};
+
+/* the client's state as of one commit, handed to the commit thread as a
+ * whole so commits are never applied halfway */
+struct protocol_update {
+	/* counts changes of the layer */
+	uint32_t layer_seq;
+	struct protocol_layer layer;
+	/* the newest submission if the commit thread hasn't latched it yet.
+	 * its damage covers the submissions it replaced */
+	bool has_submission;
+	struct protocol_submission submission;
+	/* queued_buffer_id of the client as stored for this update */
+	uint64_t queued_buffer_id;
+};
+
+/* what a client sent since it last woke us up, handed to the commit
+ * thread in one go. layer is the client's layer as of the batch */
+struct protocol_batch {
+	bool submitted;
+	struct protocol_submission submission;
+	bool layer_changed;
+	struct protocol_layer layer;
+};
+
+/* what changed about a client since the commit thread last looked */
+struct protocol_latch {
+	bool layer_changed;
+	struct protocol_layer layer;
+	bool submitted;
+	struct protocol_submission submission;
+};
+
+/* an event that couldn't be sent yet, fd is a copy of the one it carries
+ * or -1 */
+struct protocol_event {
+	union wire_event event;
+	size_t len;
+	int fd;
+};
+
+enum protocol_frame_state {
+	/* nothing of the client's waits for presentation */
+	PROTOCOL_FRAME_IDLE,
+	/* latched into the next commit */
+	PROTOCOL_FRAME_LATCHED,
+	/* part of the commit waiting for its flip */
+	PROTOCOL_FRAME_INFLIGHT,
+};
+
+enum protocol_client_status {
+	PROTOCOL_CLIENT_FREE,
+	PROTOCOL_CLIENT_CONNECTED,
+	/* hung up, waiting for the commit thread to let go of it */
+	PROTOCOL_CLIENT_CLOSING,
+};
+
+/* a client slot is shared by two threads: the protocol thread reads the
+ * socket, the commit thread turns what it sent into frames. everything
+ * but status is owned by one of them */
 struct protocol_client_state {
+	/* enum protocol_client_status. the protocol thread moves a free
+	 * slot to connected and a connected one to closing, the commit
+	 * thread frees it */
+	uint32_t status;
+	/* set before the client is connected and unchanged until it is
+	 * free again. the socket is closed by the commit thread */
 	int fd;
-	uint32_t fb_id;
+	/* the slot's index, which the client knows as its id */
+	uint32_t id;
+	/* counts the clients the slot had, bumped before one is connected.
+	 * tells the commit thread a slot it last saw as connected was
+	 * reused in the meantime */
+	uint32_t generation;
+	/* index of the output the client is shown on, picked at connect */
+	uint32_t output;
+	/* shared with the client if it asked for WIRE_HELLO_RING, NULL
+	 * otherwise, along with the eventfds the client rings for requests
+	 * and the compositor rings for events. like fd, freed by the commit
+	 * thread */
+	struct wire_shm *shm;
+	int doorbell_fd;
+	int wake_fd;
+	/* events are sent from both threads, this keeps the event ring to
+	 * one producer and in order with the socket. what can't be sent
+	 * while the ring or socket is full waits in the backlog, which is
+	 * sent before anything else once the client made room */
+	pthread_mutex_t event_lock;
+	int nbacklog;
+	int backlog_size;
+	struct protocol_event *backlog;
+	/* the socket is watched for EPOLLOUT in epollfd, only while the
+	 * backlog waits for room in it */
+	int epollfd;
+	bool watching_room;
+
+	/* published by the protocol thread and taken by the commit thread */
+	struct triple_buffer update_slots;
+	struct protocol_update updates[3];
+
+	/* protocol thread. layer is the one commits apply to, layer_seq
+	 * counts the ones published and published_layer is the last of them.
+	 * published is a copy of the submission in the update published
+	 * last, has_published false if there is none */
+	struct protocol_layer layer;
+	uint32_t layer_seq;
+	struct protocol_layer published_layer;
+	bool has_published;
+	struct protocol_submission published;
+	/* with wait_fences, a batch held back until the fence of its
+	 * submission signalled, which is watched by epoll, and what came
+	 * after it. neither is there if waiting.submitted is false */
+	struct protocol_batch waiting;
+	struct protocol_batch queued;
+	/* counts the updates published */
+	uint32_t publish_seq;
+	/* dmabufs imported by the client, so steady state submissions are
+	 * just a table lookup */
+	struct protocol_buffer buffers[PROTOCOL_MAX_BUFFERS];
+
+	/* buffers the client may not touch, by the stage they are in. 0 if
+	 * the stage is empty. a buffer is released once it is in none. the
+	 * ids are read by both threads, so they are only accessed atomically.
+	 * the first stages are written by the protocol thread: the buffers of
+	 * waiting and queued, and the one of the update published last until
+	 * it is latched. that one has publish_seq in its upper half, so the
+	 * commit thread only clears it if nothing was published since */
+	uint32_t held_buffer_ids[2];
+	uint64_t queued_buffer_id;
+
+	/* commit thread, the buffer ids below are also read by the protocol
+	 * thread */
+	uint32_t latched_layer_seq;
+	enum protocol_frame_state frame_state;
+	uint32_t latched_buffer_id;
+	uint32_t inflight_buffer_id;
+	uint32_t scanout_buffer_id;
+};
+
+/* a wire_vblank shared read-only with the clients of an output */
+struct protocol_vblank_page {
+	int fd;
+	struct wire_vblank *page;
 };
 
 struct protocol_server {
 	int socketfd;
 	int epollfd;
+	/* eventfd the protocol thread signals when a client submitted,
+	 * changed its layer or hung up */
+	int notify_fd;
+	pthread_t thread;
 
+	/* clients are numbered by their slot. the table only ever grows and
+	 * chunks don't move, so the commit thread can walk it while the
+	 * protocol thread adds to it. nclients is only accessed atomically */
 	int nclients;
-	struct protocol_client_state *clients;
+	struct protocol_client_state *chunks[PROTOCOL_MAX_CHUNKS];
+	int noutputs;
+	struct protocol_vblank_page *vblank_pages;
+	/* set if some plane can't wait for a fence itself, submissions are
+	 * only published once their fence signalled then */
+	bool wait_fences;
+
+	struct protocol_buffer_handler buffer_handler;
 };
 
 int protocol_server_init(struct protocol_server *server,
-		const char *socket_path, int max_clients);
-int protocol_server_poll(struct protocol_server *server);
-int protocol_server_broadcast(struct protocol_server *server);
+		const char *socket_path, int noutputs,
+		const struct protocol_buffer_handler *buffer_handler);
+int protocol_server_start(struct protocol_server *server);
+int protocol_server_nclients(struct protocol_server *server);
+struct protocol_client_state *protocol_server_client(
+		struct protocol_server *server, int id);
+
+/* the rest is for the commit thread */
+void protocol_server_dispatch(struct protocol_server *server);
+int protocol_server_frame_queued(struct protocol_server *server,
+		uint32_t output, int out_fence);
+void protocol_server_frame_discarded(struct protocol_server *server,
+		uint32_t output);
+int protocol_server_broadcast(struct protocol_server *server,
+		uint32_t output, const struct wire_presentation *presentation);
+void protocol_server_vblank(struct protocol_server *server, uint32_t output,
+		uint32_t sequence, uint64_t timestamp_ns, uint32_t refresh_ns);
+
+bool protocol_client_connected(struct protocol_client_state *client);
+bool protocol_client_latch(struct protocol_client_state *client,
+		struct protocol_latch *latch);
 
 #endif
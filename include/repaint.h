@@ -0,0 +1,48 @@
+#ifndef REPAINT_H
+#define REPAINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compositor.h"
+
+/* decides when to repaint an output: as late as possible before a vblank,
+ * so the newest client buffers are latched, but early enough for the
+ * commit to still make it. the margin before the vblank covers what a
+ * repaint took lately plus slack that grows whenever a flip came a vblank
+ * late, and shrinks again while none do */
+struct repaint_scheduler {
+	/* commit right away instead of at a deadline */
+	bool immediate;
+	/* kept before the vblank on top of the repaint cost */
+	uint64_t min_margin_ns;
+	uint64_t slack_ns;
+	/* the recent worst case from the start of a repaint to the end of its
+	 * commit call, decaying slowly */
+	uint64_t cost_ns;
+	/* flips in a row that made their vblank */
+	int on_time;
+
+	/* set while a repaint is scheduled, at deadline_ns. cleared by the
+	 * caller when it repaints */
+	bool scheduled;
+	uint64_t deadline_ns;
+	/* the vblank the scheduled or last commit aims for */
+	bool has_target;
+	uint32_t target_sequence;
+};
+
+void repaint_scheduler_init(struct repaint_scheduler *scheduler,
+		bool immediate, uint64_t min_margin_ns);
+/* picks the deadline for the first vblank that can still be made */
+uint64_t repaint_schedule(struct repaint_scheduler *scheduler,
+		const struct output *output, uint64_t now_ns);
+void repaint_retry(struct repaint_scheduler *scheduler,
+		const struct output *output, uint64_t now_ns);
+void repaint_committed(struct repaint_scheduler *scheduler,
+		const struct output *output, uint64_t start_ns);
+/* returns true if the flip came later than the vblank it aimed for */
+bool repaint_flipped(struct repaint_scheduler *scheduler,
+		const struct output *output);
+
+#endif
@@ -2,5 +2,6 @@
 #define SHARED_HELPER_H
 
 int open_drm_device();
+int open_render_device();
 
 #endif
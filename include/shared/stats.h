@@ -0,0 +1,79 @@
+#ifndef SHARED_STATS_H
+#define SHARED_STATS_H
+
+#include <stdint.h>
+
+/* "mpcs", followed by the layout version */
+#define STATS_MAGIC 0x7363706D
+#define STATS_VERSION 2
+
+#define STATS_BUCKETS 20
+#define STATS_MAX_OUTPUTS 4
+#define STATS_MAX_CLIENTS 32
+
+/* durations by powers of two microseconds: bucket 0 counts everything
+ * under 2us, bucket i from 2^i us up to 2^(i+1) us and the last one
+ * everything longer */
+struct stats_histogram {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_output {
+	/* commits that were queued, rejected and refused with EBUSY */
+	uint64_t commits;
+	uint64_t failed_commits;
+	uint64_t busy_commits;
+	/* frames that needed no commit and just waited for a vblank */
+	uint64_t idle_frames;
+	/* commits that flipped later than the vblank they were timed for */
+	uint64_t late_flips;
+	/* latching and compositing up to the commit call */
+	struct stats_histogram build;
+	/* the commit call itself */
+	struct stats_histogram commit;
+	/* commit call returned to page flip */
+	struct stats_histogram flip;
+	/* a submission arrived to it was scanned out, over all clients */
+	struct stats_histogram latency;
+};
+
+/* by client id, cleared when the client goes away */
+struct stats_client {
+	/* the client has had a frame latched */
+	uint32_t active;
+	uint32_t output;
+	uint64_t latched;
+	uint64_t presented;
+	/* latched frames that never made it to the screen */
+	uint64_t discarded;
+	/* vblanks that went by between a submission arriving and it being
+	 * scanned out, without showing it */
+	uint64_t missed_vblanks;
+	struct stats_histogram latency;
+};
+
+/* the page the stats socket hands out as a read-only memfd. only the
+ * compositor writes it, each field atomically, and everything but the
+ * client entries only grows. readers don't lock, so a copy may be torn
+ * between fields */
+struct stats_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t noutputs;
+	uint32_t pad;
+	/* CLOCK_MONOTONIC time the compositor started */
+	uint64_t start_ns;
+	struct stats_output outputs[STATS_MAX_OUTPUTS];
+	struct stats_client clients[STATS_MAX_CLIENTS];
+};
+
+static inline int stats_bucket(uint64_t ns) {
+	uint64_t us = ns / 1000;
+	int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef SHARED_WIRE_H
+#define SHARED_WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WIRE_MAX_FDS 4
+#define WIRE_MAX_PLANES 4
+#define WIRE_MAX_DAMAGE 8
+#define WIRE_MAX_COMMIT_SIZE 512
+
+/* bumped whenever a request, op or event changes. a client has to speak
+ * the compositor's version */
+#define WIRE_VERSION 4
+
+/* asks for requests and events to go through a wire_shm instead of the
+ * socket */
+#define WIRE_HELLO_RING (1 << 0)
+
+/* the first message of a client, picks the output it is shown on. the
+ * compositor answers with wire_welcome, or hangs up */
+struct wire_hello {
+	uint32_t version;
+	uint32_t output;
+	uint32_t flags;
+};
+
+/* requests sent from clients to the compositor, each starts with its
+ * 32-bit type */
+#define WIRE_REQUEST_COMMIT 0xCDCD1001
+#define WIRE_REQUEST_IMPORT_DMABUF 0xCDCD1002
+#define WIRE_REQUEST_DESTROY_BUFFER 0xCDCD1003
+
+/* changes the client's state. the ops following the header are applied
+ * together, from the same frame on, or not at all if any is malformed. a
+ * commit is at most WIRE_MAX_COMMIT_SIZE bytes long */
+struct wire_commit {
+	uint32_t type;
+	uint32_t num_ops;
+};
+
+#define WIRE_OP_ATTACH 1
+#define WIRE_OP_DAMAGE 2
+#define WIRE_OP_GEOMETRY 3
+#define WIRE_OP_LAYER 4
+
+/* starts every op. size includes the header and is a multiple of 4 */
+struct wire_op {
+	uint16_t type;
+	uint16_t size;
+};
+
+/* buffer_id is a kms fb_id the client created itself */
+#define WIRE_ATTACH_RAW_FB (1 << 0)
+/* the fd passed with the commit is a sync_file that signals when
+ * rendering into the buffer is done. the buffer isn't scanned out before */
+#define WIRE_ATTACH_FENCE (1 << 1)
+
+/* shows buffer_id from the next frame on. at most one per commit */
+struct wire_op_attach {
+	struct wire_op op;
+	uint32_t flags;
+	uint32_t buffer_id;
+};
+
+struct wire_rect {
+	int32_t x;
+	int32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+/* a part of the attached buffer that changed since the last one, in
+ * buffer pixels. an attach without damage means all of it changed.
+ * beyond WIRE_MAX_DAMAGE rectangles the bounding box is used */
+struct wire_op_damage {
+	struct wire_op op;
+	struct wire_rect rect;
+};
+
+/* shows the src rectangle of the client's buffers at the dst rectangle of
+ * the screen, in pixels. a zero size means the size of the mode */
+struct wire_op_geometry {
+	struct wire_op op;
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+	int32_t dst_x;
+	int32_t dst_y;
+	uint32_t dst_w;
+	uint32_t dst_h;
+};
+
+#define WIRE_LAYER_ZPOS (1 << 0)
+#define WIRE_LAYER_ALPHA (1 << 1)
+
+/* changes the fields selected by flags, alpha goes from 0 to 0xffff */
+struct wire_op_layer {
+	struct wire_op op;
+	uint32_t flags;
+	int32_t zpos;
+	uint32_t alpha;
+};
+
+/* registers a dmabuf under the client-chosen buffer_id, one fd per plane
+ * is attached */
+struct wire_import_dmabuf {
+	uint32_t type;
+	uint32_t buffer_id;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t num_planes;
+	uint32_t strides[WIRE_MAX_PLANES];
+	uint32_t offsets[WIRE_MAX_PLANES];
+	uint64_t modifier;
+};
+
+struct wire_destroy_buffer {
+	uint32_t type;
+	uint32_t buffer_id;
+};
+
+union wire_request {
+	uint32_t type;
+	struct wire_commit commit;
+	struct wire_import_dmabuf import_dmabuf;
+	struct wire_destroy_buffer destroy_buffer;
+	uint32_t words[WIRE_MAX_COMMIT_SIZE / 4];
+};
+
+/* events sent from the compositor to its clients, each starts with its
+ * 32-bit type */
+#define WIRE_EVENT_PRESENTATION 0xCDCD0001
+#define WIRE_EVENT_RELEASE 0xCDCD0002
+#define WIRE_EVENT_WELCOME 0xCDCD0003
+/* a 32-bit word carrying the sync_file that signals once the commit
+ * containing the client's last framebuffer is on screen */
+#define WIRE_EVENT_OUT_FENCE 0xCDCD0F0F
+
+/* the frame never made it to the screen, e.g. the commit failed */
+#define WIRE_PRESENTATION_DISCARDED (1 << 0)
+
+/* sent when the frame containing the client's buffer_id started scanning
+ * out. timestamp_ns is CLOCK_MONOTONIC */
+struct wire_presentation {
+	uint32_t type;
+	uint32_t flags;
+	uint32_t buffer_id;
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+	uint32_t refresh_ns;
+	uint32_t pad;
+};
+
+/* buffer_id is neither queued, about to be committed nor on screen anymore
+ * and may be rendered into again */
+struct wire_release {
+	uint32_t type;
+	uint32_t buffer_id;
+};
+
+/* the hello was accepted, client_id is how the compositor refers to the
+ * client from now on. it comes with a read-only memfd holding the
+ * wire_vblank of the client's output. with WIRE_HELLO_RING three more fds
+ * follow: a memfd holding the wire_shm, the eventfd to ring when the
+ * compositor sleeps on the request ring and the one it rings when the
+ * client sleeps on the event ring */
+struct wire_welcome {
+	uint32_t type;
+	uint32_t version;
+	uint32_t client_id;
+};
+
+union wire_event {
+	uint32_t type;
+	struct wire_presentation presentation;
+	struct wire_release release;
+	struct wire_welcome welcome;
+};
+
+/* the latest vblank of an output, updated by the compositor after every
+ * flip. count is odd while an update is in progress, readers retry if it
+ * changed while they read. it also is the futex word woken after each */
+struct wire_vblank {
+	uint32_t count;
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+	uint32_t refresh_ns;
+};
+
+#define WIRE_RING_ENTRIES 32
+
+/* stands in for a message that went over the socket instead, because it
+ * carries fds. the message is sent before the entry */
+#define WIRE_RING_ON_SOCKET 0xCDCD2001
+
+struct wire_ring_entry {
+	uint32_t size;
+	uint32_t data[WIRE_MAX_COMMIT_SIZE / 4];
+};
+
+/* a queue of messages with one producer and one consumer, in memory shared
+ * by both. head and tail count the pushed and popped entries. the peer
+ * can't be trusted, so everything read from it is checked */
+struct wire_ring {
+	uint32_t head;
+	uint32_t tail;
+	/* set while the consumer waits for its doorbell */
+	uint32_t sleeping;
+	/* set while the producer waits for the consumer to make room, which
+	 * rings the producer's doorbell then */
+	uint32_t producer_waiting;
+	struct wire_ring_entry entries[WIRE_RING_ENTRIES];
+};
+
+struct wire_shm {
+	struct wire_ring requests;
+	struct wire_ring events;
+};
+
+ssize_t wire_send(int sockfd, const void *buf, size_t len, const int *fds,
+		int nfds);
+ssize_t wire_send_fd(int sockfd, const void *buf, size_t len, int fd);
+ssize_t wire_recv(int sockfd, void *buf, size_t len, int *fds, int nfds,
+		int *received, int flags);
+ssize_t wire_recv_fd(int sockfd, void *buf, size_t len, int *fd, int flags);
+void wire_close_fds(int *fds, int nfds);
+
+bool wire_ring_full(struct wire_ring *ring);
+int wire_ring_push(struct wire_ring *ring, int doorbell, const void *buf,
+		size_t len);
+ssize_t wire_ring_pop(struct wire_ring *ring, void *buf, size_t len);
+bool wire_ring_sleep(struct wire_ring *ring);
+void wire_ring_wake(struct wire_ring *ring);
+bool wire_ring_wait_room(struct wire_ring *ring);
+bool wire_ring_room_wanted(struct wire_ring *ring);
+
+#endif
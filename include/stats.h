@@ -0,0 +1,39 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "shared/stats.h"
+
+/* frame timings and counters, kept in a shared-memory page anyone
+ * connecting to the stats socket gets a read-only copy of. only the
+ * commit thread records */
+struct stats {
+	int socketfd;
+	int page_fd;
+	struct stats_page *page;
+};
+
+static inline uint64_t stats_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct stats *stats_create(const char *socket_path, int noutputs);
+/* hands the page to whoever connected to the socket */
+void stats_accept(struct stats *stats);
+
+void stats_add(uint64_t *counter, uint64_t n);
+void stats_record(struct stats_histogram *histogram, uint64_t ns);
+
+void stats_client_latched(struct stats *stats, int id, uint32_t output,
+		bool replaced);
+void stats_client_presented(struct stats *stats, int id, uint32_t output,
+		uint64_t latency_ns, uint32_t refresh_ns);
+void stats_client_discarded(struct stats *stats, int id);
+void stats_client_reset(struct stats *stats, int id);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/* events kept, older ones are overwritten */
+#define TRACE_EVENTS (1 << 16)
+#define TRACE_MAX_THREADS 8
+
+/* one entry of the ring. names are string literals, so recording never
+ * copies or allocates */
+struct trace_event {
+	/* index + 1 once the event is complete, to skip ones that are
+	 * being overwritten while the ring is dumped */
+	uint64_t seq;
+	uint64_t ts_ns;
+	/* a span if dur_ns is not 0, an instant otherwise */
+	uint64_t dur_ns;
+	const char *name;
+	int32_t tid;
+	const char *arg_names[2];
+	uint64_t args[2];
+};
+
+/* set once tracing was started, checked before every event */
+extern bool trace_enabled;
+
+/* records from now on and writes the events to path with trace_dump, as
+ * JSON for chrome://tracing or Perfetto */
+int trace_init(const char *path);
+/* names the calling thread in the trace */
+void trace_thread_name(const char *name);
+int trace_dump(void);
+
+void trace_record(const char *name, uint64_t ts_ns, uint64_t dur_ns,
+		const char *arg0, uint64_t value0, const char *arg1,
+		uint64_t value1);
+
+/* something that happened now. args without a name are left out */
+static inline void trace_instant(const char *name, const char *arg0,
+		uint64_t value0, const char *arg1, uint64_t value1) {
+	if (__builtin_expect(trace_enabled, 0)) {
+		trace_record(name, stats_now_ns(), 0, arg0, value0, arg1,
+				value1);
+	}
+}
+
+/* like trace_instant, for something that happened at ts_ns */
+static inline void trace_instant_at(const char *name, uint64_t ts_ns,
+		const char *arg0, uint64_t value0, const char *arg1,
+		uint64_t value1) {
+	if (__builtin_expect(trace_enabled, 0)) {
+		trace_record(name, ts_ns, 0, arg0, value0, arg1, value1);
+	}
+}
+
+/* the start of a span that ends with trace_end, 0 if not tracing */
+static inline uint64_t trace_begin(void) {
+	return __builtin_expect(trace_enabled, 0) ? stats_now_ns() : 0;
+}
+
+static inline void trace_end(const char *name, uint64_t start_ns,
+		const char *arg0, uint64_t value0, const char *arg1,
+		uint64_t value1) {
+	if (__builtin_expect(trace_enabled, 0)) {
+		uint64_t now = stats_now_ns();
+		trace_record(name, start_ns, now > start_ns
+				? now - start_ns : 1, arg0, value0, arg1,
+				value1);
+	}
+}
+
+/* something that took from start_ns to end_ns */
+static inline void trace_span(const char *name, uint64_t start_ns,
+		uint64_t end_ns, const char *arg0, uint64_t value0,
+		const char *arg1, uint64_t value1) {
+	if (__builtin_expect(trace_enabled, 0)) {
+		trace_record(name, start_ns, end_ns > start_ns
+				? end_ns - start_ns : 1, arg0, value0, arg1,
+				value1);
+	}
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* set in middle while the reader hasn't taken the slot published last */
+#define TRIPLE_BUFFER_FRESH 0x4
+
+/* hands values from one writer thread to one reader thread without locks.
+ * the user keeps three slots; the writer fills back, the reader looks at
+ * front and middle is the most recently published one. publishing and
+ * taking just swap indices, so neither side ever waits for the other and
+ * the reader always gets the newest value */
+struct triple_buffer {
+	/* shared, only accessed atomically */
+	uint32_t middle;
+	/* owned by the writer and the reader respectively */
+	uint32_t back;
+	uint32_t front;
+};
+
+/* only while neither thread uses it */
+static inline void triple_buffer_init(struct triple_buffer *buffer) {
+	buffer->back = 0;
+	buffer->middle = 1;
+	buffer->front = 2;
+}
+
+/* for the writer, whether the reader has yet to take the slot published
+ * last. that can change at any time, but triple_buffer_publish notices */
+static inline uint32_t triple_buffer_state(struct triple_buffer *buffer) {
+	return __atomic_load_n(&buffer->middle, __ATOMIC_ACQUIRE);
+}
+
+static inline bool triple_buffer_fresh(uint32_t state) {
+	return (state & TRIPLE_BUFFER_FRESH) != 0;
+}
+
+/* publishes the back slot, unless the reader took a slot since *state was
+ * read. then *state is updated and the writer can adjust the back slot and
+ * try again. on success the writer gets the previous middle slot as its
+ * new back slot; if triple_buffer_fresh(*state), the reader never took it,
+ * so whatever it holds was dropped and is the writer's to clean up */
+static inline bool triple_buffer_publish(struct triple_buffer *buffer,
+		uint32_t *state) {
+	if (!__atomic_compare_exchange_n(&buffer->middle, state,
+				buffer->back | TRIPLE_BUFFER_FRESH, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	buffer->back = *state & ~TRIPLE_BUFFER_FRESH;
+	return true;
+}
+
+/* makes the most recently published slot the front one, returns false if
+ * nothing was published since the last take */
+static inline bool triple_buffer_take(struct triple_buffer *buffer) {
+	/* only the reader clears the flag, it can't go away after this */
+	if ((__atomic_load_n(&buffer->middle, __ATOMIC_RELAXED)
+				& TRIPLE_BUFFER_FRESH) == 0) {
+		return false;
+	}
+
+	uint32_t old = __atomic_exchange_n(&buffer->middle, buffer->front,
+			__ATOMIC_ACQ_REL);
+	buffer->front = old & ~TRIPLE_BUFFER_FRESH;
+	return true;
+}
+
+#endif
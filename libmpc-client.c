@@ -1,18 +1,67 @@
 #include "libmpc-client.h"
 
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "shared/wire.h"
+
 struct mpc_display {
 	int serverfd;
-	uint32_t width;
-	uint32_t height;
+	uint32_t client_id;
+	/* shared read-only with the compositor */
+	const struct wire_vblank *vblank;
+	/* set up if connected with mpc_display_connect_ring, see
+	 * wire_welcome */
+	struct wire_shm *shm;
+	int doorbell_fd;
+	int wake_fd;
+
+	/* latest presentation read off the socket but not yet waited for */
+	bool presentation_pending;
+	struct mpc_presentation presentation;
+	/* latest out fence received from the compositor, or -1 */
+	int out_fence;
+
+	uint32_t next_buffer_id;
+
+	mpc_release_handler release_handler;
+	void *release_data;
+};
+
+struct mpc_buffer_pool {
+	struct mpc_display *display;
+
+	int nbuffers;
+	struct {
+		uint32_t buffer_id;
+		bool busy;
+	} buffers[MPC_BUFFER_POOL_MAX];
 };
 
-struct mpc_display *mpc_display_connect(const char *path, int client_id) {
+/* maps a memfd the compositor handed over and closes it */
+static void *map_fd(int fd, size_t size, int prot) {
+	void *map = MAP_FAILED;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) size) {
+		map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	return map;
+}
+
+static struct mpc_display *connect_display(const char *path, int output,
+		uint32_t flags) {
 	struct sockaddr_un addr = {
 		.sun_family = AF_UNIX,
 	};
@@ -23,25 +72,618 @@ struct mpc_display *mpc_display_connect(const char *path, int client_id) {
 		return NULL;
 	}
 
-	/* TODO: Implement reading display width/height from compositor */
-
-	if (write(fd, &client_id, sizeof(uint32_t)) == -1) {
+	struct wire_hello hello = {
+		.version = WIRE_VERSION,
+		.output = output,
+		.flags = flags,
+	};
+	if (write(fd, &hello, sizeof(hello)) == -1) {
+		close(fd);
 		return NULL;
 	}
 
+	/* the compositor hangs up if it doesn't want us */
+	union wire_event event;
+	int fds[WIRE_MAX_FDS];
+	int nfds;
+	ssize_t ret = wire_recv(fd, &event, sizeof(event), fds, WIRE_MAX_FDS,
+			&nfds, 0);
+	int expected_fds = flags & WIRE_HELLO_RING ? 4 : 1;
+	if (ret != sizeof(struct wire_welcome)
+			|| event.type != WIRE_EVENT_WELCOME
+			|| event.welcome.version != WIRE_VERSION
+			|| nfds != expected_fds) {
+		goto err;
+	}
+
+	void *vblank = map_fd(fds[0], sizeof(struct wire_vblank), PROT_READ);
+	fds[0] = -1;
+	if (vblank == MAP_FAILED) {
+		goto err;
+	}
+	void *shm = NULL;
+	if (flags & WIRE_HELLO_RING) {
+		shm = map_fd(fds[1], sizeof(struct wire_shm),
+				PROT_READ | PROT_WRITE);
+		fds[1] = -1;
+		if (shm == MAP_FAILED) {
+			munmap(vblank, sizeof(struct wire_vblank));
+			goto err;
+		}
+	}
+
 	struct mpc_display *ini = calloc(1, sizeof(struct mpc_display));
 	ini->serverfd = fd;
-	ini->width = 720;
-	ini->height = 576;
+	ini->client_id = event.welcome.client_id;
+	ini->vblank = vblank;
+	ini->shm = shm;
+	ini->doorbell_fd = shm != NULL ? fds[2] : -1;
+	ini->wake_fd = shm != NULL ? fds[3] : -1;
+	ini->out_fence = -1;
+	ini->next_buffer_id = 1;
 	return ini;
+
+err:
+	wire_close_fds(fds, nfds);
+	close(fd);
+	return NULL;
+}
+
+struct mpc_display *mpc_display_connect(const char *path) {
+	return mpc_display_connect_output(path, 0);
+}
+
+struct mpc_display *mpc_display_connect_output(const char *path,
+		int output) {
+	return connect_display(path, output, 0);
+}
+
+struct mpc_display *mpc_display_connect_ring(const char *path, int output) {
+	return connect_display(path, output, WIRE_HELLO_RING);
+}
+
+uint32_t mpc_display_get_client_id(struct mpc_display *client) {
+	return client->client_id;
 }
 
 int mpc_display_set_framebuffer(struct mpc_display *client, int fb_id) {
-	uint32_t buf = fb_id;
-	return write(client->serverfd, &buf, sizeof(uint32_t));
+	return mpc_display_set_framebuffer_fenced(client, fb_id, -1);
+}
+
+/* sends a request through the ring if there is one. requests with fds go
+ * over the socket, with an entry in the ring to keep them in order */
+static int send_request(struct mpc_display *client, const void *buf,
+		size_t len, const int *fds, int nfds) {
+	if (client->shm == NULL) {
+		return wire_send(client->serverfd, buf, len, fds, nfds);
+	}
+
+	struct wire_ring *ring = &client->shm->requests;
+	uint32_t marker = WIRE_RING_ON_SOCKET;
+	if (wire_ring_full(ring)) {
+		errno = EAGAIN;
+		return -1;
+	} else if (nfds > 0) {
+		if (wire_send(client->serverfd, buf, len, fds, nfds) == -1) {
+			return -1;
+		}
+		buf = &marker;
+		len = sizeof(marker);
+	}
+	if (wire_ring_push(ring, client->doorbell_fd, buf, len) == -1) {
+		return -1;
+	}
+	return len;
+}
+
+/* appends an op to a commit, the caller makes sure it fits */
+static void add_op(union wire_request *request, size_t *size, void *op,
+		uint16_t type, uint16_t op_size) {
+	struct wire_op *header = op;
+	header->type = type;
+	header->size = op_size;
+	memcpy((char *) request + *size, op, op_size);
+	*size += op_size;
+	request->commit.num_ops++;
+}
+
+int mpc_display_commit(struct mpc_display *client,
+		const struct mpc_commit *commit) {
+	uint32_t buffer_flags = commit->flags
+		& (MPC_COMMIT_BUFFER | MPC_COMMIT_FRAMEBUFFER);
+	if (buffer_flags == (MPC_COMMIT_BUFFER | MPC_COMMIT_FRAMEBUFFER)) {
+		return -1;
+	}
+
+	union wire_request request = {
+		.commit = {
+			.type = WIRE_REQUEST_COMMIT,
+		},
+	};
+	size_t size = sizeof(struct wire_commit);
+	int fence_fd = -1;
+
+	if (buffer_flags != 0) {
+		struct wire_op_attach attach = {
+			.buffer_id = commit->buffer_id,
+		};
+		if (buffer_flags == MPC_COMMIT_FRAMEBUFFER) {
+			attach.flags |= WIRE_ATTACH_RAW_FB;
+		}
+		if (commit->fence_fd >= 0) {
+			attach.flags |= WIRE_ATTACH_FENCE;
+			fence_fd = commit->fence_fd;
+		}
+		add_op(&request, &size, &attach, WIRE_OP_ATTACH,
+				sizeof(attach));
+
+		/* too many rectangles are sent as their bounding box */
+		const struct mpc_rect *damage = commit->damage;
+		int ndamage = commit->ndamage;
+		struct mpc_rect box;
+		if (ndamage > WIRE_MAX_DAMAGE) {
+			int64_t x0 = INT64_MAX, y0 = INT64_MAX;
+			int64_t x1 = INT64_MIN, y1 = INT64_MIN;
+			for (int i = 0; i < ndamage; i++) {
+				int64_t right = damage[i].x
+					+ (int64_t) damage[i].width;
+				int64_t bottom = damage[i].y
+					+ (int64_t) damage[i].height;
+				x0 = damage[i].x < x0 ? damage[i].x : x0;
+				y0 = damage[i].y < y0 ? damage[i].y : y0;
+				x1 = right > x1 ? right : x1;
+				y1 = bottom > y1 ? bottom : y1;
+			}
+			box = (struct mpc_rect) {
+				.x = x0,
+				.y = y0,
+				.width = x1 - x0,
+				.height = y1 - y0,
+			};
+			damage = &box;
+			ndamage = 1;
+		}
+		for (int i = 0; i < ndamage; i++) {
+			struct wire_op_damage op = {
+				.rect = {
+					.x = damage[i].x,
+					.y = damage[i].y,
+					.width = damage[i].width,
+					.height = damage[i].height,
+				},
+			};
+			add_op(&request, &size, &op, WIRE_OP_DAMAGE,
+					sizeof(op));
+		}
+	}
+
+	if (commit->flags & MPC_COMMIT_GEOMETRY) {
+		struct wire_op_geometry geometry = {
+			.src_x = commit->src.x,
+			.src_y = commit->src.y,
+			.src_w = commit->src.width,
+			.src_h = commit->src.height,
+			.dst_x = commit->dst.x,
+			.dst_y = commit->dst.y,
+			.dst_w = commit->dst.width,
+			.dst_h = commit->dst.height,
+		};
+		add_op(&request, &size, &geometry, WIRE_OP_GEOMETRY,
+				sizeof(geometry));
+	}
+
+	if (commit->flags & (MPC_COMMIT_ZPOS | MPC_COMMIT_ALPHA)) {
+		struct wire_op_layer layer = {
+			.zpos = commit->zpos,
+			.alpha = commit->alpha,
+		};
+		if (commit->flags & MPC_COMMIT_ZPOS) {
+			layer.flags |= WIRE_LAYER_ZPOS;
+		}
+		if (commit->flags & MPC_COMMIT_ALPHA) {
+			layer.flags |= WIRE_LAYER_ALPHA;
+		}
+		add_op(&request, &size, &layer, WIRE_OP_LAYER, sizeof(layer));
+	}
+
+	return send_request(client, &request, size, &fence_fd,
+			fence_fd >= 0 ? 1 : 0);
+}
+
+int mpc_display_set_framebuffer_fenced(struct mpc_display *client, int fb_id,
+		int fence_fd) {
+	return mpc_display_set_framebuffer_damage(client, fb_id, fence_fd,
+			NULL, 0);
+}
+
+int mpc_display_set_framebuffer_damage(struct mpc_display *client,
+		int fb_id, int fence_fd, const struct mpc_rect *damage,
+		int ndamage) {
+	struct mpc_commit commit = {
+		.flags = MPC_COMMIT_FRAMEBUFFER,
+		.buffer_id = fb_id,
+		.fence_fd = fence_fd,
+		.damage = damage,
+		.ndamage = ndamage,
+	};
+	return mpc_display_commit(client, &commit);
+}
+
+int mpc_display_import_dmabuf(struct mpc_display *client,
+		const struct mpc_dmabuf *dmabuf) {
+	if (dmabuf->num_planes < 1 || dmabuf->num_planes > WIRE_MAX_PLANES) {
+		return -1;
+	}
+
+	struct wire_import_dmabuf import = {
+		.type = WIRE_REQUEST_IMPORT_DMABUF,
+		.buffer_id = client->next_buffer_id,
+		.width = dmabuf->width,
+		.height = dmabuf->height,
+		.format = dmabuf->format,
+		.num_planes = dmabuf->num_planes,
+		.modifier = dmabuf->modifier,
+	};
+	for (int i = 0; i < dmabuf->num_planes; i++) {
+		import.strides[i] = dmabuf->strides[i];
+		import.offsets[i] = dmabuf->offsets[i];
+	}
+
+	if (send_request(client, &import, sizeof(import), dmabuf->fds,
+				dmabuf->num_planes) == -1) {
+		return -1;
+	}
+	return client->next_buffer_id++;
+}
+
+int mpc_display_attach_buffer(struct mpc_display *client, uint32_t buffer_id,
+		int fence_fd) {
+	return mpc_display_attach_buffer_damage(client, buffer_id, fence_fd,
+			NULL, 0);
+}
+
+int mpc_display_attach_buffer_damage(struct mpc_display *client,
+		uint32_t buffer_id, int fence_fd, const struct mpc_rect *damage,
+		int ndamage) {
+	struct mpc_commit commit = {
+		.flags = MPC_COMMIT_BUFFER,
+		.buffer_id = buffer_id,
+		.fence_fd = fence_fd,
+		.damage = damage,
+		.ndamage = ndamage,
+	};
+	return mpc_display_commit(client, &commit);
+}
+
+int mpc_display_destroy_buffer(struct mpc_display *client,
+		uint32_t buffer_id) {
+	struct wire_destroy_buffer destroy = {
+		.type = WIRE_REQUEST_DESTROY_BUFFER,
+		.buffer_id = buffer_id,
+	};
+	return send_request(client, &destroy, sizeof(destroy), NULL, 0);
+}
+
+int mpc_display_set_geometry(struct mpc_display *client,
+		const struct mpc_rect *src, const struct mpc_rect *dst) {
+	struct mpc_commit commit = {
+		.flags = MPC_COMMIT_GEOMETRY,
+		.src = *src,
+		.dst = *dst,
+	};
+	return mpc_display_commit(client, &commit);
+}
+
+int mpc_display_set_zpos(struct mpc_display *client, int zpos) {
+	struct mpc_commit commit = {
+		.flags = MPC_COMMIT_ZPOS,
+		.zpos = zpos,
+	};
+	return mpc_display_commit(client, &commit);
+}
+
+int mpc_display_set_alpha(struct mpc_display *client, uint16_t alpha) {
+	struct mpc_commit commit = {
+		.flags = MPC_COMMIT_ALPHA,
+		.alpha = alpha,
+	};
+	return mpc_display_commit(client, &commit);
+}
+
+/* a consistent copy of the vblank page, see wire_vblank. returns the count
+ * it was read at */
+static uint32_t read_vblank(const struct wire_vblank *page,
+		struct mpc_vblank *vblank) {
+	uint32_t count;
+	do {
+		/* an update is just a few stores, not worth sleeping for */
+		do {
+			count = __atomic_load_n(&page->count, __ATOMIC_ACQUIRE);
+		} while (count & 1);
+
+		vblank->sequence = __atomic_load_n(&page->sequence,
+				__ATOMIC_RELAXED);
+		vblank->timestamp_ns = __atomic_load_n(&page->timestamp_ns,
+				__ATOMIC_RELAXED);
+		vblank->refresh_ns = __atomic_load_n(&page->refresh_ns,
+				__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&page->count, __ATOMIC_RELAXED) != count);
+
+	vblank->predicted = false;
+	return count;
+}
+
+void mpc_display_get_vblank(struct mpc_display *client,
+		struct mpc_vblank *vblank) {
+	read_vblank(client->vblank, vblank);
+}
+
+int mpc_display_wait_vblank(struct mpc_display *client, uint32_t sequence,
+		struct mpc_vblank *vblank) {
+	while (true) {
+		uint32_t count = read_vblank(client->vblank, vblank);
+		int32_t ahead = vblank->sequence - sequence;
+		if (ahead > 0) {
+			return 0;
+		}
+
+		/* the compositor sees no vblanks on an idle output, so the
+		 * next one after both sequence and now is extrapolated from
+		 * the last. the real one gets half a refresh to show up, then
+		 * it's predicted */
+		struct timespec deadline;
+		struct timespec *timeout = NULL;
+		uint64_t periods = 0, next = 0;
+		if (vblank->refresh_ns > 0) {
+			uint64_t last = vblank->timestamp_ns;
+			uint64_t refresh = vblank->refresh_ns;
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			uint64_t now_ns = now.tv_sec * 1000000000ull
+				+ now.tv_nsec;
+
+			/* the one asked for, or the first one after now */
+			periods = 1 - (int64_t) ahead;
+			uint64_t passed = now_ns >= last
+				? (now_ns - last) / refresh + 1 : 0;
+			if (passed > periods) {
+				periods = passed;
+			}
+			next = last + periods * refresh;
+
+			uint64_t limit = next + refresh / 2;
+			deadline.tv_sec = limit / 1000000000ull;
+			deadline.tv_nsec = limit % 1000000000ull;
+			timeout = &deadline;
+		}
+
+		/* the timeout is absolute, on CLOCK_MONOTONIC */
+		long ret = syscall(SYS_futex, &client->vblank->count,
+				FUTEX_WAIT_BITSET, count, timeout, NULL,
+				FUTEX_BITSET_MATCH_ANY);
+		if (ret == -1 && errno == ETIMEDOUT && timeout != NULL) {
+			vblank->sequence += periods;
+			vblank->timestamp_ns = next;
+			vblank->predicted = true;
+			return 0;
+		} else if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+/* blocks until the compositor rings the doorbell or hangs up */
+static int wait_doorbell(struct mpc_display *client) {
+	struct pollfd fds[2] = {
+		{
+			.fd = client->wake_fd,
+			.events = POLLIN,
+		},
+		{
+			/* just for hangups */
+			.fd = client->serverfd,
+		},
+	};
+	while (poll(fds, 2, -1) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	if (fds[1].revents & (POLLHUP | POLLERR)) {
+		return -1;
+	}
+
+	uint64_t count;
+	if (read(client->wake_fd, &count, sizeof(count)) == -1
+			&& errno != EAGAIN) {
+		return -1;
+	}
+	return 0;
+}
+
+/* like wire_recv_fd on the socket, but takes events from the ring if there
+ * is one */
+static ssize_t recv_event(struct mpc_display *client, union wire_event *event,
+		int *fd, int flags) {
+	if (client->shm == NULL) {
+		return wire_recv_fd(client->serverfd, event, sizeof(*event),
+				fd, flags);
+	}
+
+	struct wire_ring *ring = &client->shm->events;
+	ssize_t ret;
+	*fd = -1;
+	while ((ret = wire_ring_pop(ring, event, sizeof(*event))) == 0) {
+		if (flags & MSG_DONTWAIT) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (wire_ring_sleep(ring)) {
+			int waited = wait_doorbell(client);
+			wire_ring_wake(ring);
+			if (waited == -1) {
+				return -1;
+			}
+		}
+	}
+
+	if (ret == -1) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	/* the compositor holds on to events while the ring is full */
+	if (wire_ring_room_wanted(ring)) {
+		uint64_t one = 1;
+		if (write(client->doorbell_fd, &one, sizeof(one)) == -1) {
+			return -1;
+		}
+	}
+	if (ret == sizeof(uint32_t) && event->type == WIRE_RING_ON_SOCKET) {
+		/* sent before the entry, so it's there already */
+		return wire_recv_fd(client->serverfd, event, sizeof(*event),
+				fd, 0);
+	}
+	return ret;
+}
+
+/* reads one event from the compositor and records it in the display */
+static int read_event(struct mpc_display *client, int flags) {
+	union wire_event event;
+	int fd;
+	ssize_t ret = recv_event(client, &event, &fd, flags);
+	if (ret < (ssize_t) sizeof(uint32_t)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	switch (event.type) {
+		case WIRE_EVENT_PRESENTATION:
+			if (ret != sizeof(struct wire_presentation)) {
+				break;
+			}
+			client->presentation = (struct mpc_presentation) {
+				.buffer_id = event.presentation.buffer_id,
+				.sequence = event.presentation.sequence,
+				.timestamp_ns = event.presentation.timestamp_ns,
+				.refresh_ns = event.presentation.refresh_ns,
+				.discarded = event.presentation.flags
+					& WIRE_PRESENTATION_DISCARDED,
+			};
+			client->presentation_pending = true;
+			break;
+		case WIRE_EVENT_RELEASE:
+			if (ret == sizeof(struct wire_release)
+					&& client->release_handler != NULL) {
+				client->release_handler(client->release_data,
+						event.release.buffer_id);
+			}
+			break;
+		case WIRE_EVENT_OUT_FENCE:
+			if (client->out_fence >= 0) {
+				close(client->out_fence);
+			}
+			client->out_fence = fd;
+			fd = -1;
+			break;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	return 0;
+}
+
+int mpc_display_dispatch(struct mpc_display *client) {
+	return read_event(client, 0);
+}
+
+void mpc_display_set_release_handler(struct mpc_display *client,
+		mpc_release_handler handler, void *data) {
+	client->release_handler = handler;
+	client->release_data = data;
+}
+
+int mpc_display_wait_presentation(struct mpc_display *client,
+		struct mpc_presentation *presentation) {
+	while (!client->presentation_pending) {
+		if (read_event(client, 0) == -1) {
+			return -1;
+		}
+	}
+
+	client->presentation_pending = false;
+	if (presentation != NULL) {
+		*presentation = client->presentation;
+	}
+	return 0;
 }
 
 int mpc_display_wait_sync(struct mpc_display *client) {
-	uint32_t sync;
-	return read(client->serverfd, &sync, sizeof(uint32_t));
+	return mpc_display_wait_presentation(client, NULL);
+}
+
+int mpc_display_take_out_fence(struct mpc_display *client) {
+	/* pick up any fence that arrived since the last call */
+	while (read_event(client, MSG_DONTWAIT) == 0);
+
+	int fence = client->out_fence;
+	client->out_fence = -1;
+	return fence;
+}
+
+static void pool_release(void *data, uint32_t buffer_id) {
+	struct mpc_buffer_pool *pool = data;
+
+	for (int i = 0; i < pool->nbuffers; i++) {
+		if (pool->buffers[i].buffer_id == buffer_id) {
+			pool->buffers[i].busy = false;
+		}
+	}
+}
+
+struct mpc_buffer_pool *mpc_buffer_pool_create(struct mpc_display *display) {
+	struct mpc_buffer_pool *ini = calloc(1, sizeof(struct mpc_buffer_pool));
+	ini->display = display;
+	mpc_display_set_release_handler(display, pool_release, ini);
+	return ini;
+}
+
+void mpc_buffer_pool_destroy(struct mpc_buffer_pool *pool) {
+	mpc_display_set_release_handler(pool->display, NULL, NULL);
+	free(pool);
+}
+
+int mpc_buffer_pool_add(struct mpc_buffer_pool *pool, uint32_t buffer_id) {
+	if (pool->nbuffers >= MPC_BUFFER_POOL_MAX) {
+		return -1;
+	}
+
+	pool->buffers[pool->nbuffers].buffer_id = buffer_id;
+	pool->buffers[pool->nbuffers].busy = false;
+	pool->nbuffers++;
+	return 0;
+}
+
+int64_t mpc_buffer_pool_acquire(struct mpc_buffer_pool *pool) {
+	if (pool->nbuffers == 0) {
+		return -1;
+	}
+
+	while (true) {
+		for (int i = 0; i < pool->nbuffers; i++) {
+			if (!pool->buffers[i].busy) {
+				pool->buffers[i].busy = true;
+				return pool->buffers[i].buffer_id;
+			}
+		}
+
+		/* all buffers are queued or on screen, wait for a release */
+		if (read_event(pool->display, 0) == -1) {
+			return -1;
+		}
+	}
 }
@@ -6,7 +6,7 @@
 
 #define MAX_DRM_DEVICES 4
 
-int open_drm_device() {
+static int open_drm_node(int type) {
 	drmDevicePtr devices[MAX_DRM_DEVICES];
 	int fd = -1;
 
@@ -19,9 +19,9 @@ int open_drm_device() {
 	for (int i = 0; i < num_devices; i++) {
 		drmDevicePtr device = devices[i];
 
-		if (!(device->available_nodes & (1 << DRM_NODE_PRIMARY)))
+		if (!(device->available_nodes & (1 << type)))
 			continue;
-		fd = open(device->nodes[DRM_NODE_PRIMARY], O_RDWR);
+		fd = open(device->nodes[type], O_RDWR);
 	}
 	drmFreeDevices(devices, num_devices);
 
@@ -29,3 +29,13 @@ int open_drm_device() {
 		fprintf(stderr, "no drm device found!\n");
 	return fd;
 }
+
+int open_drm_device() {
+	return open_drm_node(DRM_NODE_PRIMARY);
+}
+
+/* render nodes need no drm master, enough for clients that only allocate
+ * buffers and hand them to the compositor as dmabufs */
+int open_render_device() {
+	return open_drm_node(DRM_NODE_RENDER);
+}
@@ -0,0 +1,215 @@
+#include "shared/wire.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* sends one message, attaching the nfds fds via SCM_RIGHTS */
+ssize_t wire_send(int sockfd, const void *buf, size_t len, const int *fds,
+		int nfds) {
+	struct iovec iov = {
+		.iov_base = (void *) buf,
+		.iov_len = len,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * WIRE_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	if (nfds > WIRE_MAX_FDS) {
+		return -1;
+	}
+	if (nfds > 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	return sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+}
+
+/* sends one message with a single fd attached, unless it is negative */
+ssize_t wire_send_fd(int sockfd, const void *buf, size_t len, int fd) {
+	return wire_send(sockfd, buf, len, &fd, fd >= 0 ? 1 : 0);
+}
+
+/* receives one message, fills fds with up to nfds passed fds and the rest
+ * with -1. returns the message length and the number of fds in *received,
+ * extra fds are closed */
+ssize_t wire_recv(int sockfd, void *buf, size_t len, int *fds, int nfds,
+		int *received, int flags) {
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * WIRE_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	int count = 0;
+	for (int i = 0; i < nfds; i++) {
+		fds[i] = -1;
+	}
+	if (received != NULL) {
+		*received = 0;
+	}
+
+	ssize_t ret = recvmsg(sockfd, &msg, flags | MSG_CMSG_CLOEXEC);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+				|| cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		int passed_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < passed_fds; i++) {
+			int passed;
+			memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int),
+					sizeof(int));
+			if (count < nfds) {
+				fds[count++] = passed;
+			} else {
+				close(passed);
+			}
+		}
+	}
+
+	if (received != NULL) {
+		*received = count;
+	}
+	return ret;
+}
+
+/* receives one message with at most one fd attached, *fd is -1 if there
+ * was none */
+ssize_t wire_recv_fd(int sockfd, void *buf, size_t len, int *fd, int flags) {
+	return wire_recv(sockfd, buf, len, fd, 1, NULL, flags);
+}
+
+void wire_close_fds(int *fds, int nfds) {
+	for (int i = 0; i < nfds; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+			fds[i] = -1;
+		}
+	}
+}
+
+/* only meaningful to the producer, the consumer can only make room */
+bool wire_ring_full(struct wire_ring *ring) {
+	return ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+		>= WIRE_RING_ENTRIES;
+}
+
+/* appends a message to the ring and rings the doorbell eventfd if the
+ * consumer sleeps. returns -1 if the ring is full or the message too big */
+int wire_ring_push(struct wire_ring *ring, int doorbell, const void *buf,
+		size_t len) {
+	uint32_t head = ring->head;
+	struct wire_ring_entry *entry =
+		&ring->entries[head % WIRE_RING_ENTRIES];
+	if (len > sizeof(entry->data) || wire_ring_full(ring)) {
+		return -1;
+	}
+
+	memcpy(entry->data, buf, len);
+	entry->size = len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* either we see the consumer going to sleep or it sees the entry,
+	 * see wire_ring_sleep */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+		uint64_t one = 1;
+		if (write(doorbell, &one, sizeof(one)) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* copies the oldest message of the ring into buf and returns its length.
+ * returns 0 if the ring is empty and -1 if the producer broke it */
+ssize_t wire_ring_pop(struct wire_ring *ring, void *buf, size_t len) {
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return 0;
+	} else if (head - tail > WIRE_RING_ENTRIES) {
+		return -1;
+	}
+
+	/* read once, the producer might change it under us */
+	const struct wire_ring_entry *entry =
+		&ring->entries[tail % WIRE_RING_ENTRIES];
+	uint32_t size = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+	if (size > len || size > sizeof(entry->data)) {
+		return -1;
+	}
+
+	memcpy(buf, entry->data, size);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return size;
+}
+
+/* tells the producer to ring the doorbell from now on. returns false if
+ * a message arrived before it could notice, then the consumer has to pop
+ * it instead of waiting */
+bool wire_ring_sleep(struct wire_ring *ring) {
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) != ring->tail) {
+		wire_ring_wake(ring);
+		return false;
+	}
+	return true;
+}
+
+/* the consumer is awake and polls the ring by itself */
+void wire_ring_wake(struct wire_ring *ring) {
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/* has the consumer tell the producer once it popped from the full ring.
+ * returns false if it did before it could notice, then the producer has
+ * to push instead of waiting */
+bool wire_ring_wait_room(struct wire_ring *ring) {
+	__atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!wire_ring_full(ring)) {
+		__atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+/* called by the consumer after popping. returns true once for a producer
+ * waiting for room, which has to be woken up through its doorbell */
+bool wire_ring_room_wanted(struct wire_ring *ring) {
+	/* pairs with the fence in wire_ring_wait_room */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ring->producer_waiting, __ATOMIC_RELAXED)
+		&& __atomic_exchange_n(&ring->producer_waiting, 0,
+				__ATOMIC_RELAXED);
+}
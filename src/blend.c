@@ -0,0 +1,208 @@
+#include "blend.h"
+
+#include <stdio.h>
+
+#if defined(BLEND_HAVE_X86)
+#include <immintrin.h>
+#endif
+#if defined(BLEND_HAVE_NEON)
+#include <arm_neon.h>
+#endif
+
+/* x / 255 rounded, exact for x <= 255 * 255 and cheap enough to do in 16
+ * bit lanes */
+static inline uint32_t div255(uint32_t x) {
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t blend_pixel(uint32_t d, uint32_t s, uint8_t alpha,
+		uint32_t mask) {
+	s |= mask;
+	if (alpha != 0xFF) {
+		uint32_t scaled = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t c = (s >> shift) & 0xFF;
+			scaled |= div255(c * alpha) << shift;
+		}
+		s = scaled;
+	}
+
+	uint32_t inv = 0xFF - (s >> 24);
+	uint32_t out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		uint32_t c = ((s >> shift) & 0xFF)
+			+ div255(((d >> shift) & 0xFF) * inv);
+		out |= (c > 0xFF ? 0xFF : c) << shift;
+	}
+	return out;
+}
+
+void blend_row_scalar(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque) {
+	uint32_t mask = opaque ? 0xFF000000 : 0;
+	for (int i = 0; i < width; i++) {
+		dst[i] = blend_pixel(dst[i], src[i], alpha, mask);
+	}
+}
+
+#if defined(BLEND_HAVE_X86)
+__attribute__((target("sse2")))
+static inline __m128i div255_sse2(__m128i x) {
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* blends 8 bit channels widened to 16 bit lanes, two pixels at a time */
+__attribute__((target("sse2")))
+static inline __m128i blend_half_sse2(__m128i d, __m128i s, __m128i alpha,
+		bool scale) {
+	if (scale) {
+		s = div255_sse2(_mm_mullo_epi16(s, alpha));
+	}
+	__m128i sa = _mm_shufflehi_epi16(
+			_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3));
+	__m128i inv = _mm_sub_epi16(_mm_set1_epi16(0xFF), sa);
+	return _mm_add_epi16(s, div255_sse2(_mm_mullo_epi16(d, inv)));
+}
+
+__attribute__((target("sse2")))
+void blend_row_sse2(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi32(opaque ? 0xFF000000 : 0);
+	const __m128i alpha16 = _mm_set1_epi16(alpha);
+	const bool scale = alpha != 0xFF;
+
+	int i = 0;
+	for (; i + 4 <= width; i += 4) {
+		__m128i s = _mm_or_si128(_mm_loadu_si128(
+					(const __m128i *) &src[i]), mask);
+		__m128i d = _mm_loadu_si128((const __m128i *) &dst[i]);
+
+		__m128i lo = blend_half_sse2(_mm_unpacklo_epi8(d, zero),
+				_mm_unpacklo_epi8(s, zero), alpha16, scale);
+		__m128i hi = blend_half_sse2(_mm_unpackhi_epi8(d, zero),
+				_mm_unpackhi_epi8(s, zero), alpha16, scale);
+		_mm_storeu_si128((__m128i *) &dst[i],
+				_mm_packus_epi16(lo, hi));
+	}
+
+	blend_row_scalar(&dst[i], &src[i], width - i, alpha, opaque);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255_avx2(__m256i x) {
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	x = _mm256_add_epi16(x, _mm256_srli_epi16(x, 8));
+	return _mm256_srli_epi16(x, 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_half_avx2(__m256i d, __m256i s, __m256i alpha,
+		bool scale) {
+	if (scale) {
+		s = div255_avx2(_mm256_mullo_epi16(s, alpha));
+	}
+	__m256i sa = _mm256_shufflehi_epi16(
+			_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3));
+	__m256i inv = _mm256_sub_epi16(_mm256_set1_epi16(0xFF), sa);
+	return _mm256_add_epi16(s, div255_avx2(_mm256_mullo_epi16(d, inv)));
+}
+
+/* same as the sse2 kernel with twice the lanes. unpack and pack both work
+ * within 128 bit halves, so the pixel order comes out right */
+__attribute__((target("avx2")))
+void blend_row_avx2(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i mask = _mm256_set1_epi32(opaque ? 0xFF000000 : 0);
+	const __m256i alpha16 = _mm256_set1_epi16(alpha);
+	const bool scale = alpha != 0xFF;
+
+	int i = 0;
+	for (; i + 8 <= width; i += 8) {
+		__m256i s = _mm256_or_si256(_mm256_loadu_si256(
+					(const __m256i *) &src[i]), mask);
+		__m256i d = _mm256_loadu_si256((const __m256i *) &dst[i]);
+
+		__m256i lo = blend_half_avx2(_mm256_unpacklo_epi8(d, zero),
+				_mm256_unpacklo_epi8(s, zero), alpha16, scale);
+		__m256i hi = blend_half_avx2(_mm256_unpackhi_epi8(d, zero),
+				_mm256_unpackhi_epi8(s, zero), alpha16, scale);
+		_mm256_storeu_si256((__m256i *) &dst[i],
+				_mm256_packus_epi16(lo, hi));
+	}
+
+	blend_row_sse2(&dst[i], &src[i], width - i, alpha, opaque);
+}
+#endif
+
+#if defined(BLEND_HAVE_NEON)
+static inline uint8x8_t div255_neon(uint16x8_t x) {
+	x = vaddq_u16(x, vdupq_n_u16(128));
+	return vshrn_n_u16(vaddq_u16(x, vshrq_n_u16(x, 8)), 8);
+}
+
+void blend_row_neon(uint32_t *dst, const uint32_t *src, int width,
+		uint8_t alpha, bool opaque) {
+	const uint8x8_t alpha8 = vdup_n_u8(alpha);
+
+	int i = 0;
+	for (; i + 8 <= width; i += 8) {
+		/* deinterleaved into b, g, r, a */
+		uint8x8x4_t s = vld4_u8((const uint8_t *) &src[i]);
+		uint8x8x4_t d = vld4_u8((const uint8_t *) &dst[i]);
+
+		if (opaque) {
+			s.val[3] = vdup_n_u8(0xFF);
+		}
+		if (alpha != 0xFF) {
+			for (int c = 0; c < 4; c++) {
+				s.val[c] = div255_neon(
+						vmull_u8(s.val[c], alpha8));
+			}
+		}
+
+		uint8x8_t inv = vmvn_u8(s.val[3]);
+		for (int c = 0; c < 4; c++) {
+			d.val[c] = vqadd_u8(s.val[c],
+					div255_neon(vmull_u8(d.val[c], inv)));
+		}
+		vst4_u8((uint8_t *) &dst[i], d);
+	}
+
+	blend_row_scalar(&dst[i], &src[i], width - i, alpha, opaque);
+}
+#endif
+
+static blend_row_func pick_blend_row(void) {
+#if defined(BLEND_HAVE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		printf("blend: using avx2\n");
+		return blend_row_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		printf("blend: using sse2\n");
+		return blend_row_sse2;
+	}
+#elif defined(BLEND_HAVE_NEON)
+	printf("blend: using neon\n");
+	return blend_row_neon;
+#endif
+	printf("blend: using scalar code\n");
+	return blend_row_scalar;
+}
+
+/* every output asks, the kernel is only picked and logged once. the
+ * outputs are all set up from the main thread */
+blend_row_func blend_row_select(void) {
+	static blend_row_func selected = NULL;
+	if (selected == NULL) {
+		selected = pick_blend_row();
+	}
+	return selected;
+}
@@ -0,0 +1,284 @@
+#include "capture.h"
+
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* stdio buffer of the output file, a few rows per write */
+#define CAPTURE_FILE_BUFFER (1 << 20)
+
+/* allocates a dumb buffer the size of the mode. YUV420 has its planes one
+ * after another in a buffer of one byte per pixel and half again as many
+ * rows */
+static int buffer_init(struct capture_buffer *buffer,
+		struct kms_backend *backend, uint32_t format, uint32_t width,
+		uint32_t height) {
+	bool yuv = format == DRM_FORMAT_YUV420;
+	struct kms_dumb dumb;
+	int ret = backend->impl->create_dumb(backend, width,
+			yuv ? height + height / 2 : height, yuv ? 8 : 32,
+			&dumb);
+	if (ret < 0) {
+		return ret;
+	}
+	buffer->handle = dumb.handle;
+	buffer->size = dumb.size;
+	buffer->map = dumb.map;
+	buffer->fence = -1;
+
+	buffer->nplanes = 1;
+	buffer->strides[0] = dumb.pitch;
+	buffer->row_sizes[0] = yuv ? width : width * 4;
+	buffer->rows[0] = height;
+	if (yuv) {
+		buffer->nplanes = 3;
+		for (int i = 1; i < 3; i++) {
+			buffer->strides[i] = dumb.pitch / 2;
+			buffer->row_sizes[i] = width / 2;
+			buffer->rows[i] = height / 2;
+			buffer->offsets[i] = buffer->offsets[i - 1]
+				+ buffer->strides[i - 1]
+				* buffer->rows[i - 1];
+		}
+	}
+
+	uint32_t handles[4] = { dumb.handle, dumb.handle, dumb.handle };
+	ret = backend->impl->add_fb(backend, width, height, format, handles,
+			buffer->strides, buffer->offsets, &buffer->fb_id);
+	if (ret < 0) {
+		backend->impl->destroy_dumb(backend, &dumb);
+	}
+	return ret;
+}
+
+static void buffer_finish(struct capture_buffer *buffer,
+		struct kms_backend *backend) {
+	struct kms_dumb dumb = {
+		.handle = buffer->handle,
+		.size = buffer->size,
+		.map = buffer->map,
+	};
+	backend->impl->destroy_fb(backend, buffer->fb_id);
+	backend->impl->destroy_dumb(backend, &dumb);
+}
+
+/* undoes capture_create up to the first nbuffers buffers */
+static void capture_free(struct capture *capture, int nbuffers) {
+	for (int i = 0; i < nbuffers; i++) {
+		buffer_finish(&capture->buffers[i], capture->backend);
+	}
+	pthread_cond_destroy(&capture->cond);
+	pthread_mutex_destroy(&capture->lock);
+	free(capture);
+}
+
+static int write_frame(struct capture *capture,
+		const struct capture_buffer *buffer) {
+	if (capture->y4m && fputs("FRAME\n", capture->file) == EOF) {
+		return -1;
+	}
+
+	for (int i = 0; i < buffer->nplanes; i++) {
+		const char *row = (const char *) buffer->map
+			+ buffer->offsets[i];
+		for (uint32_t y = 0; y < buffer->rows[i]; y++) {
+			if (fwrite(row, buffer->row_sizes[i], 1,
+						capture->file) != 1) {
+				return -1;
+			}
+			row += buffer->strides[i];
+		}
+	}
+	return fflush(capture->file);
+}
+
+/* writes the captured frames out in order. dumb buffers are slow to read
+ * back, but that only holds up this thread: the commit thread drops frames
+ * while every buffer is waiting here */
+static void *capture_thread(void *data) {
+	struct capture *capture = data;
+
+	/* a reader going away should stop the capture, not the compositor */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	trace_thread_name("capture");
+
+	pthread_mutex_lock(&capture->lock);
+	while (!capture->failed) {
+		if (capture->queue_len == 0) {
+			pthread_cond_wait(&capture->cond, &capture->lock);
+			continue;
+		}
+		int idx = capture->queue[capture->queue_start];
+		pthread_mutex_unlock(&capture->lock);
+
+		struct capture_buffer *buffer = &capture->buffers[idx];
+		if (buffer->fence >= 0) {
+			struct pollfd pfd = {
+				.fd = buffer->fence,
+				.events = POLLIN,
+			};
+			poll(&pfd, 1, -1);
+			close(buffer->fence);
+			buffer->fence = -1;
+		}
+
+		uint64_t start = trace_begin();
+		int ret = write_frame(capture, buffer);
+		trace_end("capture write", start, "buffer", idx, NULL, 0);
+		if (ret != 0) {
+			perror("capture: write");
+		}
+
+		pthread_mutex_lock(&capture->lock);
+		capture->queue_start = (capture->queue_start + 1)
+			% CAPTURE_BUFFERS;
+		capture->queue_len--;
+		capture->free_buffers |= 1 << idx;
+		capture->failed = ret != 0;
+		capture->frames += ret == 0;
+	}
+	fprintf(stderr, "capture: stopped after %llu frames, %llu dropped\n",
+			(unsigned long long) capture->frames,
+			(unsigned long long) capture->dropped);
+	pthread_mutex_unlock(&capture->lock);
+
+	fclose(capture->file);
+	return NULL;
+}
+
+/* starts capturing the output into path, which can be a fifo. has to be
+ * called before the initial modeset. returns NULL if the output can't be
+ * captured */
+struct capture *capture_create(struct output *output, const char *path) {
+	struct writeback *writeback = output->writeback;
+	if (writeback == NULL) {
+		fprintf(stderr, "capture: output %d has no writeback "
+				"connector\n", output->index);
+		return NULL;
+	}
+
+	size_t len = strlen(path);
+	bool y4m = len >= 4 && strcmp(path + len - 4, ".y4m") == 0;
+	/* a y4m stream needs the hardware to convert, we won't */
+	uint32_t format = y4m ? DRM_FORMAT_YUV420 : DRM_FORMAT_XRGB8888;
+	if (!writeback_supports_format(writeback, format)) {
+		fprintf(stderr, "capture: writeback of output %d can't write "
+				"%s\n", output->index,
+				y4m ? "YUV420 for y4m" : "XRGB8888");
+		return NULL;
+	}
+
+	drmModeModeInfo *mode = output->mode;
+	if (y4m && (mode->hdisplay % 2 != 0 || mode->vdisplay % 2 != 0)) {
+		fprintf(stderr, "capture: y4m needs an even mode size\n");
+		return NULL;
+	}
+
+	struct capture *ini = calloc(1, sizeof(struct capture));
+	ini->backend = output->backend;
+	ini->output = output;
+	ini->y4m = y4m;
+	ini->attached = -1;
+	ini->free_buffers = (1 << CAPTURE_BUFFERS) - 1;
+	pthread_mutex_init(&ini->lock, NULL);
+	pthread_cond_init(&ini->cond, NULL);
+
+	for (int i = 0; i < CAPTURE_BUFFERS; i++) {
+		int ret = buffer_init(&ini->buffers[i], ini->backend, format,
+				mode->hdisplay, mode->vdisplay);
+		if (ret < 0) {
+			fprintf(stderr, "capture: could not create buffer: "
+					"%s\n", strerror(-ret));
+			capture_free(ini, i);
+			return NULL;
+		}
+	}
+
+	/* blocks until there's a reader if it's a fifo */
+	ini->file = fopen(path, "wb");
+	if (ini->file == NULL) {
+		perror("capture: fopen");
+		capture_free(ini, CAPTURE_BUFFERS);
+		return NULL;
+	}
+	setvbuf(ini->file, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+	if (y4m) {
+		/* one frame per commit, so the rate is only nominal */
+		fprintf(ini->file, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 "
+				"C420jpeg\n", mode->hdisplay, mode->vdisplay,
+				mode->clock * 1000,
+				mode->htotal * mode->vtotal);
+	}
+
+	output_enable_writeback(output);
+
+	int ret = pthread_create(&ini->thread, NULL, capture_thread, ini);
+	assert(ret == 0);
+
+	printf("capture: writing %ux%u %s frames of output %d to %s\n",
+			mode->hdisplay, mode->vdisplay,
+			y4m ? "y4m" : "XRGB8888", output->index, path);
+	return ini;
+}
+
+/* hands a free buffer to the output for its next commit, if there is one
+ * and none is attached yet */
+void capture_prepare(struct capture *capture) {
+	if (capture->attached >= 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&capture->lock);
+	if (!capture->failed && capture->free_buffers != 0) {
+		capture->attached = __builtin_ctz(capture->free_buffers);
+		capture->free_buffers &= ~(1 << capture->attached);
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+	if (capture->attached >= 0) {
+		output_set_writeback_fb(capture->output,
+				capture->buffers[capture->attached].fb_id);
+	}
+}
+
+/* after a commit was queued, passes the buffer it is written into to the
+ * capture thread. a commit without a buffer is counted as dropped */
+void capture_frame_queued(struct capture *capture) {
+	struct writeback *writeback = capture->output->writeback;
+
+	pthread_mutex_lock(&capture->lock);
+	if (capture->attached < 0) {
+		if (!capture->failed && capture->dropped++ == 0) {
+			fprintf(stderr, "warning: capture can't keep up, "
+					"dropping frames\n");
+		}
+	} else if (writeback->fb == 0 && capture->failed) {
+		if (writeback->out_fence >= 0) {
+			close(writeback->out_fence);
+			writeback->out_fence = -1;
+		}
+		capture->attached = -1;
+	} else if (writeback->fb == 0) {
+		struct capture_buffer *buffer =
+			&capture->buffers[capture->attached];
+		buffer->fence = writeback->out_fence;
+		writeback->out_fence = -1;
+
+		int tail = (capture->queue_start + capture->queue_len)
+			% CAPTURE_BUFFERS;
+		capture->queue[tail] = capture->attached;
+		capture->queue_len++;
+		capture->attached = -1;
+		pthread_cond_signal(&capture->cond);
+	}
+	pthread_mutex_unlock(&capture->lock);
+}
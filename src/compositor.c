@@ -1,292 +1,681 @@
 #include "compositor.h"
 
 #include <assert.h>
+#include <drm_fourcc.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-#define MAX_DRM_DEVICES 16
-
-static int set_connector_crtc(int fd, drmModeAtomicReq *req,
-		uint32_t connector_id, int crtc_id) {
-	drmModeObjectProperties *props = drmModeObjectGetProperties(fd,
-			connector_id, DRM_MODE_OBJECT_CONNECTOR);
-	int32_t prop_id = -1;
-	for (uint32_t i = 0; i < props->count_props; i++) {
-		drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
-		bool match = strcmp(prop->name, "CRTC_ID") == 0;
-		prop_id = prop->prop_id;
-		drmModeFreeProperty(prop);
-
-		if (match) {
-			break;
-		} else {
-			prop_id = -1;
-		}
+#include "stats.h"
+#include "trace.h"
+
+const char *const plane_prop_names[PLANE_PROP_COUNT] = {
+	[PLANE_PROP_FB_ID] = "FB_ID",
+	[PLANE_PROP_CRTC_ID] = "CRTC_ID",
+	[PLANE_PROP_SRC_X] = "SRC_X",
+	[PLANE_PROP_SRC_Y] = "SRC_Y",
+	[PLANE_PROP_SRC_W] = "SRC_W",
+	[PLANE_PROP_SRC_H] = "SRC_H",
+	[PLANE_PROP_CRTC_X] = "CRTC_X",
+	[PLANE_PROP_CRTC_Y] = "CRTC_Y",
+	[PLANE_PROP_CRTC_W] = "CRTC_W",
+	[PLANE_PROP_CRTC_H] = "CRTC_H",
+	[PLANE_PROP_ZPOS] = "zpos",
+	[PLANE_PROP_ALPHA] = "alpha",
+	[PLANE_PROP_IN_FENCE_FD] = "IN_FENCE_FD",
+	[PLANE_PROP_FB_DAMAGE_CLIPS] = "FB_DAMAGE_CLIPS",
+	[PLANE_PROP_TYPE] = "type",
+	[PLANE_PROP_IN_FORMATS] = "IN_FORMATS",
+};
+
+const char *const crtc_prop_names[CRTC_PROP_COUNT] = {
+	[CRTC_PROP_MODE_ID] = "MODE_ID",
+	[CRTC_PROP_ACTIVE] = "ACTIVE",
+	[CRTC_PROP_OUT_FENCE_PTR] = "OUT_FENCE_PTR",
+	[CRTC_PROP_VRR_ENABLED] = "VRR_ENABLED",
+};
+
+const char *const connector_prop_names[CONNECTOR_PROP_COUNT] = {
+	[CONNECTOR_PROP_CRTC_ID] = "CRTC_ID",
+	[CONNECTOR_PROP_VRR_CAPABLE] = "vrr_capable",
+};
+
+const char *const writeback_prop_names[WRITEBACK_PROP_COUNT] = {
+	[WRITEBACK_PROP_CRTC_ID] = "CRTC_ID",
+	[WRITEBACK_PROP_FB_ID] = "WRITEBACK_FB_ID",
+	[WRITEBACK_PROP_OUT_FENCE_PTR] = "WRITEBACK_OUT_FENCE_PTR",
+	[WRITEBACK_PROP_PIXEL_FORMATS] = "WRITEBACK_PIXEL_FORMATS",
+};
+
+static int set_connector_property(struct output *output,
+		struct kms_request *req, enum connector_prop prop,
+		uint64_t value) {
+	if (output->connector_missing_props & (1 << prop)) {
+		return -EINVAL;
 	}
-	assert(prop_id != -1);
 
-	drmModeFreeObjectProperties(props);
-	return drmModeAtomicAddProperty(req, connector_id, prop_id, crtc_id);
+	return kms_request_add(req, output->connector_id,
+			output->connector_prop_ids[prop], value);
 }
 
-static int set_crtc_property(int fd, drmModeAtomicReq *req, uint32_t crtc_id,
-				const char *name, uint64_t value) {
-	drmModeObjectProperties *props = drmModeObjectGetProperties(fd,
-			crtc_id, DRM_MODE_OBJECT_CRTC);
-	int32_t prop_id = -1;
-	for (uint32_t i = 0; i < props->count_props; i++) {
-		drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
-		bool match = strcmp(prop->name, name) == 0;
-		prop_id = prop->prop_id;
-		drmModeFreeProperty(prop);
-
-		if (match) {
-			break;
-		} else {
-			prop_id = -1;
-		}
+static int set_crtc_property(struct output *output,
+		struct kms_request *req, enum crtc_prop prop, uint64_t value) {
+	if (output->crtc_missing_props & (1 << prop)) {
+		return -EINVAL;
 	}
-	assert(prop_id != -1);
-	drmModeFreeObjectProperties(props);
 
-	return drmModeAtomicAddProperty(req, crtc_id, prop_id, value);
+	return kms_request_add(req, output->crtc_id,
+			output->crtc_prop_ids[prop], value);
 }
 
-static int set_plane_property(struct plane *plane, drmModeAtomicReq *req,
-		const char *name, uint64_t value) {
-	int prop_id = -1;
-	for (uint32_t i = 0; i < plane->props->count_props; i++) {
-		if (strcmp(plane->props_info[i]->name, name) == 0) {
-			prop_id = plane->props_info[i]->prop_id;
-			break;
-		}
+static int set_writeback_property(struct writeback *writeback,
+		struct kms_request *req, enum writeback_prop prop,
+		uint64_t value) {
+	if (writeback->missing_props & (1 << prop)) {
+		return -EINVAL;
 	}
 
+	return kms_request_add(req, writeback->connector_id,
+			writeback->prop_ids[prop], value);
+}
 
-	if (prop_id < 0) {
-		printf("no plane property: %s\n", name);
+static int set_plane_property(struct plane *plane, struct kms_request *req,
+		enum plane_prop prop, uint64_t value) {
+	if (plane->missing_props & (1 << prop)) {
+		printf("no plane property: %s\n", plane_prop_names[prop]);
 		return -EINVAL;
 	}
 
-	return drmModeAtomicAddProperty(req, plane->plane->plane_id, prop_id, value);
+	return kms_request_add(req, plane->plane_id,
+			plane->prop_ids[prop], value);
 }
 
-static int add_plane_to_req(struct plane *plane, drmModeAtomicReq *req,
+/* computes the pending state of a plane, returns the mask of properties
+ * that are meaningful for it */
+static uint32_t plane_update_pending(struct plane *plane, bool enabled,
 		uint32_t crtc_id, drmModeModeInfo *mode) {
-#define OK(val) if (val == -1) return -1;
-	OK(set_plane_property(plane, req, "FB_ID", plane->fb));
-	OK(set_plane_property(plane, req, "CRTC_ID", crtc_id));
-	OK(set_plane_property(plane, req, "SRC_X", 0));
-	OK(set_plane_property(plane, req, "SRC_Y", 0));
-	OK(set_plane_property(plane, req, "SRC_W", mode->hdisplay << 16));
-	OK(set_plane_property(plane, req, "SRC_H", mode->vdisplay << 16));
-	OK(set_plane_property(plane, req, "CRTC_X", 0));
-	OK(set_plane_property(plane, req, "CRTC_Y", 0));
-	OK(set_plane_property(plane, req, "CRTC_W", mode->hdisplay));
-	OK(set_plane_property(plane, req, "CRTC_H", mode->vdisplay));
-	/* assume the user never sets the zpos for the 0-th plane,
-	 * with is further assumed to be the primary plane */
-	if (plane->zpos != 0) {
-		OK(set_plane_property(plane, req, "zpos", plane->zpos));
-	}
-#undef OK
-	return 0;
-}
-
-
-static int find_drm_device() {
-	drmDevicePtr devices[MAX_DRM_DEVICES];
-	int fd = -1;
+	uint64_t *pending = plane->pending.values;
 
-	int num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
-	if (num_devices < 0) {
-		fprintf(stderr, "drmGetDevices2 failed: %s\n",
-				strerror(-num_devices));
-		return -1;
+	if (!enabled) {
+		pending[PLANE_PROP_FB_ID] = 0;
+		pending[PLANE_PROP_CRTC_ID] = 0;
+		return (1 << PLANE_PROP_FB_ID) | (1 << PLANE_PROP_CRTC_ID);
 	}
 
-	for (int i = 0; i < num_devices; i++) {
-		drmDevicePtr device = devices[i];
-
-		if (!(device->available_nodes & (1 << DRM_NODE_PRIMARY)))
-			continue;
-		fd = open(device->nodes[DRM_NODE_PRIMARY], O_RDWR);
+	/* an unset size means the whole mode */
+	struct plane_layout *layout = &plane->layout;
+	uint32_t src_w = layout->src_w ? layout->src_w : mode->hdisplay;
+	uint32_t src_h = layout->src_h ? layout->src_h : mode->vdisplay;
+	uint32_t crtc_w = layout->crtc_w ? layout->crtc_w : mode->hdisplay;
+	uint32_t crtc_h = layout->crtc_h ? layout->crtc_h : mode->vdisplay;
+
+	pending[PLANE_PROP_FB_ID] = plane->fb;
+	pending[PLANE_PROP_CRTC_ID] = crtc_id;
+	pending[PLANE_PROP_SRC_X] = (uint64_t) layout->src_x << 16;
+	pending[PLANE_PROP_SRC_Y] = (uint64_t) layout->src_y << 16;
+	pending[PLANE_PROP_SRC_W] = (uint64_t) src_w << 16;
+	pending[PLANE_PROP_SRC_H] = (uint64_t) src_h << 16;
+	/* CRTC_X/Y are signed, the kernel wants them sign extended */
+	pending[PLANE_PROP_CRTC_X] = (int64_t) layout->crtc_x;
+	pending[PLANE_PROP_CRTC_Y] = (int64_t) layout->crtc_y;
+	pending[PLANE_PROP_CRTC_W] = crtc_w;
+	pending[PLANE_PROP_CRTC_H] = crtc_h;
+	pending[PLANE_PROP_ZPOS] = plane->zpos;
+	pending[PLANE_PROP_ALPHA] = plane->alpha;
+	pending[PLANE_PROP_IN_FENCE_FD] = plane->in_fence;
+	pending[PLANE_PROP_FB_DAMAGE_CLIPS] = plane->damage_blob;
+
+	/* optional properties are only touched if the plane has them */
+	uint32_t mask = (1 << PLANE_PROP_COUNT) - 1;
+	mask &= ~PLANE_INFO_PROPS;
+	mask &= ~(plane->missing_props
+			& ((1 << PLANE_PROP_ZPOS) | (1 << PLANE_PROP_ALPHA)));
+	/* the kernel doesn't keep fences between commits, so a fence is
+	 * always sent with the commit that follows output_plane_set_fb */
+	if (plane->in_fence < 0) {
+		mask &= ~(1 << PLANE_PROP_IN_FENCE_FD);
 	}
-	drmFreeDevices(devices, num_devices);
-
-	if (fd < 0)
-		fprintf(stderr, "no drm device found!\n");
-	return fd;
-}
-
-static void get_plane_info(int fd, drmModePlane *plane, struct plane *info) {
-	info->plane = plane;
-	info->props = drmModeObjectGetProperties(fd, plane->plane_id,
-			DRM_MODE_OBJECT_PLANE);
-	info->props_info =
-		calloc(info->props->count_props, sizeof(drmModePropertyRes));
-	for (uint32_t i = 0; i < info->props->count_props; i++) {
-		info->props_info[i] =
-			drmModeGetProperty(fd, info->props->props[i]);
+	/* same for damage, without it the whole fb counts as changed */
+	if (plane->damage_blob == 0) {
+		mask &= ~(1 << PLANE_PROP_FB_DAMAGE_CLIPS);
 	}
+	return mask;
 }
 
-static int get_planes_for_crtc(int fd, uint32_t crtc, uint32_t max_planes,
-		struct plane *planes) {
-	drmModePlaneRes *plane_resources = drmModeGetPlaneResources(fd);
-	assert(plane_resources != NULL);
-
-	uint32_t plane_cnt = 0;
-	for (uint32_t i = 0; i < plane_resources->count_planes; i++) {
-		if (plane_cnt >= max_planes) {
-			fprintf(stderr, "more hardware planes available than "
-					"supported (%d)... ignoring extras\n",
-					max_planes);
-			break;
+/* adds the properties that differ from the committed state to the request,
+ * returns the mask of added properties or -1 on error */
+static int add_plane_to_req(struct plane *plane, struct kms_request *req,
+		uint32_t mask) {
+	uint32_t changed = 0;
+
+	for (int i = 0; i < PLANE_PROP_COUNT; i++) {
+		if ((mask & (1 << i)) == 0) {
+			continue;
+		}
+		if ((plane->stale_props & (1 << i)) == 0
+				&& plane->pending.values[i]
+				== plane->committed.values[i]) {
+			continue;
 		}
 
-		drmModePlane *plane = drmModeGetPlane(fd, plane_resources->planes[i]);
-		if (plane->possible_crtcs & (1 << crtc)) {
-			get_plane_info(fd, plane, &planes[plane_cnt]);
-			plane_cnt++;
+		if (set_plane_property(plane, req, i,
+					plane->pending.values[i]) < 0) {
+			return -1;
 		}
+		changed |= 1 << i;
 	}
 
-	drmModeFreePlaneResources(plane_resources);
-	return plane_cnt;
+	return changed;
 }
 
-struct compositor *compositor_create() {
-	struct compositor *ini = calloc(1, sizeof(struct compositor));
-
-	ini->fd = find_drm_device();
-	assert(ini->fd > 0);
-
-	drmModeRes *resources = drmModeGetResources(ini->fd);
-	assert(resources != NULL);
-
-	/* find a connector */
-	drmModeConnector *connector = NULL;
-	for (int i = 0; i < resources->count_connectors; i++) {
-		connector = drmModeGetConnector(ini->fd, resources->connectors[i]);
-		if (connector->connection == DRM_MODE_CONNECTED
-				|| connector->connection == DRM_MODE_UNKNOWNCONNECTION) {
-			/* found either a connector or unknown
-			 * it can be unknown for connectors like composite out */
-			break;
+/* copies the properties that went into a successful commit into the
+ * committed shadow state */
+static void plane_commit_state(struct kms_backend *backend,
+		struct plane *plane, uint32_t changed) {
+	for (int i = 0; i < PLANE_PROP_COUNT; i++) {
+		if (changed & (1 << i)) {
+			plane->committed.values[i] = plane->pending.values[i];
 		}
-		drmModeFreeConnector(connector);
 	}
-	ini->connector_id = connector->connector_id;
-	assert(connector != NULL);
+	plane->stale_props &= ~changed;
 
-	/* find the preferred mode */
-	ini->mode = NULL;
-	for (int i = 0; i < connector->count_modes; i++) {
-		if (connector->modes[i].flags & (DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_DEFAULT)) {
-			ini->mode = &connector->modes[i];
-			break;
-		}
+	if (changed & (1 << PLANE_PROP_IN_FENCE_FD)) {
+		close(plane->in_fence);
+		plane->in_fence = -1;
+	}
+	if (changed & (1 << PLANE_PROP_FB_DAMAGE_CLIPS)) {
+		backend->impl->destroy_blob(backend, plane->damage_blob);
+		plane->damage_blob = 0;
 	}
-	assert(ini->mode != NULL);
+}
+
+/* asks for a vblank event so nothing-changed frames stay paced to the
+ * display without an atomic commit */
+static int request_vblank_event(struct output *output) {
+	struct kms_backend *backend = output->backend;
+	return backend->impl->wait_vblank(backend, output->crtc_index, output);
+}
 
-	/* get the encoder resource */
-	drmModeEncoder *encoder = NULL;
-	for (int i = 0; i < resources->count_encoders; i++) {
-		encoder = drmModeGetEncoder(ini->fd, resources->encoders[i]);
-		if (encoder->encoder_id == connector->encoder_id)
-			break;
-		drmModeFreeEncoder(encoder);
+/* whether the plane can scan out buffers of the given format and modifier,
+ * DRM_FORMAT_INVALID matches anything and DRM_FORMAT_MOD_INVALID stands for
+ * the driver's implicit modifier */
+bool plane_supports_format(const struct plane *plane, uint32_t format,
+		uint64_t modifier) {
+	if (format == DRM_FORMAT_INVALID) {
+		return true;
 	}
-	assert(encoder != NULL);
 
-	ini->crtc_id = 0;
-	for (int i = 0; i < resources->count_crtcs; i++) {
-		if (resources->crtcs[i] == encoder->crtc_id) {
-			ini->crtc_id = encoder->crtc_id;
-			ini->crtc_index = i;
+	for (int i = 0; i < plane->nformats; i++) {
+		const struct plane_format *f = &plane->formats[i];
+		if (f->format != format) {
+			continue;
+		}
+		if (modifier == DRM_FORMAT_MOD_INVALID
+				|| f->modifier == modifier
+				|| (f->modifier == DRM_FORMAT_MOD_INVALID
+					&& modifier == DRM_FORMAT_MOD_LINEAR)) {
+			return true;
 		}
 	}
-	assert(ini->crtc_id != 0);
+	return false;
+}
 
-	drmModeFreeResources(resources);
+/* finds the outputs of the device and their planes */
+struct compositor *compositor_create(struct kms_backend *backend) {
+	struct compositor *ini = calloc(1, sizeof(struct compositor));
+	ini->backend = backend;
+
+	int ret = backend->impl->discover(backend, ini);
+	assert(ret == 0 && ini->noutputs > 0);
+
+	for (int i = 0; i < ini->noutputs; i++) {
+		struct output *output = &ini->outputs[i];
+		printf("compositor: output %d is %ux%u on crtc %u with %d "
+				"planes%s\n", i, output->mode->hdisplay,
+				output->mode->vdisplay, output->crtc_id,
+				output->nplanes, output->writeback != NULL
+				? " and writeback" : "");
+	}
 
-	int ret = 0;
+	return ini;
+}
 
-	ret = drmSetClientCap(ini->fd, DRM_CLIENT_CAP_ATOMIC, 1);
-	if (ret < 0) {
-		fprintf(stderr, "atomic modesetting is required\n");
+static int add_planes_to_req(struct output *output,
+		struct kms_request *req, uint32_t *changed) {
+	for (int i = 0; i < output->nplanes; i++) {
+		struct plane *plane = &output->planes[i];
+		bool enabled = output->enabled_planes & (1 << i);
+
+		uint32_t mask = plane_update_pending(plane, enabled,
+				output->crtc_id, output->mode);
+		int ret = add_plane_to_req(plane, req, mask);
+		if (ret < 0) {
+			return ret;
+		}
+		changed[i] = ret;
 	}
+	return 0;
+}
 
-	ini->nplanes = get_planes_for_crtc(ini->fd, ini->crtc_index,
-			COMPOSITOR_MAX_PLANES, ini->planes);
-	printf("compositor: found %d planes\n", ini->nplanes);
-
-	return ini;
+/* asks the kernel whether the current plane state could be committed,
+ * without touching the hardware or the committed state */
+int output_test(struct output *output) {
+	struct kms_backend *backend = output->backend;
+	struct kms_request req;
+	req.nprops = 0;
+
+	uint32_t changed[COMPOSITOR_MAX_PLANES];
+	int ret = add_planes_to_req(output, &req, changed);
+	if (ret == 0 && req.nprops > 0) {
+		ret = backend->impl->commit(backend, &req,
+				DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	}
+	return ret;
 }
 
-void compositor_draw(struct compositor *compositor, bool modeset) {
-	drmModeAtomicReq *req = drmModeAtomicAlloc();
+/* builds and queues a commit for the current plane state without waiting
+ * for it to complete, returns -EBUSY if the previous frame is still in
+ * flight and should be retried after its event arrives. if no event could
+ * be asked for, flip_pending stays false and it's up to the caller to
+ * retry later, like after any other failure. the plane state stays
+ * pending until a commit of it succeeds or output_revert drops it */
+int output_draw(struct output *output, bool modeset) {
+	if (output->flip_pending) {
+		return -EBUSY;
+	}
+
+	struct kms_backend *backend = output->backend;
+	struct writeback *writeback = output->writeback;
+	struct kms_request req;
+	req.nprops = 0;
 
 	if (modeset) {
-		if (set_connector_crtc(compositor->fd, req, compositor->connector_id,
-					compositor->crtc_id) < 0) {
+		if (set_connector_property(output, &req,
+					CONNECTOR_PROP_CRTC_ID,
+					output->crtc_id) < 0) {
 			fprintf(stderr, "could not set connector crtc\n");
 			assert(0);
 		}
 
 		uint32_t mode_blob = -1;
-		if (drmModeCreatePropertyBlob(compositor->fd, compositor->mode,
+		if (backend->impl->create_blob(backend, output->mode,
 					sizeof(drmModeModeInfo), &mode_blob) != 0) {
 			fprintf(stderr, "could not set create blob for modeset\n");
 			assert(0);
 		}
 
-		if (set_crtc_property(compositor->fd, req, compositor->crtc_id,
-					"MODE_ID", mode_blob) < 0) {
+		if (set_crtc_property(output, &req, CRTC_PROP_MODE_ID,
+					mode_blob) < 0) {
 			fprintf(stderr, "could not set crtc mode property\n");
 			assert(0);
 		}
 
-		if (set_crtc_property(compositor->fd, req, compositor->crtc_id,
-					"ACTIVE", 1) < 0) {
+		if (set_crtc_property(output, &req, CRTC_PROP_ACTIVE,
+					1) < 0) {
 			fprintf(stderr, "could not activate crtc\n");
 			assert(0);
 		}
+
+		/* whoever had the crtc before might have left it on */
+		if ((output->crtc_missing_props
+					& (1 << CRTC_PROP_VRR_ENABLED)) == 0
+				&& set_crtc_property(output, &req,
+					CRTC_PROP_VRR_ENABLED,
+					output->vrr) < 0) {
+			fprintf(stderr, "could not set crtc vrr\n");
+			assert(0);
+		}
+
+		if (writeback != NULL && writeback->enabled
+				&& set_writeback_property(writeback, &req,
+					WRITEBACK_PROP_CRTC_ID,
+					output->crtc_id) < 0) {
+			fprintf(stderr, "could not set writeback crtc\n");
+			assert(0);
+		}
 	}
 
-	for (int i = 0; i < COMPOSITOR_MAX_PLANES; i++) {
-		if ((compositor->enabled_planes & (1 << i)) == 0) {
-			continue;
+	uint32_t changed[COMPOSITOR_MAX_PLANES];
+	if (add_planes_to_req(output, &req, changed) < 0) {
+		fprintf(stderr, "could not add plane properties\n");
+		assert(0);
+	}
+
+	/* nothing changed, skip the commit and just wait for the next vblank */
+	if (!modeset && req.nprops == 0) {
+		output->commit_start_ns = 0;
+		output->commit_end_ns = 0;
+		trace_instant("wait vblank", "output", output->index, NULL, 0);
+		int ret = request_vblank_event(output);
+		if (ret == 0) {
+			output->flip_pending = true;
+		} else {
+			fprintf(stderr, "warning: drmWaitVBlank failed\n");
 		}
+		return ret;
+	}
+
+	output->out_fence = -1;
+	if ((output->crtc_missing_props
+				& (1 << CRTC_PROP_OUT_FENCE_PTR)) == 0) {
+		set_crtc_property(output, &req, CRTC_PROP_OUT_FENCE_PTR,
+				(uint64_t) (uintptr_t) &output->out_fence);
+	}
 
-		if (add_plane_to_req(&compositor->planes[i], req,
-				compositor->crtc_id, compositor->mode) < 0) {
-			fprintf(stderr, "could not add plane properties\n");
+	/* a capture only comes with a commit, the kernel forgets the fb
+	 * again once it has been written */
+	bool capture = writeback != NULL && writeback->fb != 0;
+	if (capture) {
+		writeback->out_fence = -1;
+		if (set_writeback_property(writeback, &req,
+					WRITEBACK_PROP_FB_ID,
+					writeback->fb) < 0
+				|| set_writeback_property(writeback, &req,
+					WRITEBACK_PROP_OUT_FENCE_PTR,
+					(uint64_t) (uintptr_t)
+					&writeback->out_fence) < 0) {
+			fprintf(stderr, "could not add writeback properties\n");
 			assert(0);
 		}
 	}
 
-	uint32_t flags = 0;
+	/* the initial modeset is allowed to block, every later commit is
+	 * queued and completes with the page-flip event */
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT;
 	if (modeset) {
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	} else {
+		flags |= DRM_MODE_ATOMIC_NONBLOCK;
 	}
 
-	if (drmModeAtomicCommit(compositor->fd, req, flags, NULL) < 0) {
+	output->commit_start_ns = stats_now_ns();
+	int ret = backend->impl->commit(backend, &req, flags, output);
+	output->commit_end_ns = stats_now_ns();
+	trace_span("commit", output->commit_start_ns, output->commit_end_ns,
+			"output", output->index, "ret", ret);
+	if (ret < 0) {
+		output->out_fence = -1;
+		if (capture) {
+			writeback->out_fence = -1;
+		}
+	}
+	if (ret == -EBUSY) {
+		/* the kernel is still busy with an earlier commit, try again
+		 * on the next vblank */
+		if (request_vblank_event(output) == 0) {
+			output->flip_pending = true;
+		} else {
+			fprintf(stderr, "warning: drmWaitVBlank failed\n");
+		}
+	} else if (ret < 0) {
 		fprintf(stderr, "warning: drmModeAtomicCommit failed\n");
+	} else {
+		output->flip_pending = true;
+		for (int i = 0; i < output->nplanes; i++) {
+			plane_commit_state(backend, &output->planes[i],
+					changed[i]);
+		}
+		if (capture) {
+			writeback->fb = 0;
+		}
 	}
+	return ret;
+}
+
+static void page_flip_handler(int fd, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+		void *data) {
+	struct output *output = data;
+
+	output->flip_pending = false;
+	output->flip_sequence = sequence;
+	output->flip_time_ns = tv_sec * 1000000000ull + tv_usec * 1000ull;
+	trace_instant_at("flip", output->flip_time_ns, "output",
+			output->index, "sequence", sequence);
+}
+
+static void vblank_handler(int fd, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec, void *data) {
+	page_flip_handler(fd, sequence, tv_sec, tv_usec, 0, data);
+}
+
+static uint32_t pending_outputs(struct compositor *compositor) {
+	uint32_t pending = 0;
+	for (int i = 0; i < compositor->noutputs; i++) {
+		if (compositor->outputs[i].flip_pending) {
+			pending |= 1 << i;
+		}
+	}
+	return pending;
+}
+
+/* reads pending events from the device, returns the mask of outputs whose
+ * pending page flip completed */
+uint32_t compositor_handle_event(struct compositor *compositor) {
+	drmEventContext evctx = {
+		.version = 3,
+		.vblank_handler = vblank_handler,
+		.page_flip_handler2 = page_flip_handler,
+	};
+
+	uint32_t was_pending = pending_outputs(compositor);
+	struct kms_backend *backend = compositor->backend;
+	if (backend->impl->handle_event(backend, &evctx) != 0) {
+		fprintf(stderr, "warning: drmHandleEvent failed\n");
+		return 0;
+	}
+
+	return was_pending & ~pending_outputs(compositor);
+}
+
+/* wraps a client dmabuf into a kms framebuffer, the fds stay owned by the
+ * caller and may be closed right after */
+int compositor_import_dmabuf(struct compositor *compositor,
+		const struct compositor_dmabuf *dmabuf, uint32_t *fb_id) {
+	struct kms_backend *backend = compositor->backend;
+	if (dmabuf->num_planes < 1 || dmabuf->num_planes > 4) {
+		return -EINVAL;
+	}
+	return backend->impl->import_dmabuf(backend, dmabuf, fb_id);
+}
+
+void compositor_destroy_fb(struct compositor *compositor, uint32_t fb_id) {
+	struct kms_backend *backend = compositor->backend;
+	backend->impl->destroy_fb(backend, fb_id);
+}
+
+bool writeback_supports_format(const struct writeback *writeback,
+		uint32_t format) {
+	for (int i = 0; i < writeback->nformats; i++) {
+		if (writeback->formats[i] == format) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* has the initial modeset attach the output's writeback connector to its
+ * crtc, returns -1 if it has none */
+int output_enable_writeback(struct output *output) {
+	if (output->writeback == NULL) {
+		return -1;
+	}
+	output->writeback->enabled = true;
+	return 0;
+}
+
+/* has the initial modeset turn on variable refresh, returns -1 if the
+ * display can't do it */
+int output_enable_vrr(struct output *output) {
+	if (!output->vrr_capable) {
+		return -1;
+	}
+	output->vrr = true;
+	return 0;
+}
+
+/* has the next commit copy what it shows into fb, which has to be the size
+ * of the mode and in one of the writeback formats. the capture is complete
+ * when writeback->out_fence signals, but only once fb was reset to 0 */
+void output_set_writeback_fb(struct output *output, uint32_t fb) {
+	output->writeback->fb = fb;
+}
 
-	drmModeAtomicFree(req);
+/* sets the framebuffer a plane scans out from the next commit on, the plane
+ * takes ownership of in_fence */
+void output_plane_set_fb(struct output *output, uint32_t idx,
+		uint32_t fb, int in_fence) {
+	struct plane *plane = &output->planes[idx];
+
+	/* replaced before it was ever committed */
+	if (plane->in_fence >= 0) {
+		close(plane->in_fence);
+	}
+
+	/* without IN_FENCE_FD the rendering has to be done before we commit.
+	 * the protocol server waits for client fences then, so this only
+	 * blocks for one it couldn't watch */
+	bool has_in_fence = (plane->missing_props
+			& (1 << PLANE_PROP_IN_FENCE_FD)) == 0;
+	if (in_fence >= 0 && !has_in_fence) {
+		struct pollfd pfd = {
+			.fd = in_fence,
+			.events = POLLIN,
+		};
+		poll(&pfd, 1, -1);
+		close(in_fence);
+		in_fence = -1;
+	}
+
+	/* even the same fb has new contents, drivers that copy or transfer
+	 * the framebuffer only pick that up from a commit setting FB_ID */
+	plane->fb = fb;
+	plane->stale_props |= 1 << PLANE_PROP_FB_ID;
+	plane->in_fence = in_fence;
+	if (in_fence >= 0) {
+		plane->stale_props |= 1 << PLANE_PROP_IN_FENCE_FD;
+	}
+	trace_instant("plane fb", "plane", plane->plane_id, "fb", fb);
 }
 
-void compositor_plane_enable(struct compositor *compositor, uint32_t idx) {
-	compositor->enabled_planes |= (1 << idx);
+/* detaches the fence the plane waits for before scanning out its fb and
+ * returns it, -1 if there is none */
+int output_plane_take_fence(struct output *output, uint32_t idx) {
+	struct plane *plane = &output->planes[idx];
+	int in_fence = plane->in_fence;
+	plane->in_fence = -1;
+	return in_fence;
 }
 
-void compositor_plane_disable(struct compositor *compositor, uint32_t idx) {
-	compositor->enabled_planes &= ~(1 << idx);
+/* makes the next update of the plane cover all of its fb */
+static void plane_drop_damage(struct output *output,
+		struct plane *plane) {
+	if (plane->damage_blob != 0) {
+		output->backend->impl->destroy_blob(output->backend,
+				plane->damage_blob);
+		plane->damage_blob = 0;
+	}
+}
+
+/* limits the next update of the plane to the given rectangles of its fb, so
+ * drivers that copy or transfer the framebuffer can skip the rest. no
+ * rectangles means all of it changed */
+void output_plane_set_damage(struct output *output, uint32_t idx,
+		const struct drm_mode_rect *rects, int nrects) {
+	struct plane *plane = &output->planes[idx];
+
+	/* replaced before it was ever committed, the new damage has to cover
+	 * the old one too */
+	if (plane->damage_blob != 0) {
+		plane_drop_damage(output, plane);
+		nrects = 0;
+	}
+
+	if (nrects == 0
+			|| (plane->missing_props
+				& (1 << PLANE_PROP_FB_DAMAGE_CLIPS))) {
+		return;
+	}
+	if (output->backend->impl->create_blob(output->backend, rects,
+				nrects * sizeof(struct drm_mode_rect),
+				&plane->damage_blob) != 0) {
+		fprintf(stderr, "warning: could not create damage blob\n");
+		plane->damage_blob = 0;
+		return;
+	}
+	plane->stale_props |= 1 << PLANE_PROP_FB_DAMAGE_CLIPS;
+}
+
+/* sets where the plane shows its framebuffer and how it stacks, a zpos
+ * outside the plane's range is clamped */
+void output_plane_set_layout(struct output *output, uint32_t idx,
+		const struct plane_layout *layout, bool has_zpos, int zpos,
+		uint16_t alpha) {
+	struct plane *plane = &output->planes[idx];
+
+	/* whatever the plane showed before is gone */
+	plane_drop_damage(output, plane);
+	plane->layout = *layout;
+	plane->alpha = alpha;
+	plane->zpos = plane->default_zpos;
+	if (has_zpos) {
+		plane->zpos = zpos < plane->zpos_min ? plane->zpos_min
+			: zpos > plane->zpos_max ? plane->zpos_max : zpos;
+	}
+	trace_instant("plane layout", "plane", plane->plane_id, "zpos",
+			plane->zpos);
+}
+
+void output_plane_enable(struct output *output, uint32_t idx) {
+	trace_instant("plane enable", "plane", output->planes[idx].plane_id,
+			NULL, 0);
+	output->enabled_planes |= (1 << idx);
+}
+
+void output_plane_disable(struct output *output, uint32_t idx) {
+	trace_instant("plane disable", "plane", output->planes[idx].plane_id,
+			NULL, 0);
+	plane_drop_damage(output, &output->planes[idx]);
+	output->enabled_planes &= ~(1 << idx);
+}
+
+/* makes the planes show what the last successful commit did again, for a
+ * state the kernel rejected. their fences and damage go with it */
+void output_revert(struct output *output) {
+	for (int i = 0; i < output->nplanes; i++) {
+		struct plane *plane = &output->planes[i];
+		const uint64_t *v = plane->committed.values;
+
+		if (plane->in_fence >= 0) {
+			close(plane->in_fence);
+			plane->in_fence = -1;
+		}
+		plane_drop_damage(output, plane);
+		if (v[PLANE_PROP_FB_ID] == 0 || v[PLANE_PROP_CRTC_ID] == 0) {
+			output->enabled_planes &= ~(1 << i);
+			continue;
+		}
+
+		output->enabled_planes |= 1 << i;
+		plane->fb = v[PLANE_PROP_FB_ID];
+		plane->layout = (struct plane_layout) {
+			.src_x = v[PLANE_PROP_SRC_X] >> 16,
+			.src_y = v[PLANE_PROP_SRC_Y] >> 16,
+			.src_w = v[PLANE_PROP_SRC_W] >> 16,
+			.src_h = v[PLANE_PROP_SRC_H] >> 16,
+			.crtc_x = (int32_t) v[PLANE_PROP_CRTC_X],
+			.crtc_y = (int32_t) v[PLANE_PROP_CRTC_Y],
+			.crtc_w = v[PLANE_PROP_CRTC_W],
+			.crtc_h = v[PLANE_PROP_CRTC_H],
+		};
+		if ((plane->missing_props & (1 << PLANE_PROP_ZPOS)) == 0) {
+			plane->zpos = v[PLANE_PROP_ZPOS];
+		}
+		if ((plane->missing_props & (1 << PLANE_PROP_ALPHA)) == 0) {
+			plane->alpha = v[PLANE_PROP_ALPHA];
+		}
+	}
 }
@@ -0,0 +1,285 @@
+#include "cpu_composite.h"
+
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct cpu_composite *cpu_composite_create(struct kms_backend *backend,
+		uint32_t width, uint32_t height) {
+	struct cpu_composite *ini = calloc(1, sizeof(struct cpu_composite));
+
+	ini->backend = backend;
+	ini->width = width;
+	ini->height = height;
+	ini->blend_row = blend_row_select();
+	pthread_mutex_init(&ini->lock, NULL);
+
+	for (int i = 0; i < 2; i++) {
+		struct kms_dumb *fb = &ini->fbs[i];
+		int ret = backend->impl->create_dumb(backend, width, height,
+				32, fb);
+		assert(ret == 0);
+
+		uint32_t handles[4] = { fb->handle };
+		uint32_t strides[4] = { fb->pitch };
+		uint32_t offsets[4] = { 0 };
+		ret = backend->impl->add_fb(backend, width, height,
+				DRM_FORMAT_ARGB8888, handles, strides, offsets,
+				&ini->fb_ids[i]);
+		assert(ret == 0);
+		memset(fb->map, 0, fb->size);
+	}
+
+	/* dumb buffers are usually write-combined and slow to read back, so
+	 * blending happens in a cached copy */
+	ini->shadow = calloc(width * height, sizeof(uint32_t));
+	ini->scratch = malloc(width * sizeof(uint32_t));
+	assert(ini->shadow != NULL && ini->scratch != NULL);
+
+	return ini;
+}
+
+/* the buffer that was drawn last */
+uint32_t cpu_composite_front(struct cpu_composite *composite) {
+	return composite->fb_ids[composite->back ^ 1];
+}
+
+/* for a draw that never reached the screen: the buffer drawn before it is
+ * still scanned out, so the next draw goes into the other one again and
+ * brings all of it up to date */
+void cpu_composite_discard(struct cpu_composite *composite) {
+	composite->back ^= 1;
+	composite->last_damage = (struct drm_mode_rect) {
+		.x2 = composite->width,
+		.y2 = composite->height,
+	};
+}
+
+static struct cpu_buffer *find_buffer(struct cpu_composite *composite,
+		uint32_t fb_id) {
+	for (int i = 0; i < composite->nbuffers; i++) {
+		if (composite->buffers[i].fb_id == fb_id) {
+			return &composite->buffers[i];
+		}
+	}
+	return NULL;
+}
+
+/* maps an imported client buffer so it can be blended if the client ends
+ * up without a plane. only linear 32 bit rgb is supported */
+int cpu_composite_map(struct cpu_composite *composite, uint32_t fb_id,
+		const struct compositor_dmabuf *dmabuf) {
+	bool rgb = dmabuf->format == DRM_FORMAT_ARGB8888
+		|| dmabuf->format == DRM_FORMAT_XRGB8888;
+	bool linear = dmabuf->modifier == DRM_FORMAT_MOD_LINEAR
+		|| dmabuf->modifier == DRM_FORMAT_MOD_INVALID;
+	if (!rgb || !linear || dmabuf->num_planes != 1) {
+		return -1;
+	}
+
+	struct cpu_buffer buffer = {
+		.fb_id = fb_id,
+		.fd = dup(dmabuf->fds[0]),
+		.size = dmabuf->offsets[0]
+			+ (size_t) dmabuf->strides[0] * dmabuf->height,
+		.width = dmabuf->width,
+		.height = dmabuf->height,
+		.stride = dmabuf->strides[0],
+		.offset = dmabuf->offsets[0],
+		.opaque = dmabuf->format == DRM_FORMAT_XRGB8888,
+	};
+	if (buffer.fd < 0) {
+		perror("dup");
+		return -1;
+	}
+
+	buffer.map = mmap(NULL, buffer.size, PROT_READ, MAP_SHARED,
+			buffer.fd, 0);
+	if (buffer.map == MAP_FAILED) {
+		perror("mmap");
+		close(buffer.fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&composite->lock);
+	struct cpu_buffer *buffers = realloc(composite->buffers,
+			(composite->nbuffers + 1) * sizeof(struct cpu_buffer));
+	if (buffers == NULL) {
+		pthread_mutex_unlock(&composite->lock);
+		perror("realloc");
+		munmap(buffer.map, buffer.size);
+		close(buffer.fd);
+		return -1;
+	}
+	composite->buffers = buffers;
+	composite->buffers[composite->nbuffers++] = buffer;
+	pthread_mutex_unlock(&composite->lock);
+	return 0;
+}
+
+/* only from the thread that draws, which may still be reading the mapping
+ * otherwise */
+void cpu_composite_unmap(struct cpu_composite *composite, uint32_t fb_id) {
+	pthread_mutex_lock(&composite->lock);
+	struct cpu_buffer *buffer = find_buffer(composite, fb_id);
+	if (buffer != NULL) {
+		munmap(buffer->map, buffer->size);
+		close(buffer->fd);
+		*buffer = composite->buffers[--composite->nbuffers];
+	}
+	pthread_mutex_unlock(&composite->lock);
+}
+
+static void sync_buffer(struct cpu_buffer *buffer, uint64_t flags) {
+	struct dma_buf_sync sync = {
+		.flags = flags | DMA_BUF_SYNC_READ,
+	};
+	ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+/* blends one client into the shadow buffer, scaling with nearest neighbour
+ * sampling if the source and destination sizes differ */
+static void blend_layer(struct cpu_composite *composite,
+		struct cpu_buffer *buffer, const struct cpu_layer *layer,
+		const struct drm_mode_rect *clip) {
+	const struct plane_layout *layout = &layer->layout;
+	uint32_t src_w = layout->src_w ? layout->src_w : composite->width;
+	uint32_t src_h = layout->src_h ? layout->src_h : composite->height;
+	int64_t crtc_w = layout->crtc_w ? layout->crtc_w : composite->width;
+	int64_t crtc_h = layout->crtc_h ? layout->crtc_h : composite->height;
+
+	/* clip to what's being redrawn, which is on screen */
+	int64_t x0 = layout->crtc_x < clip->x1 ? clip->x1 : layout->crtc_x;
+	int64_t y0 = layout->crtc_y < clip->y1 ? clip->y1 : layout->crtc_y;
+	int64_t x1 = layout->crtc_x + crtc_w;
+	int64_t y1 = layout->crtc_y + crtc_h;
+	if (x1 > clip->x2) {
+		x1 = clip->x2;
+	}
+	if (y1 > clip->y2) {
+		y1 = clip->y2;
+	}
+	if (x0 >= x1 || y0 >= y1 || layout->src_x >= buffer->width) {
+		return;
+	}
+
+	bool scaled = src_w != crtc_w
+		|| layout->src_x + src_w > buffer->width;
+	uint8_t alpha = layer->alpha >> 8;
+
+	sync_buffer(buffer, DMA_BUF_SYNC_START);
+	for (int64_t y = y0; y < y1; y++) {
+		uint64_t sy = layout->src_y
+			+ (uint64_t) (y - layout->crtc_y) * src_h / crtc_h;
+		if (sy >= buffer->height) {
+			break;
+		}
+
+		const uint32_t *row = (const uint32_t *) ((const char *)
+				buffer->map + buffer->offset
+				+ sy * buffer->stride);
+		const uint32_t *src = row + layout->src_x
+			+ (x0 - layout->crtc_x);
+		if (scaled) {
+			for (int64_t x = x0; x < x1; x++) {
+				uint64_t sx = layout->src_x + (uint64_t)
+					(x - layout->crtc_x) * src_w / crtc_w;
+				if (sx >= buffer->width) {
+					sx = buffer->width - 1;
+				}
+				composite->scratch[x - x0] = row[sx];
+			}
+			src = composite->scratch;
+		}
+
+		composite->blend_row(
+				&composite->shadow[y * composite->width + x0],
+				src, x1 - x0, alpha, buffer->opaque);
+	}
+	sync_buffer(buffer, DMA_BUF_SYNC_END);
+}
+
+static void copy_rect(struct cpu_composite *composite, struct kms_dumb *fb,
+		const struct drm_mode_rect *rect) {
+	for (int32_t y = rect->y1; y < rect->y2; y++) {
+		memcpy((char *) fb->map + y * fb->pitch + rect->x1 * 4,
+				&composite->shadow[y * composite->width
+					+ rect->x1],
+				(rect->x2 - rect->x1) * sizeof(uint32_t));
+	}
+}
+
+/* redraws damage (in screen pixels, everything if NULL) by blending the
+ * layers, bottom first, over a transparent background and brings the back
+ * buffer up to date. damage is clipped to the screen. the buffers of the
+ * layers have to be mapped with cpu_composite_map, others are skipped, and
+ * done being rendered into. returns the fb id of the back buffer, which
+ * becomes the front one */
+uint32_t cpu_composite_draw(struct cpu_composite *composite,
+		struct cpu_layer *layers, int nlayers,
+		struct drm_mode_rect *damage) {
+	struct drm_mode_rect screen = {
+		.x2 = composite->width,
+		.y2 = composite->height,
+	};
+	struct drm_mode_rect box = screen;
+	if (damage != NULL) {
+		box.x1 = damage->x1 < 0 ? 0 : damage->x1;
+		box.y1 = damage->y1 < 0 ? 0 : damage->y1;
+		box.x2 = damage->x2 > screen.x2 ? screen.x2 : damage->x2;
+		box.y2 = damage->y2 > screen.y2 ? screen.y2 : damage->y2;
+		if (box.x2 < box.x1) {
+			box.x2 = box.x1;
+		}
+		if (box.y2 < box.y1) {
+			box.y2 = box.y1;
+		}
+		*damage = box;
+	}
+
+	for (int32_t y = box.y1; y < box.y2; y++) {
+		memset(&composite->shadow[y * composite->width + box.x1], 0,
+				(box.x2 - box.x1) * sizeof(uint32_t));
+	}
+
+	if (nlayers > composite->nresolved) {
+		composite->resolved = realloc(composite->resolved,
+				nlayers * sizeof(struct cpu_buffer));
+		assert(composite->resolved != NULL);
+		composite->nresolved = nlayers;
+	}
+	pthread_mutex_lock(&composite->lock);
+	for (int i = 0; i < nlayers; i++) {
+		struct cpu_buffer *buffer = find_buffer(composite,
+				layers[i].fb_id);
+		composite->resolved[i] = buffer != NULL ? *buffer
+			: (struct cpu_buffer) { .map = NULL };
+	}
+	pthread_mutex_unlock(&composite->lock);
+
+	for (int i = 0; i < nlayers; i++) {
+		struct cpu_layer *layer = &layers[i];
+		struct cpu_buffer *buffer = &composite->resolved[i];
+		if (buffer->map == NULL) {
+			fprintf(stderr, "warning: can't composite fb %u\n",
+					layer->fb_id);
+			continue;
+		}
+		blend_layer(composite, buffer, layer, &box);
+	}
+
+	/* the back buffer also misses what was drawn into the front one */
+	struct kms_dumb *fb = &composite->fbs[composite->back];
+	copy_rect(composite, fb, &composite->last_damage);
+	copy_rect(composite, fb, &box);
+	composite->last_damage = box;
+
+	composite->back ^= 1;
+	return composite->fb_ids[composite->back ^ 1];
+}
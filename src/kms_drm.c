@@ -0,0 +1,670 @@
+#include "compositor.h"
+#include "kms_backend.h"
+
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define MAX_DRM_DEVICES 16
+
+/* looks up the ids (and optionally the current values) of the named
+ * properties of a kms object once, so the frame path never has to compare
+ * property names */
+static void resolve_props(int fd, uint32_t object_id, uint32_t object_type,
+		const char *const *names, int count, uint32_t *ids,
+		uint32_t *missing, uint64_t *values) {
+	drmModeObjectProperties *props = drmModeObjectGetProperties(fd,
+			object_id, object_type);
+	assert(props != NULL);
+
+	*missing = (1 << count) - 1;
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		drmModePropertyRes *prop = drmModeGetProperty(fd,
+				props->props[i]);
+		for (int j = 0; j < count; j++) {
+			if (strcmp(prop->name, names[j]) == 0) {
+				ids[j] = prop->prop_id;
+				*missing &= ~(1 << j);
+				if (values != NULL) {
+					values[j] = props->prop_values[i];
+				}
+				break;
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+}
+
+static int find_drm_device() {
+	drmDevicePtr devices[MAX_DRM_DEVICES];
+	int fd = -1;
+
+	int num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
+	if (num_devices < 0) {
+		fprintf(stderr, "drmGetDevices2 failed: %s\n",
+				strerror(-num_devices));
+		return -1;
+	}
+
+	for (int i = 0; i < num_devices; i++) {
+		drmDevicePtr device = devices[i];
+
+		if (!(device->available_nodes & (1 << DRM_NODE_PRIMARY)))
+			continue;
+		fd = open(device->nodes[DRM_NODE_PRIMARY], O_RDWR);
+	}
+	drmFreeDevices(devices, num_devices);
+
+	if (fd < 0)
+		fprintf(stderr, "no drm device found!\n");
+	return fd;
+}
+
+static void add_plane_format(struct plane *plane, uint32_t format,
+		uint64_t modifier) {
+	plane->formats = realloc(plane->formats,
+			(plane->nformats + 1) * sizeof(struct plane_format));
+	plane->formats[plane->nformats++] = (struct plane_format) {
+		.format = format,
+		.modifier = modifier,
+	};
+}
+
+/* collects the format/modifier pairs the plane can scan out, from the
+ * IN_FORMATS blob if there is one */
+static void get_plane_formats(int fd, drmModePlane *plane,
+		struct plane *info) {
+	drmModePropertyBlobRes *blob = NULL;
+	if ((info->missing_props & (1 << PLANE_PROP_IN_FORMATS)) == 0) {
+		blob = drmModeGetPropertyBlob(fd,
+				info->committed.values[PLANE_PROP_IN_FORMATS]);
+	}
+
+	if (blob == NULL) {
+		/* only implicit modifiers without IN_FORMATS */
+		for (uint32_t i = 0; i < plane->count_formats; i++) {
+			add_plane_format(info, plane->formats[i],
+					DRM_FORMAT_MOD_INVALID);
+		}
+		return;
+	}
+
+	struct drm_format_modifier_blob *header = blob->data;
+	uint32_t *formats = (uint32_t *) ((char *) blob->data
+			+ header->formats_offset);
+	struct drm_format_modifier *modifiers = (struct drm_format_modifier *)
+		((char *) blob->data + header->modifiers_offset);
+	for (uint32_t i = 0; i < header->count_modifiers; i++) {
+		for (int bit = 0; bit < 64; bit++) {
+			if ((modifiers[i].formats & (1ull << bit)) == 0) {
+				continue;
+			}
+			add_plane_format(info,
+					formats[modifiers[i].offset + bit],
+					modifiers[i].modifier);
+		}
+	}
+	drmModeFreePropertyBlob(blob);
+}
+
+static void get_plane_info(int fd, drmModePlane *plane, struct plane *info) {
+	info->plane_id = plane->plane_id;
+	info->in_fence = -1;
+	/* the hardware state is unknown until our first commit */
+	info->stale_props = (1 << PLANE_PROP_COUNT) - 1;
+	resolve_props(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE,
+			plane_prop_names, PLANE_PROP_COUNT, info->prop_ids,
+			&info->missing_props, info->committed.values);
+
+	/* keep the zpos and alpha the plane came up with until a client
+	 * asks for something else */
+	info->alpha = 0xFFFF;
+	if ((info->missing_props & (1 << PLANE_PROP_ALPHA)) == 0) {
+		info->alpha = info->committed.values[PLANE_PROP_ALPHA];
+		info->stale_props &= ~(1 << PLANE_PROP_ALPHA);
+	}
+	if ((info->missing_props & (1 << PLANE_PROP_ZPOS)) == 0) {
+		info->zpos = info->committed.values[PLANE_PROP_ZPOS];
+		info->default_zpos = info->zpos;
+		info->stale_props &= ~(1 << PLANE_PROP_ZPOS);
+
+		drmModePropertyRes *zpos = drmModeGetProperty(fd,
+				info->prop_ids[PLANE_PROP_ZPOS]);
+		info->zpos_min = zpos->values[0];
+		info->zpos_max = zpos->values[1];
+		/* some drivers expose a fixed zpos for the primary plane */
+		if (zpos->flags & DRM_MODE_PROP_IMMUTABLE) {
+			info->missing_props |= 1 << PLANE_PROP_ZPOS;
+		}
+		drmModeFreeProperty(zpos);
+	}
+
+	/* without a type property the plane can only be an overlay */
+	info->type = DRM_PLANE_TYPE_OVERLAY;
+	if ((info->missing_props & (1 << PLANE_PROP_TYPE)) == 0) {
+		info->type = info->committed.values[PLANE_PROP_TYPE];
+	}
+	get_plane_formats(fd, plane, info);
+}
+
+/* the type property of a plane, an overlay if it has none */
+static uint64_t get_plane_type(int fd, uint32_t plane_id) {
+	uint32_t id;
+	uint32_t missing;
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+	resolve_props(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+			&plane_prop_names[PLANE_PROP_TYPE], 1, &id, &missing,
+			&type);
+	return type;
+}
+
+/* finds a primary plane not handed out yet that can be used with the
+ * output's crtc, with current set only the one already on it. returns its
+ * index or -1 */
+static int find_primary(drmModePlane **planes, const uint64_t *types,
+		int count, const struct output *output, bool current) {
+	uint32_t crtc_bit = 1 << output->crtc_index;
+	for (int i = 0; i < count; i++) {
+		if (planes[i] == NULL
+				|| types[i] != DRM_PLANE_TYPE_PRIMARY
+				|| (planes[i]->possible_crtcs
+					& crtc_bit) == 0) {
+			continue;
+		}
+		if (!current || planes[i]->crtc_id == output->crtc_id) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* many drivers won't enable a crtc without its primary plane, so every
+ * output gets one of those first. the overlays and cursors then go to
+ * whichever output they can be used with has the fewest planes so far */
+static void get_planes(int fd, struct compositor *compositor) {
+	drmModePlaneRes *plane_resources = drmModeGetPlaneResources(fd);
+	assert(plane_resources != NULL);
+
+	int count = plane_resources->count_planes;
+	drmModePlane **planes = calloc(count, sizeof(drmModePlane *));
+	uint64_t *types = calloc(count, sizeof(uint64_t));
+	assert(count == 0 || (planes != NULL && types != NULL));
+	for (int i = 0; i < count; i++) {
+		planes[i] = drmModeGetPlane(fd, plane_resources->planes[i]);
+		types[i] = get_plane_type(fd, planes[i]->plane_id);
+	}
+
+	/* the primary already on a crtc stays there, the others are handed
+	 * out in order */
+	for (int pass = 0; pass < 2; pass++) {
+		for (int j = 0; j < compositor->noutputs; j++) {
+			struct output *output = &compositor->outputs[j];
+			if (output->nplanes > 0) {
+				continue;
+			}
+			int i = find_primary(planes, types, count, output,
+					pass == 0);
+			if (i < 0) {
+				continue;
+			}
+			get_plane_info(fd, planes[i],
+					&output->planes[output->nplanes++]);
+			drmModeFreePlane(planes[i]);
+			planes[i] = NULL;
+		}
+	}
+	for (int j = 0; j < compositor->noutputs; j++) {
+		if (compositor->outputs[j].nplanes == 0) {
+			fprintf(stderr, "no primary plane for crtc %u\n",
+					compositor->outputs[j].crtc_id);
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		drmModePlane *plane = planes[i];
+		/* a primary left over is another crtc's */
+		if (plane == NULL || types[i] == DRM_PLANE_TYPE_PRIMARY) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		struct output *best = NULL;
+		bool usable = false;
+		for (int j = 0; j < compositor->noutputs; j++) {
+			struct output *output = &compositor->outputs[j];
+			uint32_t crtc_bit = 1 << output->crtc_index;
+			if ((plane->possible_crtcs & crtc_bit) == 0) {
+				continue;
+			}
+			usable = true;
+			if (output->nplanes < COMPOSITOR_MAX_PLANES
+					&& (best == NULL
+						|| output->nplanes
+						< best->nplanes)) {
+				best = output;
+			}
+		}
+
+		if (best == NULL) {
+			if (usable) {
+				fprintf(stderr, "more hardware planes "
+						"available than supported "
+						"(%d)... ignoring extras\n",
+						COMPOSITOR_MAX_PLANES);
+			}
+			drmModeFreePlane(plane);
+			continue;
+		}
+		get_plane_info(fd, plane, &best->planes[best->nplanes++]);
+		drmModeFreePlane(plane);
+	}
+
+	free(types);
+	free(planes);
+	drmModeFreePlaneResources(plane_resources);
+}
+
+/* picks a free crtc for the connector, preferring the one that already
+ * drives it. returns its index or -1 */
+static int find_crtc(int fd, drmModeRes *resources,
+		drmModeConnector *connector, uint32_t used_crtcs) {
+	drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoder_id);
+	if (encoder != NULL) {
+		for (int i = 0; i < resources->count_crtcs; i++) {
+			if (resources->crtcs[i] == encoder->crtc_id
+					&& (used_crtcs & (1 << i)) == 0) {
+				drmModeFreeEncoder(encoder);
+				return i;
+			}
+		}
+		drmModeFreeEncoder(encoder);
+	}
+
+	for (int i = 0; i < connector->count_encoders; i++) {
+		encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+		if (encoder == NULL) {
+			continue;
+		}
+		uint32_t possible = encoder->possible_crtcs & ~used_crtcs;
+		drmModeFreeEncoder(encoder);
+
+		for (int j = 0; j < resources->count_crtcs; j++) {
+			if (possible & (1 << j)) {
+				return j;
+			}
+		}
+	}
+	return -1;
+}
+
+static void output_init(struct output *output, struct kms_backend *backend,
+		drmModeRes *resources, drmModeConnector *connector,
+		int crtc_index) {
+	int fd = backend->fd;
+	output->backend = backend;
+	output->connector_id = connector->connector_id;
+
+	/* find the preferred mode */
+	output->mode = &connector->modes[0];
+	for (int i = 0; i < connector->count_modes; i++) {
+		if (connector->modes[i].type
+				& (DRM_MODE_TYPE_PREFERRED
+					| DRM_MODE_TYPE_DEFAULT)) {
+			output->mode = &connector->modes[i];
+			break;
+		}
+	}
+	output->refresh_ns = (uint64_t) output->mode->htotal
+		* output->mode->vtotal * 1000000 / output->mode->clock;
+
+	output->crtc_id = resources->crtcs[crtc_index];
+	output->crtc_index = crtc_index;
+
+	resolve_props(fd, output->crtc_id, DRM_MODE_OBJECT_CRTC,
+			crtc_prop_names, CRTC_PROP_COUNT, output->crtc_prop_ids,
+			&output->crtc_missing_props, NULL);
+	uint64_t values[CONNECTOR_PROP_COUNT];
+	resolve_props(fd, output->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+			connector_prop_names, CONNECTOR_PROP_COUNT,
+			output->connector_prop_ids,
+			&output->connector_missing_props, values);
+
+	/* the connector says whether the display can, the crtc has to be
+	 * able to drive it */
+	output->vrr_capable = (output->connector_missing_props
+			& (1 << CONNECTOR_PROP_VRR_CAPABLE)) == 0
+		&& values[CONNECTOR_PROP_VRR_CAPABLE] != 0
+		&& (output->crtc_missing_props
+			& (1 << CRTC_PROP_VRR_ENABLED)) == 0;
+
+	/* the cursor plane only takes buffers up to this size */
+	uint64_t cap;
+	output->cursor_width = 64;
+	if (drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &cap) == 0) {
+		output->cursor_width = cap;
+	}
+	output->cursor_height = 64;
+	if (drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &cap) == 0) {
+		output->cursor_height = cap;
+	}
+
+	output->out_fence = -1;
+}
+
+static struct writeback *writeback_create(int fd,
+		drmModeConnector *connector) {
+	struct writeback *ini = calloc(1, sizeof(struct writeback));
+	ini->connector_id = connector->connector_id;
+	ini->out_fence = -1;
+
+	uint64_t values[WRITEBACK_PROP_COUNT];
+	resolve_props(fd, connector->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+			writeback_prop_names, WRITEBACK_PROP_COUNT,
+			ini->prop_ids, &ini->missing_props, values);
+
+	drmModePropertyBlobRes *blob = NULL;
+	if ((ini->missing_props & (1 << WRITEBACK_PROP_PIXEL_FORMATS)) == 0) {
+		blob = drmModeGetPropertyBlob(fd,
+				values[WRITEBACK_PROP_PIXEL_FORMATS]);
+	}
+	if (blob != NULL) {
+		ini->formats = malloc(blob->length);
+		memcpy(ini->formats, blob->data, blob->length);
+		ini->nformats = blob->length / sizeof(uint32_t);
+		drmModeFreePropertyBlob(blob);
+	}
+	return ini;
+}
+
+/* gives a writeback connector to the first output without one whose crtc
+ * it can capture */
+static void attach_writeback(struct compositor *compositor,
+		drmModeConnector *connector) {
+	uint32_t possible_crtcs = 0;
+	for (int i = 0; i < connector->count_encoders; i++) {
+		drmModeEncoder *encoder = drmModeGetEncoder(
+				compositor->backend->fd,
+				connector->encoders[i]);
+		if (encoder != NULL) {
+			possible_crtcs |= encoder->possible_crtcs;
+			drmModeFreeEncoder(encoder);
+		}
+	}
+
+	for (int i = 0; i < compositor->noutputs; i++) {
+		struct output *output = &compositor->outputs[i];
+		uint32_t crtc_bit = 1 << output->crtc_index;
+		if (output->writeback == NULL && (possible_crtcs & crtc_bit)) {
+			output->writeback = writeback_create(
+					compositor->backend->fd, connector);
+			return;
+		}
+	}
+}
+
+/* drives every connector that has something plugged in, or might: it can
+ * be unknown for connectors like composite out */
+static int drm_discover(struct kms_backend *backend,
+		struct compositor *compositor) {
+	int fd = backend->fd;
+	drmModeRes *resources = drmModeGetResources(fd);
+	assert(resources != NULL);
+
+	uint32_t used_crtcs = 0;
+	for (int i = 0; i < resources->count_connectors; i++) {
+		drmModeConnector *connector = drmModeGetConnector(fd,
+				resources->connectors[i]);
+		if (connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK
+				|| (connector->connection != DRM_MODE_CONNECTED
+					&& connector->connection
+					!= DRM_MODE_UNKNOWNCONNECTION)
+				|| connector->count_modes == 0) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		if (compositor->noutputs == COMPOSITOR_MAX_OUTPUTS) {
+			fprintf(stderr, "more outputs connected than supported "
+					"(%d)... ignoring extras\n",
+					COMPOSITOR_MAX_OUTPUTS);
+			drmModeFreeConnector(connector);
+			break;
+		}
+
+		int crtc = find_crtc(fd, resources, connector,
+				used_crtcs);
+		if (crtc < 0) {
+			fprintf(stderr, "no crtc left for connector %u\n",
+					connector->connector_id);
+			drmModeFreeConnector(connector);
+			continue;
+		}
+		used_crtcs |= 1 << crtc;
+
+		struct output *output =
+			&compositor->outputs[compositor->noutputs];
+		output_init(output, backend, resources, connector, crtc);
+		output->index = compositor->noutputs++;
+	}
+
+	/* writeback connectors don't show anything, they can only be used
+	 * along with a crtc that is already driven */
+	for (int i = 0; i < resources->count_connectors; i++) {
+		drmModeConnector *connector = drmModeGetConnector(fd,
+				resources->connectors[i]);
+		if (connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+			attach_writeback(compositor, connector);
+		}
+		drmModeFreeConnector(connector);
+	}
+
+	drmModeFreeResources(resources);
+
+	get_planes(fd, compositor);
+	return compositor->noutputs > 0 ? 0 : -ENODEV;
+}
+
+static int drm_commit(struct kms_backend *backend,
+		const struct kms_request *req, uint32_t flags,
+		void *user_data) {
+	drmModeAtomicReq *atomic = drmModeAtomicAlloc();
+	if (atomic == NULL) {
+		return -ENOMEM;
+	}
+
+	int ret = 0;
+	for (int i = 0; i < req->nprops && ret >= 0; i++) {
+		const struct kms_prop_value *prop = &req->props[i];
+		ret = drmModeAtomicAddProperty(atomic, prop->object_id,
+				prop->prop_id, prop->value);
+	}
+	if (ret >= 0) {
+		ret = drmModeAtomicCommit(backend->fd, atomic, flags,
+				user_data);
+	}
+
+	drmModeAtomicFree(atomic);
+	return ret;
+}
+
+static int drm_wait_vblank(struct kms_backend *backend, uint32_t crtc_index,
+		void *user_data) {
+	drmVBlank vbl = {
+		.request = {
+			.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT
+				| ((crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT)
+					& DRM_VBLANK_HIGH_CRTC_MASK),
+			.sequence = 1,
+			.signal = (unsigned long) user_data,
+		},
+	};
+
+	return drmWaitVBlank(backend->fd, &vbl);
+}
+
+static int drm_handle_event(struct kms_backend *backend,
+		drmEventContext *context) {
+	return drmHandleEvent(backend->fd, context);
+}
+
+static int drm_create_blob(struct kms_backend *backend, const void *data,
+		size_t size, uint32_t *blob_id) {
+	return drmModeCreatePropertyBlob(backend->fd, data, size, blob_id);
+}
+
+static void drm_destroy_blob(struct kms_backend *backend, uint32_t blob_id) {
+	drmModeDestroyPropertyBlob(backend->fd, blob_id);
+}
+
+static void close_gem_handle(int fd, uint32_t handle) {
+	struct drm_gem_close args = {
+		.handle = handle,
+	};
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &args);
+}
+
+static int drm_import_dmabuf(struct kms_backend *backend,
+		const struct compositor_dmabuf *dmabuf, uint32_t *fb_id) {
+	int ret = 0;
+	uint32_t handles[4] = { 0 };
+	uint64_t modifiers[4] = { 0 };
+
+	for (int i = 0; i < dmabuf->num_planes; i++) {
+		ret = drmPrimeFDToHandle(backend->fd, dmabuf->fds[i],
+				&handles[i]);
+		if (ret < 0) {
+			ret = -errno;
+			fprintf(stderr, "drmPrimeFDToHandle failed: %s\n",
+					strerror(-ret));
+			goto out;
+		}
+		modifiers[i] = dmabuf->modifier;
+	}
+
+	uint32_t flags = 0;
+	if (dmabuf->modifier != DRM_FORMAT_MOD_INVALID) {
+		flags |= DRM_MODE_FB_MODIFIERS;
+	}
+	ret = drmModeAddFB2WithModifiers(backend->fd, dmabuf->width,
+			dmabuf->height, dmabuf->format, handles,
+			dmabuf->strides, dmabuf->offsets,
+			flags ? modifiers : NULL, fb_id, flags);
+	if (ret < 0) {
+		fprintf(stderr, "drmModeAddFB2WithModifiers failed: %s\n",
+				strerror(-ret));
+	}
+
+out:
+	/* the framebuffer holds its own reference, planes sharing one
+	 * dmabuf get the same handle, which must only be closed once */
+	for (int i = 0; i < dmabuf->num_planes; i++) {
+		bool dup = false;
+		for (int j = 0; j < i; j++) {
+			dup |= handles[j] == handles[i];
+		}
+		if (handles[i] != 0 && !dup) {
+			close_gem_handle(backend->fd, handles[i]);
+		}
+	}
+	return ret;
+}
+
+static void drm_destroy_fb(struct kms_backend *backend, uint32_t fb_id) {
+	drmModeRmFB(backend->fd, fb_id);
+}
+
+static int drm_create_dumb(struct kms_backend *backend, uint32_t width,
+		uint32_t height, uint32_t bpp, struct kms_dumb *dumb) {
+	struct drm_mode_create_dumb create = {
+		.width = width,
+		.height = height,
+		.bpp = bpp,
+	};
+	int ret = drmIoctl(backend->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	if (ret < 0) {
+		return -errno;
+	}
+
+	struct drm_mode_destroy_dumb destroy = { .handle = create.handle };
+	struct drm_mode_map_dumb map = { .handle = create.handle };
+	ret = drmIoctl(backend->fd, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	if (ret < 0) {
+		ret = -errno;
+		goto err;
+	}
+	void *ptr = mmap(NULL, create.size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, backend->fd, map.offset);
+	if (ptr == MAP_FAILED) {
+		ret = -errno;
+		goto err;
+	}
+
+	*dumb = (struct kms_dumb) {
+		.handle = create.handle,
+		.pitch = create.pitch,
+		.size = create.size,
+		.map = ptr,
+	};
+	return 0;
+
+err:
+	/* callers expect nothing to be left behind on failure */
+	drmIoctl(backend->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	return ret;
+}
+
+static void drm_destroy_dumb(struct kms_backend *backend,
+		const struct kms_dumb *dumb) {
+	struct drm_mode_destroy_dumb destroy = { .handle = dumb->handle };
+	munmap(dumb->map, dumb->size);
+	drmIoctl(backend->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+}
+
+static int drm_add_fb(struct kms_backend *backend, uint32_t width,
+		uint32_t height, uint32_t format, const uint32_t handles[4],
+		const uint32_t strides[4], const uint32_t offsets[4],
+		uint32_t *fb_id) {
+	return drmModeAddFB2(backend->fd, width, height, format, handles,
+			strides, offsets, fb_id, 0);
+}
+
+static const struct kms_backend_impl drm_impl = {
+	.discover = drm_discover,
+	.commit = drm_commit,
+	.wait_vblank = drm_wait_vblank,
+	.handle_event = drm_handle_event,
+	.create_blob = drm_create_blob,
+	.destroy_blob = drm_destroy_blob,
+	.import_dmabuf = drm_import_dmabuf,
+	.create_dumb = drm_create_dumb,
+	.destroy_dumb = drm_destroy_dumb,
+	.add_fb = drm_add_fb,
+	.destroy_fb = drm_destroy_fb,
+};
+
+/* the first drm device, with atomic modesetting */
+struct kms_backend *kms_drm_create(void) {
+	int fd = find_drm_device();
+	if (fd < 0) {
+		return NULL;
+	}
+
+	int ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret < 0) {
+		fprintf(stderr, "atomic modesetting is required\n");
+	}
+	/* only needed for capturing, not every driver has them */
+	drmSetClientCap(fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+
+	struct kms_backend *ini = calloc(1, sizeof(struct kms_backend));
+	ini->impl = &drm_impl;
+	ini->fd = fd;
+	return ini;
+}
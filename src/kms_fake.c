@@ -0,0 +1,838 @@
+#include "compositor.h"
+#include "kms_backend.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FAKE_CRTC_BASE 0x100
+#define FAKE_CONNECTOR_BASE 0x200
+#define FAKE_PLANE_BASE 0x300
+#define FAKE_MAX_FORMATS 16
+#define FAKE_MAX_PLANES (COMPOSITOR_MAX_OUTPUTS * COMPOSITOR_MAX_PLANES)
+
+/* how the fake device looks and behaves, from the ":key=value,..." part
+ * of the backend name */
+struct fake_config {
+	int noutputs;
+	uint32_t width;
+	uint32_t height;
+	uint32_t refresh_hz;
+	/* per output: a primary plane, overlays and a cursor if cursor */
+	int nplanes;
+	bool cursor;
+	int nformats;
+	uint32_t formats[FAKE_MAX_FORMATS];
+	bool zpos;
+	bool alpha;
+
+	/* a commit is shown on the first vblank at least flip_delay_us after
+	 * it, and the commit call itself takes commit_us */
+	uint32_t flip_delay_us;
+	uint32_t commit_us;
+	/* events are due right away instead of on the next vblank, to run
+	 * the frame loop as fast as it goes */
+	bool unpaced;
+	/* the displays can vary their refresh rate between vrr_min_hz and
+	 * refresh_hz, 0 if they can't */
+	uint32_t vrr_min_hz;
+
+	/* commits, tests included, are rejected if a crtc would have more
+	 * than max_active planes (0 for no limit) or if a plane would
+	 * scale without scaling */
+	int max_active;
+	bool scaling;
+	/* every nth real commit fails, 0 for never */
+	int fail_every;
+};
+
+struct fake_fb {
+	uint32_t id;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct fake_blob {
+	uint32_t id;
+	size_t size;
+	void *data;
+};
+
+struct fake_plane {
+	uint32_t type;
+	int output;
+	uint64_t values[PLANE_PROP_COUNT];
+};
+
+/* everything a commit can change, so it can be checked on a copy */
+struct fake_state {
+	uint64_t crtcs[COMPOSITOR_MAX_OUTPUTS][CRTC_PROP_COUNT];
+	uint64_t connectors[COMPOSITOR_MAX_OUTPUTS][CONNECTOR_PROP_COUNT];
+	struct fake_plane planes[FAKE_MAX_PLANES];
+};
+
+/* a page-flip or vblank event due at time_ns */
+struct fake_event {
+	bool queued;
+	uint64_t time_ns;
+	uint32_t sequence;
+	void *user_data;
+};
+
+/* a display device that only exists in memory. its vblanks are ticks of a
+ * timer that started with it, and its events come in through a timerfd */
+struct kms_fake {
+	struct kms_backend base;
+	struct fake_config config;
+
+	drmModeModeInfo mode;
+	uint64_t epoch_ns;
+	uint64_t refresh_ns;
+
+	struct fake_state state;
+	int nplanes;
+	/* a commit is waiting for its flip */
+	bool flip_pending[COMPOSITOR_MAX_OUTPUTS];
+	/* per output the flip and the vblank event */
+	struct fake_event events[COMPOSITOR_MAX_OUTPUTS][2];
+	/* with variable refresh, the time and sequence of the last refresh
+	 * of each output, queued ones included */
+	uint64_t vrr_refresh_ns[COMPOSITOR_MAX_OUTPUTS];
+	uint32_t vrr_sequence[COMPOSITOR_MAX_OUTPUTS];
+	uint64_t ncommits;
+
+	/* fbs are imported on the protocol thread while the commit thread
+	 * looks them up, so they, the blobs and next_id are only touched
+	 * under lock */
+	pthread_mutex_t lock;
+	uint32_t next_id;
+	int nfbs;
+	struct fake_fb *fbs;
+	int nblobs;
+	struct fake_blob *blobs;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the first vblank after time_ns, and its sequence number */
+static uint64_t next_vblank(struct kms_fake *fake, uint64_t time_ns,
+		uint32_t *sequence) {
+	uint64_t count = time_ns < fake->epoch_ns ? 0
+		: (time_ns - fake->epoch_ns) / fake->refresh_ns;
+	*sequence = count + 1;
+	return fake->epoch_ns + (count + 1) * fake->refresh_ns;
+}
+
+/* with variable refresh a flip is shown as soon as it comes, but no sooner
+ * than one refresh after the last. without a flip the display refreshes
+ * on its own once it waited as long as it can */
+static uint64_t next_vrr_refresh(struct kms_fake *fake, int output,
+		bool flip, uint64_t time_ns, uint32_t *sequence) {
+	uint64_t max_period = 1000000000ull / fake->config.vrr_min_hz;
+	uint64_t last = fake->vrr_refresh_ns[output];
+	uint32_t count = fake->vrr_sequence[output];
+
+	/* the refreshes it did on its own since */
+	if (time_ns > last + max_period) {
+		uint64_t n = (time_ns - last) / max_period;
+		last += n * max_period;
+		count += n;
+	}
+
+	uint64_t next = last + (flip ? fake->refresh_ns : max_period);
+	if (flip && time_ns > next) {
+		next = time_ns;
+	}
+	fake->vrr_refresh_ns[output] = next;
+	fake->vrr_sequence[output] = *sequence = count + 1;
+	return next;
+}
+
+/* arms the timer for the earliest queued event */
+static void arm_timer(struct kms_fake *fake) {
+	uint64_t earliest = 0;
+	for (int i = 0; i < fake->config.noutputs; i++) {
+		for (int j = 0; j < 2; j++) {
+			struct fake_event *event = &fake->events[i][j];
+			if (event->queued && (earliest == 0
+						|| event->time_ns < earliest)) {
+				earliest = event->time_ns;
+			}
+		}
+	}
+
+	/* zero disarms it, anything in the past fires right away */
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = earliest / 1000000000,
+			.tv_nsec = earliest % 1000000000,
+		},
+	};
+	timerfd_settime(fake->base.fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void queue_event(struct kms_fake *fake, int output, bool flip,
+		uint64_t after_ns, void *user_data) {
+	struct fake_event *event = &fake->events[output][flip ? 0 : 1];
+	event->queued = true;
+	if (fake->state.crtcs[output][CRTC_PROP_VRR_ENABLED]) {
+		event->time_ns = next_vrr_refresh(fake, output, flip,
+				after_ns, &event->sequence);
+	} else {
+		event->time_ns = next_vblank(fake, after_ns,
+				&event->sequence);
+	}
+	if (fake->config.unpaced) {
+		event->time_ns = after_ns;
+	}
+	event->user_data = user_data;
+	arm_timer(fake);
+}
+
+static struct fake_fb *find_fb(struct kms_fake *fake, uint32_t id) {
+	for (int i = 0; i < fake->nfbs; i++) {
+		if (fake->fbs[i].id == id) {
+			return &fake->fbs[i];
+		}
+	}
+	return NULL;
+}
+
+static struct fake_blob *find_blob(struct kms_fake *fake, uint32_t id) {
+	for (int i = 0; i < fake->nblobs; i++) {
+		if (fake->blobs[i].id == id) {
+			return &fake->blobs[i];
+		}
+	}
+	return NULL;
+}
+
+static bool supports_format(struct kms_fake *fake,
+		const struct fake_plane *plane, uint32_t format) {
+	if (plane->type == DRM_PLANE_TYPE_CURSOR) {
+		return format == DRM_FORMAT_ARGB8888;
+	}
+	for (int i = 0; i < fake->config.nformats; i++) {
+		if (fake->config.formats[i] == format) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* what the kernel's atomic check would say about state */
+static int check_state(struct kms_fake *fake, const struct fake_state *state) {
+	int active[COMPOSITOR_MAX_OUTPUTS] = { 0 };
+
+	for (int i = 0; i < fake->nplanes; i++) {
+		const struct fake_plane *plane = &state->planes[i];
+		const uint64_t *v = plane->values;
+		if (v[PLANE_PROP_FB_ID] == 0 || v[PLANE_PROP_CRTC_ID] == 0) {
+			if (v[PLANE_PROP_FB_ID] != v[PLANE_PROP_CRTC_ID]) {
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		int output = v[PLANE_PROP_CRTC_ID] - FAKE_CRTC_BASE;
+		struct fake_fb *fb = find_fb(fake, v[PLANE_PROP_FB_ID]);
+		if (output != plane->output || fb == NULL
+				|| !state->crtcs[output][CRTC_PROP_ACTIVE]
+				|| !supports_format(fake, plane, fb->format)) {
+			return -EINVAL;
+		}
+
+		/* like the kernel, an enabled plane can't be empty */
+		if (v[PLANE_PROP_SRC_W] == 0 || v[PLANE_PROP_SRC_H] == 0
+				|| v[PLANE_PROP_CRTC_W] == 0
+				|| v[PLANE_PROP_CRTC_H] == 0) {
+			return -EINVAL;
+		}
+
+		uint64_t src_w = v[PLANE_PROP_SRC_W] >> 16;
+		uint64_t src_h = v[PLANE_PROP_SRC_H] >> 16;
+		if (((v[PLANE_PROP_SRC_X] >> 16) + src_w > fb->width)
+				|| ((v[PLANE_PROP_SRC_Y] >> 16) + src_h
+					> fb->height)) {
+			return -ENOSPC;
+		}
+		bool scaled = src_w != v[PLANE_PROP_CRTC_W]
+			|| src_h != v[PLANE_PROP_CRTC_H];
+		bool cursor = plane->type == DRM_PLANE_TYPE_CURSOR;
+		if (scaled && (!fake->config.scaling || cursor)) {
+			return -ERANGE;
+		}
+
+		active[output]++;
+		if (fake->config.max_active > 0
+				&& active[output] > fake->config.max_active) {
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/* applies one property to state, the mask of outputs it concerns goes into
+ * touched and OUT_FENCE_PTRs into out_fences */
+static int set_prop(struct kms_fake *fake, struct fake_state *state,
+		const struct kms_prop_value *prop, uint32_t *touched,
+		int32_t **out_fences) {
+	uint32_t id = prop->object_id;
+	uint32_t prop_idx = prop->prop_id - 1;
+	uint32_t noutputs = fake->config.noutputs;
+
+	if (id >= FAKE_CRTC_BASE && id < FAKE_CRTC_BASE + noutputs
+			&& prop_idx < CRTC_PROP_COUNT) {
+		int output = id - FAKE_CRTC_BASE;
+		*touched |= 1 << output;
+		/* not part of the state, it's only good for one commit */
+		if (prop_idx == CRTC_PROP_OUT_FENCE_PTR) {
+			out_fences[output] =
+				(int32_t *) (uintptr_t) prop->value;
+			return 0;
+		}
+		if (prop_idx == CRTC_PROP_MODE_ID
+				&& find_blob(fake, prop->value) == NULL) {
+			return -EINVAL;
+		}
+		if (prop_idx == CRTC_PROP_VRR_ENABLED && prop->value != 0
+				&& fake->config.vrr_min_hz == 0) {
+			return -EINVAL;
+		}
+		state->crtcs[output][prop_idx] = prop->value;
+		return 0;
+	}
+
+	if (id >= FAKE_CONNECTOR_BASE && id < FAKE_CONNECTOR_BASE + noutputs
+			&& prop_idx < CONNECTOR_PROP_COUNT) {
+		int output = id - FAKE_CONNECTOR_BASE;
+		uint64_t crtc_id = FAKE_CRTC_BASE + output;
+		if (prop_idx == CONNECTOR_PROP_VRR_CAPABLE) {
+			return -EINVAL;
+		}
+		/* every connector has a crtc of its own */
+		if (prop->value != 0 && prop->value != crtc_id) {
+			return -EINVAL;
+		}
+		*touched |= 1 << output;
+		state->connectors[output][prop_idx] = prop->value;
+		return 0;
+	}
+
+	int idx = id - FAKE_PLANE_BASE;
+	if (id >= FAKE_PLANE_BASE && idx < fake->nplanes
+			&& prop_idx < PLANE_PROP_COUNT) {
+		struct fake_plane *plane = &state->planes[idx];
+		bool missing = (prop_idx == PLANE_PROP_ZPOS
+				&& !fake->config.zpos)
+			|| (prop_idx == PLANE_PROP_ALPHA
+				&& !fake->config.alpha);
+		if (missing || (1 << prop_idx) & PLANE_INFO_PROPS) {
+			return -EINVAL;
+		}
+		if (prop_idx == PLANE_PROP_FB_DAMAGE_CLIPS && prop->value != 0
+				&& find_blob(fake, prop->value) == NULL) {
+			return -EINVAL;
+		}
+		*touched |= 1 << plane->output;
+		plane->values[prop_idx] = prop->value;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int fake_commit(struct kms_backend *backend,
+		const struct kms_request *req, uint32_t flags,
+		void *user_data) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+	if (fake->config.commit_us > 0) {
+		usleep(fake->config.commit_us);
+	}
+
+	struct fake_state state = fake->state;
+	uint32_t touched = 0;
+	int32_t *out_fences[COMPOSITOR_MAX_OUTPUTS] = { NULL };
+	int ret = 0;
+	pthread_mutex_lock(&fake->lock);
+	for (int i = 0; i < req->nprops && ret == 0; i++) {
+		ret = set_prop(fake, &state, &req->props[i], &touched,
+				out_fences);
+	}
+	if (ret == 0) {
+		ret = check_state(fake, &state);
+	}
+	pthread_mutex_unlock(&fake->lock);
+	if (ret < 0 || (flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		return ret;
+	}
+
+	for (int i = 0; i < fake->config.noutputs; i++) {
+		if ((touched & (1 << i)) == 0) {
+			continue;
+		}
+		bool modeset = memcmp(state.crtcs[i], fake->state.crtcs[i],
+				sizeof(state.crtcs[i])) != 0
+			|| memcmp(state.connectors[i],
+					fake->state.connectors[i],
+					sizeof(state.connectors[i])) != 0;
+		if (modeset && !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+			return -EINVAL;
+		}
+		if (fake->flip_pending[i]) {
+			return -EBUSY;
+		}
+	}
+
+	fake->ncommits++;
+	if (fake->config.fail_every > 0
+			&& fake->ncommits % fake->config.fail_every == 0) {
+		return -EINVAL;
+	}
+
+	/* fences are neither kept nor handed out */
+	for (int i = 0; i < fake->nplanes; i++) {
+		state.planes[i].values[PLANE_PROP_IN_FENCE_FD] = -1;
+	}
+	for (int i = 0; i < fake->config.noutputs; i++) {
+		if (out_fences[i] != NULL) {
+			*out_fences[i] = -1;
+		}
+	}
+
+	/* variable refresh picks up from the last fixed vblank */
+	for (int i = 0; i < fake->config.noutputs; i++) {
+		uint64_t *crtc = fake->state.crtcs[i];
+		if (state.crtcs[i][CRTC_PROP_VRR_ENABLED]
+				&& !crtc[CRTC_PROP_VRR_ENABLED]) {
+			fake->vrr_refresh_ns[i] = next_vblank(fake, now_ns(),
+					&fake->vrr_sequence[i])
+				- fake->refresh_ns;
+			fake->vrr_sequence[i]--;
+		}
+	}
+	fake->state = state;
+
+	if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+		uint64_t after = now_ns()
+			+ fake->config.flip_delay_us * 1000ull;
+		for (int i = 0; i < fake->config.noutputs; i++) {
+			if (touched & (1 << i)) {
+				fake->flip_pending[i] = true;
+				queue_event(fake, i, true, after, user_data);
+			}
+		}
+	}
+	return 0;
+}
+
+static int fake_wait_vblank(struct kms_backend *backend,
+		uint32_t crtc_index, void *user_data) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+	if (crtc_index >= (uint32_t) fake->config.noutputs) {
+		return -EINVAL;
+	}
+	queue_event(fake, crtc_index, false, now_ns(), user_data);
+	return 0;
+}
+
+static int fake_handle_event(struct kms_backend *backend,
+		drmEventContext *context) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+	uint64_t expirations;
+	if (read(backend->fd, &expirations, sizeof(expirations)) < 0
+			&& errno != EAGAIN) {
+		return -errno;
+	}
+
+	uint64_t now = now_ns();
+	for (int i = 0; i < fake->config.noutputs; i++) {
+		for (int j = 0; j < 2; j++) {
+			struct fake_event *event = &fake->events[i][j];
+			if (!event->queued || event->time_ns > now) {
+				continue;
+			}
+			event->queued = false;
+
+			unsigned int sec = event->time_ns / 1000000000;
+			unsigned int usec = event->time_ns % 1000000000 / 1000;
+			if (j == 0) {
+				fake->flip_pending[i] = false;
+				context->page_flip_handler2(backend->fd,
+						event->sequence, sec, usec,
+						FAKE_CRTC_BASE + i,
+						event->user_data);
+			} else {
+				context->vblank_handler(backend->fd,
+						event->sequence, sec, usec,
+						event->user_data);
+			}
+		}
+	}
+
+	arm_timer(fake);
+	return 0;
+}
+
+static int fake_create_blob(struct kms_backend *backend, const void *data,
+		size_t size, uint32_t *blob_id) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+	void *copy = malloc(size);
+	memcpy(copy, data, size);
+
+	pthread_mutex_lock(&fake->lock);
+	fake->blobs = realloc(fake->blobs,
+			(fake->nblobs + 1) * sizeof(struct fake_blob));
+	struct fake_blob *blob = &fake->blobs[fake->nblobs++];
+	blob->id = fake->next_id++;
+	blob->size = size;
+	blob->data = copy;
+	*blob_id = blob->id;
+	pthread_mutex_unlock(&fake->lock);
+	return 0;
+}
+
+static void fake_destroy_blob(struct kms_backend *backend,
+		uint32_t blob_id) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+	pthread_mutex_lock(&fake->lock);
+	struct fake_blob *blob = find_blob(fake, blob_id);
+	if (blob != NULL) {
+		free(blob->data);
+		*blob = fake->blobs[--fake->nblobs];
+	}
+	pthread_mutex_unlock(&fake->lock);
+}
+
+static int add_fb(struct kms_fake *fake, uint32_t width, uint32_t height,
+		uint32_t format, uint32_t *fb_id) {
+	pthread_mutex_lock(&fake->lock);
+	fake->fbs = realloc(fake->fbs,
+			(fake->nfbs + 1) * sizeof(struct fake_fb));
+	fake->fbs[fake->nfbs] = (struct fake_fb) {
+		.id = fake->next_id++,
+		.format = format,
+		.width = width,
+		.height = height,
+	};
+	*fb_id = fake->fbs[fake->nfbs++].id;
+	pthread_mutex_unlock(&fake->lock);
+	return 0;
+}
+
+static int fake_import_dmabuf(struct kms_backend *backend,
+		const struct compositor_dmabuf *dmabuf, uint32_t *fb_id) {
+	return add_fb((struct kms_fake *) backend, dmabuf->width,
+			dmabuf->height, dmabuf->format, fb_id);
+}
+
+static int fake_add_fb(struct kms_backend *backend, uint32_t width,
+		uint32_t height, uint32_t format, const uint32_t handles[4],
+		const uint32_t strides[4], const uint32_t offsets[4],
+		uint32_t *fb_id) {
+	return add_fb((struct kms_fake *) backend, width, height, format,
+			fb_id);
+}
+
+static void fake_destroy_fb(struct kms_backend *backend, uint32_t fb_id) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+	pthread_mutex_lock(&fake->lock);
+	struct fake_fb *fb = find_fb(fake, fb_id);
+	if (fb != NULL) {
+		*fb = fake->fbs[--fake->nfbs];
+	}
+	pthread_mutex_unlock(&fake->lock);
+}
+
+/* plain memory, nothing ever scans it out */
+static int fake_create_dumb(struct kms_backend *backend, uint32_t width,
+		uint32_t height, uint32_t bpp, struct kms_dumb *dumb) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+	uint32_t pitch = ((width * bpp / 8) + 63) & ~63u;
+	void *map = calloc(height, pitch);
+	if (map == NULL) {
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&fake->lock);
+	*dumb = (struct kms_dumb) {
+		.handle = fake->next_id++,
+		.pitch = pitch,
+		.size = (uint64_t) pitch * height,
+		.map = map,
+	};
+	pthread_mutex_unlock(&fake->lock);
+	return 0;
+}
+
+static void fake_destroy_dumb(struct kms_backend *backend,
+		const struct kms_dumb *dumb) {
+	free(dumb->map);
+}
+
+static void init_plane(struct kms_fake *fake, struct plane *info,
+		int output, int idx) {
+	const struct fake_config *config = &fake->config;
+	struct fake_plane *plane = &fake->state.planes[fake->nplanes];
+
+	plane->output = output;
+	plane->type = DRM_PLANE_TYPE_OVERLAY;
+	if (idx == 0) {
+		plane->type = DRM_PLANE_TYPE_PRIMARY;
+	} else if (config->cursor && idx == config->nplanes - 1) {
+		plane->type = DRM_PLANE_TYPE_CURSOR;
+	}
+	plane->values[PLANE_PROP_ZPOS] = idx;
+	plane->values[PLANE_PROP_ALPHA] = 0xFFFF;
+	plane->values[PLANE_PROP_IN_FENCE_FD] = -1;
+	plane->values[PLANE_PROP_TYPE] = plane->type;
+
+	info->plane_id = FAKE_PLANE_BASE + fake->nplanes++;
+	info->type = plane->type;
+	info->in_fence = -1;
+	for (int i = 0; i < PLANE_PROP_COUNT; i++) {
+		info->prop_ids[i] = i + 1;
+		info->committed.values[i] = plane->values[i];
+	}
+	/* the formats are only listed as implicit ones */
+	info->missing_props = 1 << PLANE_PROP_IN_FORMATS;
+	info->stale_props = (1 << PLANE_PROP_COUNT) - 1;
+	info->alpha = 0xFFFF;
+	info->zpos = idx;
+	info->default_zpos = idx;
+	info->zpos_min = 0;
+	info->zpos_max = config->nplanes - 1;
+	if (config->zpos) {
+		info->stale_props &= ~(1 << PLANE_PROP_ZPOS);
+	} else {
+		info->missing_props |= 1 << PLANE_PROP_ZPOS;
+	}
+	if (config->alpha) {
+		info->stale_props &= ~(1 << PLANE_PROP_ALPHA);
+	} else {
+		info->missing_props |= 1 << PLANE_PROP_ALPHA;
+	}
+
+	int nformats = plane->type == DRM_PLANE_TYPE_CURSOR
+		? 1 : config->nformats;
+	info->nformats = nformats;
+	info->formats = calloc(nformats, sizeof(struct plane_format));
+	for (int i = 0; i < nformats; i++) {
+		info->formats[i] = (struct plane_format) {
+			.format = plane->type == DRM_PLANE_TYPE_CURSOR
+				? DRM_FORMAT_ARGB8888 : config->formats[i],
+			.modifier = DRM_FORMAT_MOD_INVALID,
+		};
+	}
+}
+
+static int fake_discover(struct kms_backend *backend,
+		struct compositor *compositor) {
+	struct kms_fake *fake = (struct kms_fake *) backend;
+
+	for (int i = 0; i < fake->config.noutputs; i++) {
+		struct output *output = &compositor->outputs[i];
+		output->backend = backend;
+		output->index = i;
+		output->connector_id = FAKE_CONNECTOR_BASE + i;
+		output->mode = &fake->mode;
+		output->crtc_id = FAKE_CRTC_BASE + i;
+		output->crtc_index = i;
+		output->cursor_width = 64;
+		output->cursor_height = 64;
+		output->refresh_ns = fake->refresh_ns;
+		output->out_fence = -1;
+		for (int j = 0; j < CRTC_PROP_COUNT; j++) {
+			output->crtc_prop_ids[j] = j + 1;
+		}
+		for (int j = 0; j < CONNECTOR_PROP_COUNT; j++) {
+			output->connector_prop_ids[j] = j + 1;
+		}
+		output->vrr_capable = fake->config.vrr_min_hz > 0;
+		if (!output->vrr_capable) {
+			output->connector_missing_props =
+				1 << CONNECTOR_PROP_VRR_CAPABLE;
+		}
+
+		output->nplanes = fake->config.nplanes;
+		for (int j = 0; j < output->nplanes; j++) {
+			init_plane(fake, &output->planes[j], i, j);
+		}
+	}
+	compositor->noutputs = fake->config.noutputs;
+	return 0;
+}
+
+static const struct kms_backend_impl fake_impl = {
+	.discover = fake_discover,
+	.commit = fake_commit,
+	.wait_vblank = fake_wait_vblank,
+	.handle_event = fake_handle_event,
+	.create_blob = fake_create_blob,
+	.destroy_blob = fake_destroy_blob,
+	.import_dmabuf = fake_import_dmabuf,
+	.create_dumb = fake_create_dumb,
+	.destroy_dumb = fake_destroy_dumb,
+	.add_fb = fake_add_fb,
+	.destroy_fb = fake_destroy_fb,
+};
+
+static int parse_formats(struct fake_config *config, const char *value) {
+	config->nformats = 0;
+	while (*value != '\0') {
+		size_t len = strcspn(value, ":");
+		if (len != 4 || config->nformats == FAKE_MAX_FORMATS) {
+			return -1;
+		}
+		config->formats[config->nformats++] = fourcc_code(value[0],
+				value[1], value[2], value[3]);
+		value += value[len] == ':' ? len + 1 : len;
+	}
+	return config->nformats > 0 ? 0 : -1;
+}
+
+static int parse_option(struct fake_config *config, const char *key,
+		const char *value) {
+	char *end;
+	long n = strtol(value, &end, 10);
+	bool number = *value != '\0' && *end == '\0' && n >= 0;
+
+	if (strcmp(key, "mode") == 0) {
+		unsigned int width, height, hz;
+		if (sscanf(value, "%ux%u@%u", &width, &height, &hz) != 3
+				|| width == 0 || height == 0 || hz == 0) {
+			return -1;
+		}
+		config->width = width;
+		config->height = height;
+		config->refresh_hz = hz;
+		return 0;
+	} else if (strcmp(key, "formats") == 0) {
+		return parse_formats(config, value);
+	} else if (!number) {
+		return -1;
+	}
+
+	if (strcmp(key, "outputs") == 0 && n >= 1
+			&& n <= COMPOSITOR_MAX_OUTPUTS) {
+		config->noutputs = n;
+	} else if (strcmp(key, "planes") == 0 && n >= 1
+			&& n <= COMPOSITOR_MAX_PLANES) {
+		config->nplanes = n;
+	} else if (strcmp(key, "cursor") == 0) {
+		config->cursor = n != 0;
+	} else if (strcmp(key, "zpos") == 0) {
+		config->zpos = n != 0;
+	} else if (strcmp(key, "alpha") == 0) {
+		config->alpha = n != 0;
+	} else if (strcmp(key, "flip_delay_us") == 0) {
+		config->flip_delay_us = n;
+	} else if (strcmp(key, "commit_us") == 0) {
+		config->commit_us = n;
+	} else if (strcmp(key, "unpaced") == 0) {
+		config->unpaced = n != 0;
+	} else if (strcmp(key, "vrr_min_hz") == 0) {
+		config->vrr_min_hz = n;
+	} else if (strcmp(key, "max_active") == 0) {
+		config->max_active = n;
+	} else if (strcmp(key, "scaling") == 0) {
+		config->scaling = n != 0;
+	} else if (strcmp(key, "fail_every") == 0) {
+		config->fail_every = n;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* config is a comma separated list of key=value pairs, see struct
+ * fake_config. e.g. "outputs=2,planes=3,mode=1280x720@60,max_active=2" */
+struct kms_backend *kms_fake_create(const char *config) {
+	struct kms_fake *ini = calloc(1, sizeof(struct kms_fake));
+	ini->base.impl = &fake_impl;
+	ini->config = (struct fake_config) {
+		.noutputs = 1,
+		.width = 1920,
+		.height = 1080,
+		.refresh_hz = 60,
+		.nplanes = 4,
+		.cursor = true,
+		.nformats = 2,
+		.formats = { DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888 },
+		.zpos = true,
+		.alpha = true,
+		.scaling = true,
+	};
+
+	char *options = strdup(config);
+	char *saveptr;
+	for (char *option = strtok_r(options, ",", &saveptr); option != NULL;
+			option = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(option, '=');
+		if (value != NULL) {
+			*value++ = '\0';
+		}
+		if (value == NULL || parse_option(&ini->config, option,
+					value) < 0) {
+			fprintf(stderr, "fake kms: bad option %s\n", option);
+			free(options);
+			free(ini);
+			return NULL;
+		}
+	}
+	free(options);
+	if (ini->config.vrr_min_hz >= ini->config.refresh_hz) {
+		fprintf(stderr, "fake kms: vrr_min_hz has to be below the "
+				"refresh rate\n");
+		free(ini);
+		return NULL;
+	}
+
+	/* reduced blanking timings, so the refresh comes out right the way
+	 * the compositor computes it */
+	struct fake_config *c = &ini->config;
+	ini->mode = (drmModeModeInfo) {
+		.hdisplay = c->width,
+		.hsync_start = c->width + 48,
+		.hsync_end = c->width + 80,
+		.htotal = c->width + 160,
+		.vdisplay = c->height,
+		.vsync_start = c->height + 3,
+		.vsync_end = c->height + 8,
+		.vtotal = c->height + 31,
+		.vrefresh = c->refresh_hz,
+		.type = DRM_MODE_TYPE_PREFERRED,
+	};
+	ini->mode.clock = (uint64_t) ini->mode.htotal * ini->mode.vtotal
+		* c->refresh_hz / 1000;
+	snprintf(ini->mode.name, sizeof(ini->mode.name), "%ux%u",
+			c->width, c->height);
+	ini->refresh_ns = (uint64_t) ini->mode.htotal * ini->mode.vtotal
+		* 1000000 / ini->mode.clock;
+
+	ini->base.fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ini->base.fd < 0) {
+		perror("timerfd_create");
+		free(ini);
+		return NULL;
+	}
+	ini->epoch_ns = now_ns();
+	pthread_mutex_init(&ini->lock, NULL);
+	ini->next_id = 1;
+
+	printf("fake kms: %d outputs of %ux%u@%u with %d planes\n",
+			c->noutputs, c->width, c->height, c->refresh_hz,
+			c->nplanes);
+	return &ini->base;
+}
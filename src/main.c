@@ -1,62 +1,1017 @@
 #include <assert.h>
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
+#include "capture.h"
 #include "compositor.h"
+#include "cpu_composite.h"
+#include "kms_backend.h"
+#include "plane_alloc.h"
 #include "protocol.h"
-#include "shared/dumb_fb.h"
+#include "repaint.h"
+#include "stats.h"
+#include "trace.h"
 
 
 struct mpc_options {
 	const char *socket_path;
-	int max_clients;
+	/* "drm", or "fake" with an optional ":key=value,..." configuration */
+	const char *backend;
+	/* the first output that can be captured is streamed here, or NULL */
+	const char *capture_path;
+	const char *stats_path;
+	/* frame events are recorded and written here on SIGUSR1 or exit, if
+	 * not NULL */
+	const char *trace_path;
+	/* commit as soon as something changed rather than just in time for
+	 * the vblank, and the least margin kept before it otherwise */
+	bool immediate_repaint;
+	uint64_t repaint_margin_ns;
+	/* vary the refresh rate with the clients on displays that can */
+	bool vrr;
+};
+
+/* what changed in a client's latest fb, in its pixels */
+struct client_damage {
+	/* a new fb was latched but not handed to a plane yet */
+	bool pending;
+	/* all of it changed if 0 */
+	int nrects;
+	struct drm_mode_rect rects[WIRE_MAX_DAMAGE];
+};
 
-	int *client_planes;
+/* when the submissions of a client on their way to the screen arrived, 0
+ * if there is none */
+struct client_timing {
+	uint64_t latched_ns;
+	uint64_t inflight_ns;
 };
 
+/* what is shown on one output. clients are bound to a single output, their
+ * views stay inactive on the others */
+struct mpc_output {
+	struct output *output;
+
+	/* what each client wants shown and the plane it got, indexed by
+	 * client id. grown along with the server's client table */
+	struct plane_alloc alloc;
+	int nviews;
+	struct plane_alloc_client *views;
+	struct client_damage *damage;
+	struct client_timing *timing;
+	/* the generation of the client each view was last latched from */
+	uint32_t *generations;
+	/* the views and the composite layer as of the last commit that went
+	 * through, fences left out. a rejected one falls back to them */
+	struct plane_alloc_client *committed_views;
+	struct plane_alloc_client committed_composite;
+	/* room for composite_clients to sort and blend every view */
+	struct plane_alloc_client **order;
+	struct cpu_layer *layers;
+
+	/* clients left without a plane are blended into this layer. a draw
+	 * that had to wait for a client may have to be complete */
+	struct cpu_composite *composite;
+	struct plane_alloc_client composite_view;
+	bool composite_full;
+
+	/* a frame was latched but could not be committed yet */
+	bool needs_commit;
+	/* the planes have to be handed out again, after a rejected commit
+	 * brought back views that may not match them */
+	bool needs_reassign;
+	/* clients published something since the last repaint */
+	bool has_updates;
+	struct repaint_scheduler scheduler;
+
+	/* NULL unless the output is being captured */
+	struct capture *capture;
+
+	/* fbs of buffers the clients destroyed, removed once nothing shows
+	 * them. added to by the protocol thread under destroy_lock. the
+	 * first nreapable were destroyed before the clients were last
+	 * latched, so no submission left can bring them back */
+	uint32_t *destroyed;
+	int ndestroyed;
+	int nreapable;
+};
+
+struct mpc_state {
+	struct mpc_options opts;
+	struct protocol_server server;
+	struct compositor *compositor;
+	struct stats *stats;
+	pthread_mutex_t destroy_lock;
+	/* wakes us up for the earliest repaint deadline */
+	int repaint_timer_fd;
+	uint64_t repaint_timer_ns;
+
+	int noutputs;
+	struct mpc_output outputs[COMPOSITOR_MAX_OUTPUTS];
+};
+
+static void view_reset(struct plane_alloc_client *view) {
+	if (view->in_fence >= 0) {
+		close(view->in_fence);
+	}
+	*view = (struct plane_alloc_client) {
+		.alpha = 0xFFFF,
+		.in_fence = -1,
+		.plane = -1,
+	};
+}
+
+/* makes room for the views of the first nclients clients */
+static void reserve_views(struct mpc_output *out, int nclients) {
+	if (nclients <= out->nviews) {
+		return;
+	}
+
+	out->views = realloc(out->views,
+			nclients * sizeof(struct plane_alloc_client));
+	out->damage = realloc(out->damage,
+			nclients * sizeof(struct client_damage));
+	out->timing = realloc(out->timing,
+			nclients * sizeof(struct client_timing));
+	out->generations = realloc(out->generations,
+			nclients * sizeof(uint32_t));
+	out->committed_views = realloc(out->committed_views,
+			nclients * sizeof(struct plane_alloc_client));
+	out->order = realloc(out->order,
+			nclients * sizeof(struct plane_alloc_client *));
+	out->layers = realloc(out->layers,
+			nclients * sizeof(struct cpu_layer));
+	assert(out->views != NULL && out->damage != NULL
+			&& out->timing != NULL && out->generations != NULL
+			&& out->committed_views != NULL && out->order != NULL
+			&& out->layers != NULL);
+	for (int i = out->nviews; i < nclients; i++) {
+		out->views[i].in_fence = -1;
+		view_reset(&out->views[i]);
+		out->damage[i] = (struct client_damage) { 0 };
+		out->timing[i] = (struct client_timing) { 0 };
+		out->generations[i] = 0;
+		out->committed_views[i] = out->views[i];
+	}
+	out->nviews = nclients;
+}
+
+static void rect_union(struct drm_mode_rect *box,
+		const struct drm_mode_rect *rect) {
+	box->x1 = rect->x1 < box->x1 ? rect->x1 : box->x1;
+	box->y1 = rect->y1 < box->y1 ? rect->y1 : box->y1;
+	box->x2 = rect->x2 > box->x2 ? rect->x2 : box->x2;
+	box->y2 = rect->y2 > box->y2 ? rect->y2 : box->y2;
+}
+
+/* where a rectangle of a client's buffer ends up on screen, rounded
+ * outwards. the part outside the source crop isn't shown */
+static struct drm_mode_rect damage_to_screen(const struct plane_layout *layout,
+		const drmModeModeInfo *mode, const struct drm_mode_rect *rect) {
+	int64_t src_w = layout->src_w ? layout->src_w : mode->hdisplay;
+	int64_t src_h = layout->src_h ? layout->src_h : mode->vdisplay;
+	int64_t crtc_w = layout->crtc_w ? layout->crtc_w : mode->hdisplay;
+	int64_t crtc_h = layout->crtc_h ? layout->crtc_h : mode->vdisplay;
+
+	int64_t x1 = rect->x1 - (int64_t) layout->src_x;
+	int64_t y1 = rect->y1 - (int64_t) layout->src_y;
+	int64_t x2 = rect->x2 - (int64_t) layout->src_x;
+	int64_t y2 = rect->y2 - (int64_t) layout->src_y;
+	x1 = x1 < 0 ? 0 : x1 > src_w ? src_w : x1;
+	y1 = y1 < 0 ? 0 : y1 > src_h ? src_h : y1;
+	x2 = x2 < 0 ? 0 : x2 > src_w ? src_w : x2;
+	y2 = y2 < 0 ? 0 : y2 > src_h ? src_h : y2;
+
+	return (struct drm_mode_rect) {
+		.x1 = layout->crtc_x + x1 * crtc_w / src_w,
+		.y1 = layout->crtc_y + y1 * crtc_h / src_h,
+		.x2 = layout->crtc_x + (x2 * crtc_w + src_w - 1) / src_w,
+		.y2 = layout->crtc_y + (y2 * crtc_h + src_h - 1) / src_h,
+	};
+}
+
+static bool fence_signalled(int fence_fd) {
+	struct pollfd pfd = {
+		.fd = fence_fd,
+		.events = POLLIN,
+	};
+	return fence_fd < 0 || poll(&pfd, 1, 0) == 1;
+}
+
+/* blends the clients without a plane, in stacking order, and shows the
+ * result on the composite layer's plane. only what those clients damaged
+ * is redrawn, unless full is set. a client still rendering holds up the
+ * draw until a later repaint, the layer keeps what it showed meanwhile.
+ * returns true if it changed */
+static bool composite_clients(struct mpc_state *state,
+		struct mpc_output *out, bool full) {
+	drmModeModeInfo *mode = out->output->mode;
+	struct plane_alloc_client **order = out->order;
+	int n = plane_alloc_order(out->views, out->nviews, order);
+
+	full |= out->composite_full;
+	for (int i = 0; i < n; i++) {
+		if (order[i]->plane < 0
+				&& !fence_signalled(order[i]->in_fence)) {
+			out->composite_full = full;
+			out->has_updates = true;
+			return false;
+		}
+	}
+	out->composite_full = false;
+
+	struct drm_mode_rect box = {
+		.x1 = mode->hdisplay,
+		.y1 = mode->vdisplay,
+	};
+	struct cpu_layer *layers = out->layers;
+	int nlayers = 0;
+	for (int i = 0; i < n; i++) {
+		struct plane_alloc_client *view = order[i];
+		struct client_damage *damage = &out->damage[view - out->views];
+		if (view->plane >= 0) {
+			continue;
+		}
+
+		if (damage->pending) {
+			const struct drm_mode_rect all = {
+				.x1 = view->layout.src_x,
+				.y1 = view->layout.src_y,
+				.x2 = INT32_MAX,
+				.y2 = INT32_MAX,
+			};
+			for (int j = 0; j < damage->nrects || j == 0; j++) {
+				struct drm_mode_rect rect = damage_to_screen(
+						&view->layout, mode,
+						damage->nrects
+						? &damage->rects[j] : &all);
+				rect_union(&box, &rect);
+			}
+			damage->pending = false;
+		}
+
+		layers[nlayers++] = (struct cpu_layer) {
+			.fb_id = view->fb,
+			.layout = view->layout,
+			.alpha = view->alpha,
+		};
+		if (view->in_fence >= 0) {
+			close(view->in_fence);
+			view->in_fence = -1;
+		}
+	}
+
+	/* clip to the screen, nothing visible changed if that's empty */
+	box.x1 = box.x1 < 0 ? 0 : box.x1;
+	box.y1 = box.y1 < 0 ? 0 : box.y1;
+	box.x2 = box.x2 > mode->hdisplay ? mode->hdisplay : box.x2;
+	box.y2 = box.y2 > mode->vdisplay ? mode->vdisplay : box.y2;
+	if (!full && (box.x1 >= box.x2 || box.y1 >= box.y2)) {
+		return false;
+	}
+
+	struct plane_alloc_client *view = &out->composite_view;
+	view->fb = cpu_composite_draw(out->composite, layers, nlayers,
+			full ? NULL : &box);
+	output_plane_set_fb(out->output, view->plane, view->fb, -1);
+	if (!full) {
+		output_plane_set_damage(out->output, view->plane, &box, 1);
+	}
+	return true;
+}
+
+/* lets go of what a client that left showed, returns true if it had a
+ * plane or was composited */
+static bool forget_client(struct mpc_state *state, struct mpc_output *out,
+		int i) {
+	bool shown = out->views[i].active;
+	view_reset(&out->views[i]);
+	out->committed_views[i] = out->views[i];
+	out->damage[i].pending = false;
+	out->timing[i] = (struct client_timing) { 0 };
+	if (shown) {
+		stats_client_reset(state->stats, i);
+	}
+	return shown;
+}
+
+/* latches newly received framebuffers into the planes, returns true if
+ * anything changed since the last commit */
+static bool update_planes(struct mpc_state *state, struct mpc_output *out) {
+	struct protocol_server *server = &state->server;
+	struct output *output = out->output;
+	bool dirty = false;
+	/* planes have to be handed out again */
+	bool reassign = out->needs_reassign;
+	out->needs_reassign = false;
+
+	pthread_mutex_lock(&state->destroy_lock);
+	out->nreapable = out->ndestroyed;
+	pthread_mutex_unlock(&state->destroy_lock);
+
+	reserve_views(out, protocol_server_nclients(server));
+	for (int i = 0; i < out->nviews; i++) {
+		struct protocol_client_state *client =
+			protocol_server_client(server, i);
+		struct plane_alloc_client *view = &out->views[i];
+		struct client_damage *damage = &out->damage[i];
+
+		if (!protocol_client_connected(client)
+				|| client->output != (uint32_t) output->index) {
+			if (view->active) {
+				reassign |= forget_client(state, out, i);
+			}
+			continue;
+		}
+		/* the slot was freed and taken by a new client while a flip
+		 * kept us from looking */
+		if (out->generations[i] != client->generation) {
+			reassign |= forget_client(state, out, i);
+			out->generations[i] = client->generation;
+		}
+
+		/* the layer and buffer of a commit are applied together */
+		struct protocol_latch latch;
+		if (!protocol_client_latch(client, &latch)) {
+			continue;
+		}
+
+		if (latch.layer_changed) {
+			const struct protocol_layer *layer = &latch.layer;
+			view->layout = (struct plane_layout) {
+				.src_x = layer->src_x,
+				.src_y = layer->src_y,
+				.src_w = layer->src_w,
+				.src_h = layer->src_h,
+				.crtc_x = layer->dst_x,
+				.crtc_y = layer->dst_y,
+				.crtc_w = layer->dst_w,
+				.crtc_h = layer->dst_h,
+			};
+			view->has_zpos = layer->has_zpos;
+			view->zpos = layer->zpos;
+			view->alpha = layer->alpha;
+			reassign |= view->active;
+		}
+
+		/* no fb received since the last commit, keep the old one */
+		if (!latch.submitted) {
+			continue;
+		}
+		const struct protocol_submission *submission =
+			&latch.submission;
+		struct client_timing *timing = &out->timing[i];
+		stats_client_latched(state->stats, i, output->index,
+				timing->latched_ns != 0);
+		timing->latched_ns = submission->received_ns;
+
+		/* a different kind of buffer might need a different plane */
+		if (!view->active || view->format != submission->format
+				|| view->modifier != submission->modifier) {
+			reassign = true;
+		}
+		if (view->in_fence >= 0) {
+			close(view->in_fence);
+		}
+		view->active = true;
+		view->fb = submission->fb_id;
+		view->format = submission->format;
+		view->modifier = submission->modifier;
+		view->in_fence = submission->fence_fd;
+
+		/* a latched fb that never reached a plane left its damage
+		 * behind, so it all counts as changed */
+		damage->nrects = damage->pending ? 0 : submission->ndamage;
+		damage->pending = true;
+		for (int j = 0; j < damage->nrects; j++) {
+			const struct wire_rect *rect = &submission->damage[j];
+			damage->rects[j] = (struct drm_mode_rect) {
+				.x1 = rect->x,
+				.y1 = rect->y,
+				.x2 = rect->x + (int64_t) rect->width,
+				.y2 = rect->y + (int64_t) rect->height,
+			};
+		}
+		dirty = true;
+	}
+
+	if (reassign) {
+		plane_alloc_assign(&out->alloc, output, out->views,
+				out->nviews, &out->composite_view);
+		dirty = true;
+	}
+
+	for (int i = 0; i < out->nviews; i++) {
+		struct plane_alloc_client *view = &out->views[i];
+		struct client_damage *damage = &out->damage[i];
+
+		/* left without a plane, composited below */
+		if (!view->active || view->plane < 0 || !damage->pending) {
+			continue;
+		}
+
+		output_plane_set_fb(output, view->plane, view->fb,
+				view->in_fence);
+		view->in_fence = -1;
+		/* a plane that was just (re)assigned has to be redrawn
+		 * completely */
+		if (!reassign) {
+			output_plane_set_damage(output, view->plane,
+					damage->rects, damage->nrects);
+		}
+		damage->pending = false;
+	}
+
+	if (out->composite_view.plane >= 0
+			&& composite_clients(state, out, reassign)) {
+		dirty = true;
+	}
+	return dirty;
+}
+
+/* what the frame that was just committed, or not, cost */
+static void record_commit(struct mpc_state *state, struct output *output,
+		uint64_t start_ns, int ret) {
+	struct stats_output *stats =
+		&state->stats->page->outputs[output->index];
+
+	if (ret == -EBUSY) {
+		stats_add(&stats->busy_commits, 1);
+	} else if (ret < 0) {
+		stats_add(&stats->failed_commits, 1);
+	} else if (output->commit_end_ns == 0) {
+		stats_add(&stats->idle_frames, 1);
+	} else {
+		stats_add(&stats->commits, 1);
+		stats_record(&stats->build, output->commit_start_ns - start_ns);
+		stats_record(&stats->commit,
+				output->commit_end_ns
+				- output->commit_start_ns);
+	}
+}
+
+static void frame_queued(struct mpc_state *state, struct output *output) {
+	struct mpc_output *out = &state->outputs[output->index];
+	int fence = output->out_fence;
+
+	/* like the clients' frame states, everything latched is in flight */
+	for (int i = 0; i < out->nviews; i++) {
+		struct client_timing *timing = &out->timing[i];
+		if (timing->latched_ns != 0) {
+			timing->inflight_ns = timing->latched_ns;
+			timing->latched_ns = 0;
+		}
+	}
+
+	protocol_server_frame_queued(&state->server, output->index, fence);
+	if (fence >= 0) {
+		close(fence);
+		output->out_fence = -1;
+	}
+}
+
+static void frame_presented(struct mpc_state *state, struct output *output) {
+	struct mpc_output *out = &state->outputs[output->index];
+	struct stats_output *stats =
+		&state->stats->page->outputs[output->index];
+
+	if (output->commit_end_ns != 0) {
+		stats_record(&stats->flip,
+				output->flip_time_ns > output->commit_end_ns
+				? output->flip_time_ns - output->commit_end_ns
+				: 0);
+	}
+	for (int i = 0; i < out->nviews; i++) {
+		struct client_timing *timing = &out->timing[i];
+		if (timing->inflight_ns == 0) {
+			continue;
+		}
+		uint64_t latency = output->flip_time_ns > timing->inflight_ns
+			? output->flip_time_ns - timing->inflight_ns : 0;
+		stats_client_presented(state->stats, i, output->index,
+				latency, output->refresh_ns);
+		timing->inflight_ns = 0;
+	}
+
+	struct wire_presentation presentation = {
+		.sequence = output->flip_sequence,
+		.timestamp_ns = output->flip_time_ns,
+		.refresh_ns = output->refresh_ns,
+	};
+
+	protocol_server_broadcast(&state->server, output->index,
+			&presentation);
+}
+
+static int import_buffer(void *data, uint32_t output,
+		const struct wire_import_dmabuf *import,
+		const int *fds, uint32_t *fb_id) {
+	struct mpc_state *state = data;
+	struct compositor_dmabuf dmabuf = {
+		.width = import->width,
+		.height = import->height,
+		.format = import->format,
+		.modifier = import->modifier,
+		.num_planes = import->num_planes,
+	};
+	for (int i = 0; i < dmabuf.num_planes; i++) {
+		dmabuf.fds[i] = fds[i];
+		dmabuf.strides[i] = import->strides[i];
+		dmabuf.offsets[i] = import->offsets[i];
+	}
+
+	int ret = compositor_import_dmabuf(state->compositor, &dmabuf, fb_id);
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* in case the client doesn't get a plane, not every buffer can be
+	 * composited */
+	cpu_composite_map(state->outputs[output].composite, *fb_id, &dmabuf);
+	return 0;
+}
+
+/* whether a view or plane of the output still uses fb, or the screen */
+static bool fb_in_use(struct mpc_output *out, uint32_t fb) {
+	for (int i = 0; i < out->nviews; i++) {
+		if (out->views[i].active && out->views[i].fb == fb) {
+			return true;
+		}
+		/* brought back if the next commit is rejected */
+		if (out->committed_views[i].active
+				&& out->committed_views[i].fb == fb) {
+			return true;
+		}
+	}
+
+	struct output *output = out->output;
+	for (int i = 0; i < output->nplanes; i++) {
+		const struct plane *plane = &output->planes[i];
+		if ((output->enabled_planes & (1 << i))
+				&& plane->fb == (int) fb) {
+			return true;
+		}
+		if (plane->committed.values[PLANE_PROP_FB_ID] == fb) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* removes the fbs of destroyed buffers nothing uses any more. while a flip
+ * is pending, the fbs it replaces are still on screen */
+static void reap_fbs(struct mpc_state *state, struct mpc_output *out) {
+	if (out->output->flip_pending) {
+		return;
+	}
+
+	pthread_mutex_lock(&state->destroy_lock);
+	int n = 0;
+	for (int i = 0; i < out->ndestroyed; i++) {
+		uint32_t fb = out->destroyed[i];
+		if (i >= out->nreapable || fb_in_use(out, fb)) {
+			out->destroyed[n++] = fb;
+			continue;
+		}
+		cpu_composite_unmap(out->composite, fb);
+		compositor_destroy_fb(state->compositor, fb);
+	}
+	out->nreapable -= out->ndestroyed - n;
+	out->ndestroyed = n;
+	pthread_mutex_unlock(&state->destroy_lock);
+}
+
+/* left to reap_fbs on the commit thread */
+static void destroy_buffer(void *data, uint32_t output, uint32_t fb_id) {
+	struct mpc_state *state = data;
+	struct mpc_output *out = &state->outputs[output];
+
+	pthread_mutex_lock(&state->destroy_lock);
+	out->destroyed = realloc(out->destroyed,
+			(out->ndestroyed + 1) * sizeof(uint32_t));
+	assert(out->destroyed != NULL);
+	out->destroyed[out->ndestroyed++] = fb_id;
+	pthread_mutex_unlock(&state->destroy_lock);
+}
+
+static void handle_drm_event(struct mpc_state *state) {
+	uint32_t flipped = compositor_handle_event(state->compositor);
+	for (int i = 0; i < state->noutputs; i++) {
+		if ((flipped & (1 << i)) == 0) {
+			continue;
+		}
+
+		struct mpc_output *out = &state->outputs[i];
+		struct output *output = out->output;
+		protocol_server_vblank(&state->server, output->index,
+				output->flip_sequence, output->flip_time_ns,
+				output->refresh_ns);
+		if (repaint_flipped(&out->scheduler, output)) {
+			stats_add(&state->stats->page->outputs[i].late_flips,
+					1);
+		}
+		frame_presented(state, output);
+		reap_fbs(state, out);
+	}
+}
+
+/* SIGUSR1 writes out the trace so far, the others end the compositor
+ * after writing it */
+static void handle_signal(int signal_fd) {
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		trace_dump();
+		if (info.ssi_signo != SIGUSR1) {
+			exit(0);
+		}
+	}
+}
+
+static void output_init(struct mpc_output *out, struct output *output) {
+	out->output = output;
+
+	/* offered to the plane allocator when the clients don't fit */
+	out->composite = cpu_composite_create(output->backend,
+			output->mode->hdisplay, output->mode->vdisplay);
+	out->composite_view = (struct plane_alloc_client) {
+		.active = true,
+		.fb = cpu_composite_front(out->composite),
+		.format = DRM_FORMAT_ARGB8888,
+		.modifier = DRM_FORMAT_MOD_LINEAR,
+		.alpha = 0xFFFF,
+		.in_fence = -1,
+		.plane = -1,
+	};
+	out->committed_composite = out->composite_view;
+}
+
+/* whether the kernel turned down the state of a commit, rather than being
+ * busy or short of something for a moment. without a commit call there
+ * was nothing to turn down */
+static bool commit_rejected(struct output *output, int ret) {
+	return ret < 0 && output->commit_end_ns != 0 && ret != -EBUSY
+		&& ret != -EAGAIN && ret != -EINTR && ret != -ENOMEM;
+}
+
+/* remembers what the views look like on screen now */
+static void views_committed(struct mpc_output *out) {
+	for (int i = 0; i < out->nviews; i++) {
+		out->committed_views[i] = out->views[i];
+		out->committed_views[i].in_fence = -1;
+	}
+	out->committed_composite = out->composite_view;
+}
+
+/* drops what a rejected commit was to show, which would only be rejected
+ * again. the planes and views go back to the last commit that went
+ * through and the clients get their latched buffers back */
+static void discard_frame(struct mpc_state *state, struct mpc_output *out) {
+	struct output *output = out->output;
+
+	output_revert(output);
+	for (int i = 0; i < out->nviews; i++) {
+		view_reset(&out->views[i]);
+		out->views[i] = out->committed_views[i];
+		out->damage[i].pending = false;
+		if (out->timing[i].latched_ns != 0) {
+			stats_client_discarded(state->stats, i);
+			out->timing[i].latched_ns = 0;
+		}
+	}
+	out->composite_view = out->committed_composite;
+	if (cpu_composite_front(out->composite) != out->composite_view.fb) {
+		cpu_composite_discard(out->composite);
+	}
+	out->needs_reassign = true;
+	out->needs_commit = false;
+	protocol_server_frame_discarded(&state->server, output->index);
+}
+
+/* commits whatever changed on an output since its last frame */
+static void output_repaint(struct mpc_state *state, struct mpc_output *out) {
+	struct output *output = out->output;
+
+	uint64_t start = stats_now_ns();
+	if (update_planes(state, out)) {
+		out->needs_commit = true;
+	}
+	reap_fbs(state, out);
+	if (!out->needs_commit) {
+		return;
+	}
+
+	if (out->capture != NULL) {
+		capture_prepare(out->capture);
+	}
+	int ret = output_draw(output, false);
+	record_commit(state, output, start, ret);
+	repaint_committed(&out->scheduler, output, start);
+	trace_end("repaint", start, "output", output->index, "ret", ret);
+
+	if (commit_rejected(output, ret)) {
+		discard_frame(state, out);
+		return;
+	}
+	/* the planes still hold what a busy commit was to show, so it stays
+	 * latched and is committed again rather than released while the
+	 * next commit may still scan it out */
+	if (ret < 0) {
+		return;
+	}
+	out->needs_commit = false;
+	views_committed(out);
+	if (out->capture != NULL) {
+		capture_frame_queued(out->capture);
+	}
+	frame_queued(state, output);
+}
+
+/* repaints an output once its deadline came, if anything changed */
+static void output_update(struct mpc_state *state, struct mpc_output *out,
+		uint64_t now_ns) {
+	struct repaint_scheduler *scheduler = &out->scheduler;
+
+	/* only one frame in flight, the flip event will wake us up.
+	 * meanwhile new submissions just replace the queued ones */
+	if (out->output->flip_pending
+			|| (!out->has_updates && !out->needs_commit)) {
+		return;
+	}
+
+	if (!scheduler->scheduled) {
+		repaint_schedule(scheduler, out->output, now_ns);
+	}
+	if (now_ns < scheduler->deadline_ns) {
+		return;
+	}
+	scheduler->scheduled = false;
+	out->has_updates = false;
+	output_repaint(state, out);
+
+	/* nothing will wake us up for a frame that is left over without a
+	 * flip or vblank event to wait for, or for clients still rendering */
+	if ((out->needs_commit || out->has_updates)
+			&& !out->output->flip_pending) {
+		repaint_retry(scheduler, out->output, now_ns);
+	}
+}
+
+static void arm_repaint_timer(struct mpc_state *state) {
+	uint64_t earliest = 0;
+	for (int i = 0; i < state->noutputs; i++) {
+		struct mpc_output *out = &state->outputs[i];
+		if (out->scheduler.scheduled && (earliest == 0
+					|| out->scheduler.deadline_ns
+					< earliest)) {
+			earliest = out->scheduler.deadline_ns;
+		}
+	}
+	if (earliest == state->repaint_timer_ns) {
+		return;
+	}
+
+	/* zero disarms it */
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = earliest / 1000000000,
+			.tv_nsec = earliest % 1000000000,
+		},
+	};
+	timerfd_settime(state->repaint_timer_fd, TFD_TIMER_ABSTIME, &spec,
+			NULL);
+	state->repaint_timer_ns = earliest;
+}
+
+static bool parse_margin(struct mpc_options *opts, const char *value) {
+	if (strcmp(value, "off") == 0) {
+		opts->immediate_repaint = true;
+		return true;
+	}
+
+	char *end;
+	long us = strtol(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || us < 0) {
+		return false;
+	}
+	opts->repaint_margin_ns = us * 1000ull;
+	return true;
+}
+
 int main(int argc, char *argv[]) {
 	int ret;
 
-	struct protocol_server server;
-	struct mpc_options opts = {
-		.socket_path = "/home/pi/mpc.sock",
-		.max_clients = 2,
-		.client_planes = (int[]) { 0, 1 },
+	struct mpc_state state = {
+		.opts = {
+			.socket_path = "/home/pi/mpc.sock",
+			.stats_path = "/home/pi/mpc-stats.sock",
+			.repaint_margin_ns = 1000000,
+			.backend = "drm",
+		},
 	};
-	ret = protocol_server_init(&server, opts.socket_path, opts.max_clients);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:k:s:t:v")) != -1) {
+		switch (opt) {
+			case 'c':
+				state.opts.capture_path = optarg;
+				break;
+			case 'd':
+				if (!parse_margin(&state.opts, optarg)) {
+					fprintf(stderr,
+							"bad deadline margin: "
+							"%s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'k':
+				state.opts.backend = optarg;
+				break;
+			case 's':
+				state.opts.stats_path = optarg;
+				break;
+			case 't':
+				state.opts.trace_path = optarg;
+				break;
+			case 'v':
+				state.opts.vrr = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s "
+						"[-c capture.raw|capture.y4m] "
+						"[-d margin_us|off] "
+						"[-k drm|fake[:config]] "
+						"[-s stats.sock] "
+						"[-t trace.json] [-v]\n",
+						argv[0]);
+				return 1;
+		}
+	}
+
+	/* the trace is written by this thread, every other one has to leave
+	 * the signals to it */
+	int signal_fd = -1;
+	if (state.opts.trace_path != NULL) {
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		sigaddset(&signals, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+		signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (signal_fd == -1 || trace_init(state.opts.trace_path) < 0) {
+			perror("trace");
+			return 1;
+		}
+		trace_thread_name("commit");
+	}
+
+	struct kms_backend *backend = NULL;
+	const char *name = state.opts.backend;
+	if (strcmp(name, "drm") == 0) {
+		backend = kms_drm_create();
+	} else if (strncmp(name, "fake", 4) == 0
+			&& (name[4] == '\0' || name[4] == ':')) {
+		backend = kms_fake_create(name[4] == ':' ? name + 5 : "");
+	} else {
+		fprintf(stderr, "unknown backend: %s\n", name);
+		return 1;
+	}
+	if (backend == NULL) {
+		return 1;
+	}
+
+	state.compositor = compositor_create(backend);
+	assert(state.compositor);
+
+	state.noutputs = state.compositor->noutputs;
+	state.stats = stats_create(state.opts.stats_path, state.noutputs);
+	assert(state.stats);
+	for (int i = 0; i < state.noutputs; i++) {
+		output_init(&state.outputs[i], &state.compositor->outputs[i]);
+		if (state.opts.vrr && output_enable_vrr(
+					state.outputs[i].output) < 0) {
+			fprintf(stderr, "output %d can't vary its refresh "
+					"rate\n", i);
+		}
+	}
+
+	/* has to be set up before the modeset attaches the writeback */
+	if (state.opts.capture_path != NULL) {
+		struct mpc_output *out = NULL;
+		for (int i = 0; i < state.noutputs && out == NULL; i++) {
+			if (state.outputs[i].output->writeback != NULL) {
+				out = &state.outputs[i];
+			}
+		}
+		if (out == NULL) {
+			fprintf(stderr, "no output can be captured\n");
+			return 1;
+		}
+		out->capture = capture_create(out->output,
+				state.opts.capture_path);
+		if (out->capture == NULL) {
+			return 1;
+		}
+	}
+
+	pthread_mutex_init(&state.destroy_lock, NULL);
+	struct protocol_buffer_handler buffer_handler = {
+		.import = import_buffer,
+		.destroy = destroy_buffer,
+		.data = &state,
+	};
+	ret = protocol_server_init(&state.server, state.opts.socket_path,
+			state.noutputs, &buffer_handler);
 	assert(ret != -1);
 
-	struct compositor *compositor = compositor_create();
-	assert(compositor);
-	assert(compositor->nplanes >= opts.max_clients);
+	/* planes without IN_FENCE_FD would block the loop on a client's
+	 * rendering, so the server holds back submissions until it's done */
+	for (int i = 0; i < state.noutputs; i++) {
+		struct output *output = state.outputs[i].output;
+		for (int j = 0; j < output->nplanes; j++) {
+			struct plane *plane = &output->planes[j];
+			if (plane->missing_props
+					& (1 << PLANE_PROP_IN_FENCE_FD)) {
+				state.server.wait_fences = true;
+			}
+		}
+	}
+
+	for (int i = 0; i < state.noutputs; i++) {
+		output_draw(state.outputs[i].output, true);
+		frame_queued(&state, state.outputs[i].output);
+	}
+
+	state.repaint_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC);
+	assert(state.repaint_timer_fd != -1);
+	for (int i = 0; i < state.noutputs; i++) {
+		repaint_scheduler_init(&state.outputs[i].scheduler,
+				state.opts.immediate_repaint,
+				state.opts.repaint_margin_ns);
+	}
+
+	/* clients are read on the protocol thread, this one only commits */
+	ret = protocol_server_start(&state.server);
+	assert(ret != -1);
 
-	compositor_draw(compositor, true);
+	struct pollfd fds[] = {
+		{ .fd = backend->fd, .events = POLLIN },
+		{ .fd = state.server.notify_fd, .events = POLLIN },
+		{ .fd = state.stats->socketfd, .events = POLLIN },
+		{ .fd = signal_fd, .events = POLLIN },
+		{ .fd = state.repaint_timer_fd, .events = POLLIN },
+	};
 	while (true) {
-		ret = protocol_server_poll(&server);
+		/* sleep until a client sent something, a page flip arrives or
+		 * it's time to repaint */
+		ret = poll(fds, 5, -1);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
 		assert(ret != -1);
 
-		for (int i = 0; i < opts.max_clients; i++) {
-			if (server.clients[i].fd != -1) {
-				uint32_t plane = opts.client_planes[i];
-				/* no fb received this frame */
-				if (server.clients[i].fb_id == (uint32_t) -1) {
-					compositor_plane_disable(compositor, i);
-					continue;
-				}
-
-				compositor_plane_enable(compositor, plane);
-				compositor->planes[plane].fb = server.clients[i].fb_id;
-				server.clients[i].fb_id = -1;
-			} else {
-				compositor_plane_disable(compositor, i);
+		if (fds[0].revents & POLLIN) {
+			handle_drm_event(&state);
+		}
+		if (fds[1].revents & POLLIN) {
+			protocol_server_dispatch(&state.server);
+			/* we don't know whose clients it was */
+			for (int i = 0; i < state.noutputs; i++) {
+				state.outputs[i].has_updates = true;
+			}
+		}
+		if (fds[2].revents & POLLIN) {
+			stats_accept(state.stats);
+		}
+		if (fds[3].revents & POLLIN) {
+			handle_signal(signal_fd);
+		}
+		if (fds[4].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(state.repaint_timer_fd, &expirations,
+						sizeof(expirations)) == -1
+					&& errno != EAGAIN) {
+				perror("repaint timer: read");
 			}
 		}
 
-		compositor_draw(compositor, false);
-		protocol_server_broadcast(&server);
+		/* every output flips on its own vblank */
+		uint64_t now = stats_now_ns();
+		for (int i = 0; i < state.noutputs; i++) {
+			output_update(&state, &state.outputs[i], now);
+		}
+		arm_repaint_timer(&state);
 	}
 }
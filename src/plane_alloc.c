@@ -0,0 +1,433 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "plane_alloc.h"
+
+struct search {
+	struct output *output;
+	struct plane_alloc_client **order;
+
+	/* plane and zpos picked for each client in order */
+	int planes[COMPOSITOR_MAX_LAYERS];
+	int zpos[COMPOSITOR_MAX_LAYERS];
+	uint32_t used_planes;
+	int tests;
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+	/* fnv-1a */
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/* summarizes the parts of the clients' state that decide whether a plane
+ * can show them. positions are left out, so moving a client around reuses
+ * the cached assignment */
+static uint64_t config_key(const struct plane_alloc_client *clients,
+		struct plane_alloc_client **order, int n, bool composite) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (int i = 0; i < n; i++) {
+		const struct plane_alloc_client *client = order[i];
+		const struct plane_layout *layout = &client->layout;
+		uint32_t values[] = {
+			client - clients,
+			client->format,
+			client->modifier >> 32,
+			client->modifier,
+			layout->src_w,
+			layout->src_h,
+			layout->crtc_w,
+			layout->crtc_h,
+			client->alpha != 0xFFFF,
+		};
+		hash = hash_bytes(hash, values, sizeof(values));
+	}
+	hash = hash_bytes(hash, &composite, sizeof(composite));
+	/* 0 marks free cache entries */
+	return hash ? hash : 1;
+}
+
+/* stacking position of a plane that can't be restacked. without a zpos
+ * property drivers put the primary plane at the bottom and the cursor on
+ * top */
+static int fixed_zpos(const struct plane *plane) {
+	if (plane->prop_ids[PLANE_PROP_ZPOS] != 0) {
+		return plane->default_zpos;
+	}
+	switch (plane->type) {
+		case DRM_PLANE_TYPE_PRIMARY:
+			return 0;
+		case DRM_PLANE_TYPE_CURSOR:
+			return 2;
+		default:
+			return 1;
+	}
+}
+
+static bool zpos_mutable(const struct plane *plane) {
+	return (plane->missing_props & (1 << PLANE_PROP_ZPOS)) == 0;
+}
+
+/* filters out planes that can't possibly show the client, everything else
+ * is left to the kernel */
+static bool plane_can_show(const struct output *output,
+		const struct plane *plane,
+		const struct plane_alloc_client *client, int position) {
+	if (!plane_supports_format(plane, client->format, client->modifier)) {
+		return false;
+	}
+	if (client->alpha != 0xFFFF
+			&& (plane->missing_props & (1 << PLANE_PROP_ALPHA))) {
+		return false;
+	}
+	/* anything drawn below the primary plane would be hidden */
+	if (plane->type == DRM_PLANE_TYPE_PRIMARY && position != 0) {
+		return false;
+	}
+
+	if (plane->type == DRM_PLANE_TYPE_CURSOR) {
+		const struct plane_layout *layout = &client->layout;
+		if (layout->crtc_w == 0 || layout->crtc_h == 0
+				|| layout->crtc_w > output->cursor_width
+				|| layout->crtc_h > output->cursor_height) {
+			return false;
+		}
+		/* cursor planes don't scale */
+		uint32_t src_w = layout->src_w ? layout->src_w
+			: output->mode->hdisplay;
+		uint32_t src_h = layout->src_h ? layout->src_h
+			: output->mode->vdisplay;
+		if (src_w != layout->crtc_w || src_h != layout->crtc_h) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* points the planes at the first n clients in order, disabling the rest */
+static void apply(struct output *output,
+		struct plane_alloc_client **order, const int *planes,
+		const int *zpos, int n) {
+	for (int i = 0; i < output->nplanes; i++) {
+		output_plane_disable(output, i);
+	}
+
+	for (int i = 0; i < n; i++) {
+		const struct plane_alloc_client *client = order[i];
+		struct plane *plane = &output->planes[planes[i]];
+
+		output_plane_enable(output, planes[i]);
+		output_plane_set_layout(output, planes[i],
+				&client->layout, true, zpos[i], client->alpha);
+		/* a plane that already has the fb is left as it is */
+		if (plane->fb != (int) client->fb) {
+			output_plane_set_fb(output, planes[i],
+					client->fb, -1);
+		}
+	}
+}
+
+/* gives each fence back to the plane that shows its fb now, a fence
+ * whose fb lost its plane isn't needed any more */
+static void restore_fences(struct output *output, const uint32_t *fbs,
+		const int *fences) {
+	for (int i = 0; i < output->nplanes; i++) {
+		if (fences[i] < 0) {
+			continue;
+		}
+
+		int owner = -1;
+		for (int j = 0; j < output->nplanes; j++) {
+			const struct plane *plane = &output->planes[j];
+			if ((output->enabled_planes & (1 << j))
+					&& plane->fb == (int) fbs[i]) {
+				owner = j;
+			}
+		}
+		if (owner >= 0) {
+			output_plane_set_fb(output, owner, fbs[i], fences[i]);
+		} else {
+			close(fences[i]);
+		}
+	}
+}
+
+static bool test(struct search *search, int n) {
+	search->tests++;
+	apply(search->output, search->order, search->planes,
+			search->zpos, n);
+	return output_test(search->output) == 0;
+}
+
+/* picks planes for clients position.. of order with zpos above below_zpos,
+ * depth first. only complete assignments are tested, the kernel doesn't
+ * have much to say about partial ones */
+static bool search_planes(struct search *search, int position, int n,
+		int below_plane, int below_zpos) {
+	if (position == n) {
+		return test(search, n);
+	}
+
+	struct output *output = search->output;
+	const struct plane_alloc_client *client = search->order[position];
+
+	/* try the primary plane first for the bottom client, some hardware
+	 * can't scan out without it */
+	static const uint32_t types[] = {
+		DRM_PLANE_TYPE_PRIMARY,
+		DRM_PLANE_TYPE_OVERLAY,
+		DRM_PLANE_TYPE_CURSOR,
+	};
+	for (int t = 0; t < 3; t++) {
+		for (int i = 0; i < output->nplanes; i++) {
+			const struct plane *plane = &output->planes[i];
+			if (plane->type != types[t]
+					|| (search->used_planes & (1 << i))
+					|| !plane_can_show(output, plane,
+						client, position)) {
+				continue;
+			}
+
+			/* the stacking order has to follow the client order */
+			int zpos;
+			if (zpos_mutable(plane)) {
+				zpos = below_zpos == INT_MIN ? plane->zpos_min
+					: below_zpos + 1;
+				if (zpos < plane->zpos_min) {
+					zpos = plane->zpos_min;
+				}
+				if (zpos > plane->zpos_max) {
+					continue;
+				}
+			} else {
+				zpos = fixed_zpos(plane);
+				if (zpos < below_zpos || (zpos == below_zpos
+							&& i < below_plane)) {
+					continue;
+				}
+			}
+
+			search->planes[position] = i;
+			search->zpos[position] = zpos;
+			search->used_planes |= 1 << i;
+			if (search_planes(search, position + 1, n, i, zpos)) {
+				return true;
+			}
+			search->used_planes &= ~(1 << i);
+
+			if (search->tests >= PLANE_ALLOC_MAX_TESTS) {
+				return false;
+			}
+		}
+	}
+
+	return false;
+}
+
+static struct plane_alloc_entry *cache_lookup(struct plane_alloc *alloc,
+		uint64_t key) {
+	for (int i = 0; i < PLANE_ALLOC_CACHE_SIZE; i++) {
+		if (alloc->cache[i].key == key) {
+			return &alloc->cache[i];
+		}
+	}
+	return NULL;
+}
+
+/* replaces the least recently used entry */
+static struct plane_alloc_entry *cache_insert(struct plane_alloc *alloc,
+		uint64_t key) {
+	struct plane_alloc_entry *entry = &alloc->cache[0];
+	for (int i = 1; i < PLANE_ALLOC_CACHE_SIZE; i++) {
+		if (alloc->cache[i].last_used < entry->last_used) {
+			entry = &alloc->cache[i];
+		}
+	}
+	entry->key = key;
+	return entry;
+}
+
+/* zpos of each cached plane, recomputed the same way the search does */
+static void cached_zpos(struct output *output, const int *planes,
+		int *zpos, int n) {
+	int below = INT_MIN;
+	for (int i = 0; i < n; i++) {
+		const struct plane *plane = &output->planes[planes[i]];
+		if (zpos_mutable(plane)) {
+			zpos[i] = below == INT_MIN ? plane->zpos_min
+				: below + 1;
+			if (zpos[i] < plane->zpos_min) {
+				zpos[i] = plane->zpos_min;
+			}
+		} else {
+			zpos[i] = fixed_zpos(plane);
+		}
+		below = zpos[i];
+	}
+}
+
+/* sorts the active clients bottom first, by zpos and then by index. order
+ * needs room for nclients, returns how many there are */
+int plane_alloc_order(struct plane_alloc_client *clients, int nclients,
+		struct plane_alloc_client **order) {
+	int n = 0;
+
+	/* insertion sort */
+	for (int i = 0; i < nclients; i++) {
+		if (!clients[i].active) {
+			continue;
+		}
+
+		int zpos = clients[i].has_zpos ? clients[i].zpos : 0;
+		int j = n++;
+		for (; j > 0; j--) {
+			const struct plane_alloc_client *above = order[j - 1];
+			if ((above->has_zpos ? above->zpos : 0) <= zpos) {
+				break;
+			}
+			order[j] = order[j - 1];
+		}
+		order[j] = &clients[i];
+	}
+
+	return n;
+}
+
+static bool search_all(struct search *search, int n) {
+	search->used_planes = 0;
+	search->tests = 0;
+	if (search_planes(search, 0, n, -1, INT_MIN)) {
+		return true;
+	}
+	if (search->tests >= PLANE_ALLOC_MAX_TESTS) {
+		fprintf(stderr, "plane_alloc: giving up on %d layers after %d "
+				"tests\n", n, search->tests);
+	}
+	return false;
+}
+
+/* spreads the active clients over the hardware planes and applies the
+ * result to the output. if not all of them fit, the topmost ones are
+ * left without a plane and, if given, the composite layer is stacked on top
+ * of the rest to show them instead. returns the number of clients that got
+ * a plane */
+int plane_alloc_assign(struct plane_alloc *alloc,
+		struct output *output,
+		struct plane_alloc_client *clients, int nclients,
+		struct plane_alloc_client *composite) {
+	for (int i = 0; i < nclients; i++) {
+		clients[i].plane = -1;
+	}
+	if (composite != NULL) {
+		composite->plane = -1;
+	}
+
+	/* the candidates set fbs without fences, which would close the ones
+	 * the planes hold. they are handed back once the search is done */
+	uint32_t fence_fbs[COMPOSITOR_MAX_PLANES];
+	int fences[COMPOSITOR_MAX_PLANES];
+	for (int i = 0; i < output->nplanes; i++) {
+		fence_fbs[i] = output->planes[i].fb;
+		fences[i] = output_plane_take_fence(output, i);
+	}
+
+	struct plane_alloc_client **order =
+		malloc((nclients + 1) * sizeof(*order));
+	assert(order != NULL);
+	int n = plane_alloc_order(clients, nclients, order);
+
+	/* no more clients than planes are searched, the composite layer
+	 * takes the last plane if there are more */
+	int first_placed = n;
+	bool first_composited = false;
+	if (n > output->nplanes) {
+		first_composited = composite != NULL;
+		first_placed = output->nplanes - first_composited;
+	}
+
+	/* the layers actually searched, the clients that got a plane followed
+	 * by the composite layer if there is one */
+	struct plane_alloc_client *stack[COMPOSITOR_MAX_LAYERS];
+	struct search search = {
+		.output = output,
+		.order = stack,
+	};
+	alloc->clock++;
+
+	uint64_t key = config_key(clients, order, n, composite != NULL);
+	int placed = first_placed;
+	bool composited = first_composited;
+
+	struct plane_alloc_entry *entry = cache_lookup(alloc, key);
+	if (entry != NULL) {
+		placed = entry->placed;
+		composited = entry->composited;
+		memcpy(stack, order, placed * sizeof(*order));
+		if (composited) {
+			stack[placed] = composite;
+		}
+		memcpy(search.planes, entry->planes,
+				(placed + composited) * sizeof(int));
+		cached_zpos(output, search.planes, search.zpos,
+				placed + composited);
+
+		/* positions aren't part of the key, so check it still works */
+		if (placed + composited == 0
+				|| test(&search, placed + composited)) {
+			entry->last_used = alloc->clock;
+			goto out;
+		}
+		entry->key = 0;
+		placed = first_placed;
+		composited = first_composited;
+	}
+
+	memcpy(stack, order, placed * sizeof(*order));
+	if (composited) {
+		stack[placed] = composite;
+	}
+
+	/* hand the composite layer the planes of the topmost clients until
+	 * the rest fits */
+	while (!search_all(&search, placed + composited)) {
+		if (placed == 0) {
+			composited = false;
+			break;
+		}
+		placed--;
+		if (composite != NULL) {
+			stack[placed] = composite;
+			composited = true;
+		}
+	}
+
+	entry = cache_insert(alloc, key);
+	entry->last_used = alloc->clock;
+	entry->placed = placed;
+	entry->composited = composited;
+	memcpy(entry->planes, search.planes,
+			(placed + composited) * sizeof(int));
+
+out:
+	/* the search may have left a failed candidate behind */
+	apply(output, stack, search.planes, search.zpos,
+			placed + composited);
+	restore_fences(output, fence_fbs, fences);
+	for (int i = 0; i < placed; i++) {
+		order[i]->plane = search.planes[i];
+	}
+	if (composited) {
+		composite->plane = search.planes[placed];
+	}
+	free(order);
+	return placed;
+}
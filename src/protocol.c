@@ -1,15 +1,26 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include "protocol.h"
+#include "shared/wire.h"
+#include "stats.h"
+#include "trace.h"
 
-#define MAX_EVENTS 16
+#define MAX_EVENTS 64
 #define CLIENTID_SERVER 0xFFFFFFFF
 #define CLIENTID_UNKNOWNCLIENT 0xFFFFFFFE
 
@@ -29,62 +40,720 @@ static struct event_data u64_to_event_data(uint64_t u64) {
 	};
 }
 
-static int accept_client(int socketfd, int epollfd) {
-	int ret;
+static void submission_release(struct protocol_submission *submission) {
+	if (submission->fence_fd >= 0) {
+		close(submission->fence_fd);
+	}
+	submission->fence_fd = -1;
+}
+
+static void notify(struct protocol_server *server) {
+	uint64_t one = 1;
+	if (write(server->notify_fd, &one, sizeof(one)) == -1) {
+		perror("notify: write");
+	}
+}
+
+/* the stage buffer ids are read by both threads, each stage is written by
+ * one. a buffer moving on to the next stage is stored there before it's
+ * cleared from the previous one, and release_if_unused reads them in stage
+ * order, so it can't miss a buffer that is in use */
+static uint32_t load_id(const uint32_t *id) {
+	return __atomic_load_n(id, __ATOMIC_ACQUIRE);
+}
+
+static void store_id(uint32_t *id, uint32_t value) {
+	__atomic_store_n(id, value, __ATOMIC_RELEASE);
+}
+
+static uint32_t load_queued_id(struct protocol_client_state *client) {
+	return __atomic_load_n(&client->queued_buffer_id, __ATOMIC_ACQUIRE);
+}
 
-	int fd = accept4(socketfd, NULL, NULL, SOCK_NONBLOCK);
-	if (fd == -1) {
-		perror("accept_client: accept");
+enum event_delivery {
+	EVENT_SENT,
+	/* the client is woken up by wire_ring_wait_room to make room */
+	EVENT_RING_FULL,
+	/* EPOLLOUT tells once there is room */
+	EVENT_SOCKET_FULL,
+};
+
+/* sends an event through the client's ring, or its socket if it has none
+ * or the event carries an fd. other errors than running out of room mean
+ * the client is going away, then the event is as good as sent */
+static enum event_delivery deliver_event(
+		struct protocol_client_state *client, const void *event,
+		size_t len, int fd) {
+	uint32_t marker = WIRE_RING_ON_SOCKET;
+	if (client->shm != NULL && wire_ring_full(&client->shm->events)) {
+		return EVENT_RING_FULL;
+	}
+	if (client->shm == NULL || fd >= 0) {
+		if (wire_send_fd(client->fd, event, len, fd) == -1
+				&& (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return EVENT_SOCKET_FULL;
+		}
+		event = &marker;
+		len = sizeof(marker);
+	}
+	if (client->shm != NULL) {
+		wire_ring_push(&client->shm->events, client->wake_fd, event,
+				len);
+	}
+	return EVENT_SENT;
+}
+
+/* has epoll tell us once the socket has room again, or stop telling. a
+ * client that is being disconnected may be gone from the epoll set */
+static void watch_room(struct protocol_client_state *client, bool watch) {
+	if (client->watching_room == watch) {
+		return;
+	}
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLET | (watch ? EPOLLOUT : 0),
+		.data = {
+			.u64 = event_data_to_u64(client->fd, client->id),
+		},
+	};
+	if (epoll_ctl(client->epollfd, EPOLL_CTL_MOD, client->fd, &ev) == -1
+			&& errno != ENOENT) {
+		perror("watch_room: epoll_ctl");
+		return;
+	}
+	client->watching_room = watch;
+}
+
+/* sends what the backlog holds until the client runs out of room again,
+ * called with event_lock held */
+static void flush_backlog(struct protocol_client_state *client) {
+	enum event_delivery delivery = EVENT_SENT;
+	int sent = 0;
+	while (sent < client->nbacklog) {
+		struct protocol_event *pending = &client->backlog[sent];
+		delivery = deliver_event(client, &pending->event,
+				pending->len, pending->fd);
+		if (delivery == EVENT_RING_FULL
+				&& !wire_ring_wait_room(&client->shm->events)) {
+			/* it made room in the meantime */
+			continue;
+		} else if (delivery != EVENT_SENT) {
+			break;
+		}
+		if (pending->fd >= 0) {
+			close(pending->fd);
+		}
+		sent++;
+	}
+
+	if (sent > 0) {
+		client->nbacklog -= sent;
+		memmove(client->backlog, client->backlog + sent,
+				client->nbacklog * sizeof(*client->backlog));
+	}
+	if (client->nbacklog == 0 || delivery == EVENT_SOCKET_FULL) {
+		watch_room(client, client->nbacklog > 0);
+	}
+}
+
+static void clear_backlog(struct protocol_client_state *client) {
+	for (int i = 0; i < client->nbacklog; i++) {
+		if (client->backlog[i].fd >= 0) {
+			close(client->backlog[i].fd);
+		}
+	}
+	client->nbacklog = 0;
+}
+
+/* queues an event behind the ones the client didn't make room for yet. a
+ * client that stopped reading altogether is hung up on, and its backlog
+ * thrown away. called with event_lock held */
+static int backlog_push(struct protocol_client_state *client,
+		const void *event, size_t len, int fd) {
+	if (client->nbacklog == PROTOCOL_MAX_BACKLOG) {
+		fprintf(stderr, "warning: client %u stopped reading events, "
+				"disconnecting it\n", client->id);
+		shutdown(client->fd, SHUT_RDWR);
+		clear_backlog(client);
 		return -1;
 	}
+	if (client->nbacklog == client->backlog_size) {
+		int size = client->backlog_size ? client->backlog_size * 2 : 16;
+		struct protocol_event *backlog = realloc(client->backlog,
+				size * sizeof(struct protocol_event));
+		if (backlog == NULL) {
+			perror("backlog_push: realloc");
+			return -1;
+		}
+		client->backlog = backlog;
+		client->backlog_size = size;
+	}
 
+	struct protocol_event *pending = &client->backlog[client->nbacklog];
+	pending->fd = -1;
+	if (fd >= 0) {
+		pending->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (pending->fd == -1) {
+			perror("backlog_push: fcntl");
+			return -1;
+		}
+	}
+	memcpy(&pending->event, event, len);
+	pending->len = len;
+	client->nbacklog++;
+	return 0;
+}
+
+/* sends an event, or queues it until the client made room for it. events
+ * are never dropped or reordered. called from both threads */
+static int send_event(struct protocol_client_state *client,
+		const void *event, size_t len, int fd) {
+	int ret = 0;
+	pthread_mutex_lock(&client->event_lock);
+	if (client->nbacklog > 0 || deliver_event(client, event, len, fd)
+			!= EVENT_SENT) {
+		ret = backlog_push(client, event, len, fd);
+		flush_backlog(client);
+	}
+	pthread_mutex_unlock(&client->event_lock);
+	return ret;
+}
+
+/* tells the client it may reuse buffer_id, unless it is about to be
+ * committed or on screen. called from both threads */
+static void release_if_unused(struct protocol_client_state *client,
+		uint32_t buffer_id) {
+	if (buffer_id == 0
+			|| load_id(&client->held_buffer_ids[0]) == buffer_id
+			|| load_id(&client->held_buffer_ids[1]) == buffer_id
+			|| load_queued_id(client) == buffer_id
+			|| load_id(&client->latched_buffer_id) == buffer_id
+			|| load_id(&client->inflight_buffer_id) == buffer_id
+			|| load_id(&client->scanout_buffer_id) == buffer_id) {
+		return;
+	}
+
+	struct wire_release event = {
+		.type = WIRE_EVENT_RELEASE,
+		.buffer_id = buffer_id,
+	};
+	send_event(client, &event, sizeof(event), -1);
+}
+
+bool protocol_client_connected(struct protocol_client_state *client) {
+	return __atomic_load_n(&client->status, __ATOMIC_ACQUIRE)
+		== PROTOCOL_CLIENT_CONNECTED;
+}
+
+/* takes what changed about the client since it was last latched. a new
+ * submission goes into the next commit, the caller owns its fence_fd
+ * afterwards */
+bool protocol_client_latch(struct protocol_client_state *client,
+		struct protocol_latch *latch) {
+	latch->layer_changed = false;
+	latch->submitted = false;
+	if (!triple_buffer_take(&client->update_slots)) {
+		return false;
+	}
+
+	const struct protocol_update *update =
+		&client->updates[client->update_slots.front];
+	if (update->layer_seq != client->latched_layer_seq) {
+		client->latched_layer_seq = update->layer_seq;
+		latch->layer = update->layer;
+		latch->layer_changed = true;
+	}
+	if (!update->has_submission) {
+		return true;
+	}
+
+	latch->submission = update->submission;
+	latch->submitted = true;
+
+	/* replaces a latched buffer that never made it into a commit */
+	uint32_t replaced = load_id(&client->latched_buffer_id);
+	client->frame_state = PROTOCOL_FRAME_LATCHED;
+	store_id(&client->latched_buffer_id, update->submission.buffer_id);
+	uint64_t queued = update->queued_buffer_id;
+	__atomic_compare_exchange_n(&client->queued_buffer_id, &queued, 0,
+			false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	release_if_unused(client, replaced);
+	return true;
+}
+
+/* adds a rectangle to the damage of a submission, falling back to the
+ * bounding box if there are too many */
+static void add_damage(struct protocol_submission *submission,
+		const struct wire_rect *rect) {
+	if (submission->ndamage < WIRE_MAX_DAMAGE) {
+		submission->damage[submission->ndamage++] = *rect;
+		return;
+	}
+
+	int64_t x0 = rect->x, y0 = rect->y;
+	int64_t x1 = rect->x + (int64_t) rect->width;
+	int64_t y1 = rect->y + (int64_t) rect->height;
+	for (int i = 0; i < submission->ndamage; i++) {
+		const struct wire_rect *other = &submission->damage[i];
+		x0 = other->x < x0 ? other->x : x0;
+		y0 = other->y < y0 ? other->y : y0;
+		x1 = other->x + (int64_t) other->width > x1
+			? other->x + (int64_t) other->width : x1;
+		y1 = other->y + (int64_t) other->height > y1
+			? other->y + (int64_t) other->height : y1;
+	}
+	submission->ndamage = 1;
+	submission->damage[0] = (struct wire_rect) {
+		.x = x0,
+		.y = y0,
+		.width = x1 - x0,
+		.height = y1 - y0,
+	};
+}
+
+/* adds the damage of a submission that never made it to the commit thread
+ * to the one replacing it */
+static void merge_damage(struct protocol_submission *submission,
+		const struct protocol_submission *replaced) {
+	if (submission->ndamage == 0 || replaced->ndamage == 0) {
+		submission->ndamage = 0;
+		return;
+	}
+	for (int i = 0; i < replaced->ndamage; i++) {
+		add_damage(submission, &replaced->damage[i]);
+	}
+}
+
+/* hands the client's layer and the newest submission to the commit thread
+ * in one update. returns false if it replaced an update the commit thread
+ * was told about but didn't take yet */
+static bool publish_update(struct protocol_client_state *client,
+		const struct protocol_batch *batch) {
+	struct protocol_update *slot =
+		&client->updates[client->update_slots.back];
+	slot->layer_seq = client->layer_seq;
+	slot->layer = client->published_layer;
+
+	/* an update that isn't taken is dropped, so what it submitted has to
+	 * be carried over. the publish fails if the commit thread took it in
+	 * the meantime, and then it isn't */
+	uint32_t state = triple_buffer_state(&client->update_slots);
+	do {
+		bool pending = client->has_published
+			&& triple_buffer_fresh(state);
+		slot->has_submission = batch->submitted || pending;
+		if (batch->submitted) {
+			slot->submission = batch->submission;
+			if (pending) {
+				merge_damage(&slot->submission,
+						&client->published);
+			}
+		} else if (pending) {
+			slot->submission = client->published;
+		}
+		slot->queued_buffer_id = slot->has_submission
+			? (uint64_t) client->publish_seq << 32
+				| slot->submission.buffer_id : 0;
+		__atomic_store_n(&client->queued_buffer_id,
+				slot->queued_buffer_id, __ATOMIC_RELEASE);
+	} while (!triple_buffer_publish(&client->update_slots, &state));
+	client->publish_seq++;
+
+	client->has_published = slot->has_submission;
+	client->published = slot->submission;
+	if (!triple_buffer_fresh(state)) {
+		return true;
+	}
+
+	/* the fence moved along if the submission was carried over */
+	struct protocol_update *dropped =
+		&client->updates[client->update_slots.back];
+	if (dropped->has_submission && batch->submitted) {
+		submission_release(&dropped->submission);
+		if (dropped->submission.buffer_id
+				!= batch->submission.buffer_id) {
+			release_if_unused(client,
+					dropped->submission.buffer_id);
+		}
+	}
+	return false;
+}
+
+static void publish_batch(struct protocol_server *server,
+		struct protocol_client_state *client,
+		const struct protocol_batch *batch) {
+	if (batch->layer_changed) {
+		client->layer_seq++;
+		client->published_layer = batch->layer;
+	}
+	if (publish_update(client, batch)) {
+		notify(server);
+	}
+	trace_instant("publish", "client", client->id, "submitted",
+			batch->submitted);
+}
+
+/* whether the rendering a fence stands for is done, which it is if there
+ * is no fence */
+static bool fence_signalled(int fence_fd) {
+	if (fence_fd < 0) {
+		return true;
+	}
+	struct pollfd pfd = {
+		.fd = fence_fd,
+		.events = POLLIN,
+	};
+	return poll(&pfd, 1, 0) == 1;
+}
+
+static bool watch_fence(struct protocol_server *server,
+		struct protocol_client_state *client, int fence_fd) {
 	struct epoll_event ev = {
 		.events = EPOLLIN,
 		.data = {
-			.u64 = event_data_to_u64(fd, CLIENTID_UNKNOWNCLIENT),
+			.u64 = event_data_to_u64(fence_fd, client->id),
 		},
 	};
+	if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fence_fd, &ev) == -1) {
+		perror("watch_fence: epoll_ctl");
+		return false;
+	}
+	return true;
+}
 
-	ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
-	if (ret == -1) {
-		perror("accept_client: epoll_ctl");
+static void unwatch_fence(struct protocol_server *server, int fence_fd) {
+	if (epoll_ctl(server->epollfd, EPOLL_CTL_DEL, fence_fd, NULL) == -1) {
+		perror("unwatch_fence: epoll_ctl");
+	}
+}
+
+/* only the newest submission of a batch reaches the commit thread */
+static void batch_submit(struct protocol_client_state *client,
+		struct protocol_batch *batch,
+		const struct protocol_submission *submission) {
+	if (batch->submitted) {
+		struct protocol_submission *replaced = &batch->submission;
+		submission_release(replaced);
+		if (replaced->buffer_id != submission->buffer_id) {
+			release_if_unused(client, replaced->buffer_id);
+		}
+		struct protocol_submission merged = *submission;
+		merge_damage(&merged, replaced);
+		*replaced = merged;
+	} else {
+		batch->submission = *submission;
+		batch->submitted = true;
+	}
+}
+
+/* folds a batch into the one before it, which never reached the commit
+ * thread */
+static void batch_merge(struct protocol_client_state *client,
+		struct protocol_batch *batch,
+		const struct protocol_batch *next) {
+	if (next->submitted) {
+		batch_submit(client, batch, &next->submission);
+	}
+	if (next->layer_changed) {
+		batch->layer_changed = true;
+		batch->layer = next->layer;
+	}
+}
+
+/* brings the stages of the held batches up to date, once wherever their
+ * buffers went was stored */
+static void store_held(struct protocol_client_state *client) {
+	store_id(&client->held_buffer_ids[0], client->waiting.submitted
+			? client->waiting.submission.buffer_id : 0);
+	store_id(&client->held_buffer_ids[1], client->queued.submitted
+			? client->queued.submission.buffer_id : 0);
+}
+
+/* lets go of the batches held back for a fence */
+static void drop_held(struct protocol_server *server,
+		struct protocol_client_state *client) {
+	if (client->waiting.submitted) {
+		unwatch_fence(server, client->waiting.submission.fence_fd);
+		submission_release(&client->waiting.submission);
+	}
+	if (client->queued.submitted) {
+		submission_release(&client->queued.submission);
+	}
+	client->waiting = (struct protocol_batch) { 0 };
+	client->queued = (struct protocol_batch) { 0 };
+	store_held(client);
+}
+
+/* hands a batch to the commit thread. if the planes can't wait for a
+ * fence, only once the buffer it submits has been rendered into: batches
+ * after one that is held back wait behind it then, unless they submit a
+ * buffer that is ready and replaces it */
+static void flush_batch(struct protocol_server *server,
+		struct protocol_client_state *client,
+		struct protocol_batch *batch) {
+	if (!batch->submitted && !batch->layer_changed) {
+		return;
+	}
+	if (!server->wait_fences) {
+		publish_batch(server, client, batch);
+		return;
+	}
+
+	/* a buffer replaced by a merge below is released. the one it is
+	 * replaced by is stored first, so only the replaced one can be */
+	bool ready = batch->submitted
+		&& fence_signalled(batch->submission.fence_fd);
+	if (client->waiting.submitted) {
+		if (!ready) {
+			if (batch->submitted) {
+				store_id(&client->held_buffer_ids[1],
+						batch->submission.buffer_id);
+			}
+			batch_merge(client, &client->queued, batch);
+			return;
+		}
+		store_id(&client->held_buffer_ids[0],
+				batch->submission.buffer_id);
+		store_id(&client->held_buffer_ids[1], 0);
+		struct protocol_batch held = client->waiting;
+		unwatch_fence(server, held.submission.fence_fd);
+		batch_merge(client, &held, &client->queued);
+		batch_merge(client, &held, batch);
+		client->waiting = (struct protocol_batch) { 0 };
+		client->queued = (struct protocol_batch) { 0 };
+		*batch = held;
+	}
+
+	if (batch->submitted && !ready) {
+		/* handed over along with the fence if it can't be watched */
+		if (watch_fence(server, client, batch->submission.fence_fd)) {
+			client->waiting = *batch;
+			store_held(client);
+			return;
+		}
+	} else if (batch->submitted) {
+		submission_release(&batch->submission);
+	}
+	publish_batch(server, client, batch);
+	store_held(client);
+}
+
+/* the fence of the batch held back signalled, the batch after it may have
+ * to wait for its own */
+static void fence_ready(struct protocol_server *server,
+		struct protocol_client_state *client) {
+	struct protocol_batch batch = client->waiting;
+	struct protocol_batch queued = client->queued;
+	unwatch_fence(server, batch.submission.fence_fd);
+	submission_release(&batch.submission);
+	client->waiting = (struct protocol_batch) { 0 };
+	client->queued = (struct protocol_batch) { 0 };
+
+	trace_instant("fence", "client", client->id, "buffer",
+			batch.submission.buffer_id);
+	publish_batch(server, client, &batch);
+	store_id(&client->held_buffer_ids[0], 0);
+	flush_batch(server, client, &queued);
+	store_held(client);
+}
+
+int protocol_server_nclients(struct protocol_server *server) {
+	return __atomic_load_n(&server->nclients, __ATOMIC_ACQUIRE);
+}
+
+struct protocol_client_state *protocol_server_client(
+		struct protocol_server *server, int id) {
+	return &server->chunks[id / PROTOCOL_CLIENT_CHUNK]
+		[id % PROTOCOL_CLIENT_CHUNK];
+}
+
+/* finds a slot for a new client, growing the table if all are taken.
+ * returns -1 if it can't grow any further */
+static int alloc_client(struct protocol_server *server) {
+	int n = server->nclients;
+	for (int i = 0; i < n; i++) {
+		struct protocol_client_state *client =
+			protocol_server_client(server, i);
+		if (__atomic_load_n(&client->status, __ATOMIC_ACQUIRE)
+				== PROTOCOL_CLIENT_FREE) {
+			return i;
+		}
+	}
+
+	if (n == PROTOCOL_CLIENT_CHUNK * PROTOCOL_MAX_CHUNKS) {
+		return -1;
+	}
+	if (n % PROTOCOL_CLIENT_CHUNK == 0) {
+		struct protocol_client_state *chunk = calloc(
+				PROTOCOL_CLIENT_CHUNK,
+				sizeof(struct protocol_client_state));
+		if (chunk == NULL) {
+			return -1;
+		}
+		for (int i = 0; i < PROTOCOL_CLIENT_CHUNK; i++) {
+			chunk[i].fd = -1;
+			pthread_mutex_init(&chunk[i].event_lock, NULL);
+		}
+		server->chunks[n / PROTOCOL_CLIENT_CHUNK] = chunk;
+	}
+
+	/* publishes the chunk along with the count */
+	__atomic_store_n(&server->nclients, n + 1, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* the listening socket is edge triggered as well, so every pending
+ * connection has to be accepted at once */
+static int accept_clients(struct protocol_server *server) {
+	while (true) {
+		int fd = accept4(server->socketfd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			} else if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept_clients: accept");
+			return -1;
+		}
+
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLET,
+			.data = {
+				.u64 = event_data_to_u64(fd,
+						CLIENTID_UNKNOWNCLIENT),
+			},
+		};
+		if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("accept_clients: epoll_ctl");
+			close(fd);
+			return -1;
+		}
+	}
+}
+
+static void layer_reset(struct protocol_layer *layer) {
+	*layer = (struct protocol_layer) {
+		.alpha = 0xFFFF,
+	};
+}
+
+static void drain_client(struct protocol_server *server,
+		struct protocol_client_state *client);
+
+/* sets up the rings of a client that asked for WIRE_HELLO_RING, returns
+ * the memfd to hand over or -1 */
+static int create_ring(struct protocol_server *server,
+		struct protocol_client_state *client, int client_id) {
+	struct wire_shm *shm = MAP_FAILED;
+	int doorbell_fd = -1, wake_fd = -1;
+
+	int memfd = memfd_create("mpc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1) {
+		perror("create_ring: memfd_create");
 		return -1;
 	}
+	/* sealed, so the client can't shrink it under our mapping */
+	if (ftruncate(memfd, sizeof(struct wire_shm)) == -1
+			|| fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK
+				| F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+		perror("create_ring: memfd");
+		goto err;
+	}
+	shm = mmap(NULL, sizeof(struct wire_shm), PROT_READ | PROT_WRITE,
+			MAP_SHARED, memfd, 0);
+	if (shm == MAP_FAILED) {
+		perror("create_ring: mmap");
+		goto err;
+	}
 
-	return ret;
+	doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (doorbell_fd == -1 || wake_fd == -1) {
+		perror("create_ring: eventfd");
+		goto err;
+	}
+
+	/* every write to an eventfd is an edge of its own, so the doorbell
+	 * is never read */
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLET,
+		.data = {
+			.u64 = event_data_to_u64(doorbell_fd, client_id),
+		},
+	};
+	if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, doorbell_fd, &ev)
+			== -1) {
+		perror("create_ring: epoll_ctl");
+		goto err;
+	}
+
+	/* the ring isn't looked at until the first doorbell */
+	shm->requests.sleeping = 1;
+	client->shm = shm;
+	client->doorbell_fd = doorbell_fd;
+	client->wake_fd = wake_fd;
+	return memfd;
+
+err:
+	if (doorbell_fd >= 0) {
+		close(doorbell_fd);
+	}
+	if (wake_fd >= 0) {
+		close(wake_fd);
+	}
+	if (shm != MAP_FAILED) {
+		munmap(shm, sizeof(struct wire_shm));
+	}
+	close(memfd);
+	return -1;
 }
 
 static int handle_unknown_client(struct protocol_server *server, int fd) {
 	int ret;
 
-	int client_id;
-	ret = read(fd, &client_id, sizeof(uint32_t));
-	if (ret != sizeof(uint32_t)) {
+	/* sized to tell a hello apart from longer messages */
+	union {
+		struct wire_hello hello;
+		uint32_t words[4];
+	} message;
+	ret = recv(fd, &message, sizeof(message), 0);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		/* woken up again once it arrives */
+		return 0;
+	} else if (ret != sizeof(struct wire_hello)) {
 		fprintf(stderr, "warning: ignoring non-compliant client\n");
 		close(fd);
 		return -1;
-	} else if (ret == -1) {
-		perror("handle_unknown_client: read");
-		exit(EXIT_SUCCESS);
 	}
 
-	/* sanity check the client_id */
-	if (client_id >= server->nclients) {
-		fprintf(stderr, "warning: ignoring client that reported a "
-				"client_id >= configured nclients\n");
+	struct wire_hello hello = message.hello;
+	if (hello.version != WIRE_VERSION) {
+		fprintf(stderr, "warning: ignoring client speaking version "
+				"%u instead of %u\n", hello.version,
+				WIRE_VERSION);
+		close(fd);
+		return -1;
+	} else if (hello.output >= (uint32_t) server->noutputs) {
+		fprintf(stderr, "warning: ignoring client that asked for "
+				"output %u of %d\n", hello.output,
+				server->noutputs);
 		close(fd);
 		return -1;
 	}
-	if (server->clients[client_id].fd != -1) {
-		fprintf(stderr, "warning: ignoring client reported a client_id "
-				"which is already in use\n");
+
+	int client_id = alloc_client(server);
+	if (client_id < 0) {
+		fprintf(stderr, "warning: refusing client, no room for more "
+				"than %d\n", server->nclients);
 		close(fd);
 		return -1;
 	}
 
-	/* update epoll data */
+	/* update epoll data. EPOLLOUT is only added while events wait for
+	 * room in the socket */
 	struct epoll_event ev = {
-		.events = EPOLLIN,
+		.events = EPOLLIN | EPOLLET,
 		.data = {
 			.u64 = event_data_to_u64(fd, client_id),
 		},
@@ -92,37 +761,502 @@ static int handle_unknown_client(struct protocol_server *server, int fd) {
 	ret = epoll_ctl(server->epollfd, EPOLL_CTL_MOD, fd, &ev);
 	if (ret == -1) {
 		perror("handle_unknown_client: epoll_ctl");
-		exit(EXIT_SUCCESS);
+		close(fd);
+		return -1;
+	}
+
+	/* the commit thread reset its part when it freed the slot */
+	struct protocol_client_state *client =
+		protocol_server_client(server, client_id);
+	int fds[4] = { server->vblank_pages[hello.output].fd };
+	int nfds = 1;
+	if (hello.flags & WIRE_HELLO_RING) {
+		fds[1] = create_ring(server, client, client_id);
+		if (fds[1] == -1) {
+			close(fd);
+			return -1;
+		}
+		fds[2] = client->doorbell_fd;
+		fds[3] = client->wake_fd;
+		nfds = 4;
+	}
+
+	struct wire_welcome welcome = {
+		.type = WIRE_EVENT_WELCOME,
+		.version = WIRE_VERSION,
+		.client_id = client_id,
+	};
+	wire_send(fd, &welcome, sizeof(welcome), fds, nfds);
+	if (nfds > 1) {
+		/* the mapping stays */
+		close(fds[1]);
+	}
+
+	client->fd = fd;
+	client->id = client_id;
+	client->generation++;
+	client->epollfd = server->epollfd;
+	client->watching_room = false;
+	client->output = hello.output;
+	triple_buffer_init(&client->update_slots);
+	client->has_published = false;
+	client->layer_seq = 0;
+	layer_reset(&client->layer);
+	struct protocol_batch batch = {
+		.layer_changed = true,
+		.layer = client->layer,
+	};
+	flush_batch(server, client, &batch);
+	__atomic_store_n(&client->status, PROTOCOL_CLIENT_CONNECTED,
+			__ATOMIC_RELEASE);
+	notify(server);
+
+	/* whatever was sent right after the hello came with the same edge */
+	drain_client(server, client);
+	return 0;
+}
+
+static struct protocol_buffer *find_buffer(
+		struct protocol_client_state *client, uint32_t id) {
+	for (int i = 0; i < PROTOCOL_MAX_BUFFERS; i++) {
+		if (client->buffers[i].id == id) {
+			return &client->buffers[i];
+		}
+	}
+	return NULL;
+}
+
+/* a submission that can't be shown, answered right away so the client
+ * doesn't wait for a presentation that never comes */
+static void discard_submission(struct protocol_client_state *client,
+		uint32_t buffer_id) {
+	struct wire_presentation event = {
+		.type = WIRE_EVENT_PRESENTATION,
+		.flags = WIRE_PRESENTATION_DISCARDED,
+		.buffer_id = buffer_id,
+	};
+	send_event(client, &event, sizeof(event), -1);
+}
+
+static void batch_drop_fb(struct protocol_client_state *client,
+		struct protocol_batch *batch, uint32_t fb_id) {
+	if (!batch->submitted || batch->submission.fb_id != fb_id) {
+		return;
 	}
+	submission_release(&batch->submission);
+	batch->submitted = false;
+	discard_submission(client, batch->submission.buffer_id);
+}
+
+/* the commit thread may still show the buffer, so the buffer handler only
+ * removes its fb once it doesn't. submissions of it that weren't
+ * published yet are dropped, they would be latched after that. batch is
+ * the one being read, if any */
+static void destroy_buffer(struct protocol_server *server,
+		struct protocol_client_state *client,
+		struct protocol_batch *batch, struct protocol_buffer *buffer) {
+	uint32_t fb_id = buffer->fb_id;
+	if (batch != NULL) {
+		batch_drop_fb(client, batch, fb_id);
+	}
+	batch_drop_fb(client, &client->queued, fb_id);
+	if (client->waiting.submitted
+			&& client->waiting.submission.fb_id == fb_id) {
+		struct protocol_batch held = client->waiting;
+		unwatch_fence(server, held.submission.fence_fd);
+		batch_drop_fb(client, &held, fb_id);
+		batch_merge(client, &held, &client->queued);
+		client->waiting = (struct protocol_batch) { 0 };
+		client->queued = (struct protocol_batch) { 0 };
+		flush_batch(server, client, &held);
+	}
+	store_held(client);
+
+	server->buffer_handler.destroy(server->buffer_handler.data,
+			client->output, fb_id);
+	*buffer = (struct protocol_buffer) { 0 };
+	notify(server);
+}
 
-	server->clients[client_id].fd = fd;
-	server->clients[client_id].fb_id = -1;
+static void destroy_client_buffers(struct protocol_server *server,
+		struct protocol_client_state *client) {
+	for (int i = 0; i < PROTOCOL_MAX_BUFFERS; i++) {
+		if (client->buffers[i].id != 0) {
+			destroy_buffer(server, client, NULL,
+					&client->buffers[i]);
+		}
+	}
+}
+
+/* stops reading from a client. the commit thread may still be sending to
+ * it, so closing the socket is left to protocol_server_dispatch */
+static void disconnect_client(struct protocol_server *server,
+		struct protocol_client_state *client) {
+	int ret = epoll_ctl(server->epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+	if (ret == -1) {
+		perror("disconnect_client: epoll_ctl");
+	}
+	if (client->shm != NULL && epoll_ctl(server->epollfd, EPOLL_CTL_DEL,
+				client->doorbell_fd, NULL) == -1) {
+		perror("disconnect_client: epoll_ctl");
+	}
+
+	drop_held(server, client);
+	destroy_client_buffers(server, client);
+	__atomic_store_n(&client->status, PROTOCOL_CLIENT_CLOSING,
+			__ATOMIC_RELEASE);
+	notify(server);
+}
+
+static void apply_geometry(struct protocol_layer *layer,
+		const struct wire_op_geometry *geometry) {
+	layer->src_x = geometry->src_x;
+	layer->src_y = geometry->src_y;
+	layer->src_w = geometry->src_w;
+	layer->src_h = geometry->src_h;
+	layer->dst_x = geometry->dst_x;
+	layer->dst_y = geometry->dst_y;
+	layer->dst_w = geometry->dst_w;
+	layer->dst_h = geometry->dst_h;
+}
+
+static void apply_layer(struct protocol_layer *layer,
+		const struct wire_op_layer *set_layer) {
+	if (set_layer->flags & WIRE_LAYER_ZPOS) {
+		layer->has_zpos = true;
+		layer->zpos = set_layer->zpos;
+	}
+	if (set_layer->flags & WIRE_LAYER_ALPHA) {
+		layer->alpha = set_layer->alpha > 0xFFFF ? 0xFFFF
+			: set_layer->alpha;
+	}
+}
+
+/* checks the ops of a commit and applies them to the batch, all of them
+ * or none */
+static int handle_commit(struct protocol_server *server,
+		struct protocol_client_state *client,
+		const union wire_request *request, size_t size, int *fds,
+		int nfds, struct protocol_batch *batch) {
+	struct protocol_layer layer = client->layer;
+	bool layer_changed = false;
+	bool attached = false;
+	struct wire_op_attach attach = { 0 };
+	struct protocol_submission submission = {
+		.fence_fd = -1,
+	};
+	union {
+		struct wire_op_damage damage;
+		struct wire_op_geometry geometry;
+		struct wire_op_layer layer;
+	} ops;
+
+	/* ops are only 4 byte aligned and copied out before use */
+	const char *data = (const char *) request;
+	size_t offset = sizeof(struct wire_commit);
+	for (uint32_t i = 0; i < request->commit.num_ops; i++) {
+		struct wire_op op;
+		if (size - offset < sizeof(op)) {
+			goto malformed;
+		}
+		memcpy(&op, data + offset, sizeof(op));
+		if (op.size < sizeof(op) || op.size % 4 != 0
+				|| op.size > size - offset) {
+			goto malformed;
+		}
+		const char *op_data = data + offset;
+		offset += op.size;
+
+		switch (op.type) {
+			case WIRE_OP_ATTACH:
+				if (op.size != sizeof(attach) || attached) {
+					goto malformed;
+				}
+				memcpy(&attach, op_data, sizeof(attach));
+				attached = true;
+				break;
+			case WIRE_OP_DAMAGE:
+				if (op.size != sizeof(ops.damage)) {
+					goto malformed;
+				}
+				memcpy(&ops.damage, op_data,
+						sizeof(ops.damage));
+				add_damage(&submission, &ops.damage.rect);
+				break;
+			case WIRE_OP_GEOMETRY:
+				if (op.size != sizeof(ops.geometry)) {
+					goto malformed;
+				}
+				memcpy(&ops.geometry, op_data,
+						sizeof(ops.geometry));
+				apply_geometry(&layer, &ops.geometry);
+				layer_changed = true;
+				break;
+			case WIRE_OP_LAYER:
+				if (op.size != sizeof(ops.layer)) {
+					goto malformed;
+				}
+				memcpy(&ops.layer, op_data, sizeof(ops.layer));
+				apply_layer(&layer, &ops.layer);
+				layer_changed = true;
+				break;
+			default:
+				goto malformed;
+		}
+	}
+
+	/* damage only makes sense for a buffer, and a fence is only passed
+	 * along with one */
+	int nfences = attached && (attach.flags & WIRE_ATTACH_FENCE) ? 1 : 0;
+	if (offset != size || (submission.ndamage > 0 && !attached)
+			|| nfds != nfences) {
+		goto malformed;
+	}
+
+	if (attached) {
+		submission.buffer_id = attach.buffer_id;
+		submission.fb_id = attach.buffer_id;
+		submission.fence_fd = nfences > 0 ? fds[0] : -1;
+		submission.received_ns = stats_now_ns();
+		if ((attach.flags & WIRE_ATTACH_RAW_FB) == 0) {
+			struct protocol_buffer *buffer =
+				find_buffer(client, attach.buffer_id);
+			if (attach.buffer_id == 0 || buffer == NULL) {
+				fprintf(stderr, "warning: client attached "
+						"unknown buffer %u\n",
+						attach.buffer_id);
+				goto discard;
+			}
+			submission.fb_id = buffer->fb_id;
+			submission.format = buffer->format;
+			submission.modifier = buffer->modifier;
+		}
+		batch_submit(client, batch, &submission);
+	}
+	if (layer_changed) {
+		client->layer = layer;
+		batch->layer_changed = true;
+		batch->layer = layer;
+	}
 	return 0;
+
+malformed:
+	fprintf(stderr, "warning: ignoring malformed commit\n");
+discard:
+	wire_close_fds(fds, nfds);
+	if (attached) {
+		discard_submission(client, attach.buffer_id);
+	}
+	return -1;
 }
 
-static int handle_client_message(struct protocol_server *server,
-		struct event_data *data) {
-	int ret;
+static int handle_import_dmabuf(struct protocol_server *server,
+		struct protocol_client_state *client,
+		const struct wire_import_dmabuf *import, int *fds, int nfds,
+		struct protocol_batch *batch) {
+	int ret = -1;
+
+	if (import->buffer_id == 0 || import->num_planes == 0
+			|| import->num_planes > WIRE_MAX_PLANES
+			|| (uint32_t) nfds != import->num_planes) {
+		fprintf(stderr, "warning: ignoring malformed dmabuf import\n");
+		goto out;
+	}
+
+	/* re-importing an id replaces the old buffer */
+	struct protocol_buffer *buffer = find_buffer(client, import->buffer_id);
+	if (buffer != NULL) {
+		destroy_buffer(server, client, batch, buffer);
+	} else {
+		buffer = find_buffer(client, 0);
+	}
+	if (buffer == NULL) {
+		fprintf(stderr, "warning: client exceeded %d buffers\n",
+				PROTOCOL_MAX_BUFFERS);
+		goto out;
+	}
+
+	uint32_t fb_id;
+	ret = server->buffer_handler.import(server->buffer_handler.data,
+			client->output, import, fds, &fb_id);
+	if (ret < 0) {
+		fprintf(stderr, "warning: could not import client dmabuf\n");
+		goto out;
+	}
+
+	buffer->id = import->buffer_id;
+	buffer->fb_id = fb_id;
+	buffer->format = import->format;
+	buffer->modifier = import->modifier;
+
+out:
+	/* the kms framebuffer keeps its own reference to the dmabuf */
+	wire_close_fds(fds, nfds);
+	return ret;
+}
+
+static int handle_request(struct protocol_server *server,
+		struct protocol_client_state *client,
+		const union wire_request *request, int ret, int *fds, int nfds,
+		struct protocol_batch *batch) {
+	switch (request->type) {
+		case WIRE_REQUEST_COMMIT:
+			/* ret is the full size, even if it didn't fit */
+			if (ret < (int) sizeof(struct wire_commit)
+					|| ret > (int) sizeof(*request)) {
+				break;
+			}
+			return handle_commit(server, client, request, ret,
+					fds, nfds, batch);
+		case WIRE_REQUEST_IMPORT_DMABUF:
+			if (ret != sizeof(struct wire_import_dmabuf)) {
+				break;
+			}
+			return handle_import_dmabuf(server, client,
+					&request->import_dmabuf, fds, nfds,
+					batch);
+		case WIRE_REQUEST_DESTROY_BUFFER:
+			if (ret != sizeof(struct wire_destroy_buffer)
+					|| request->destroy_buffer.buffer_id
+					== 0) {
+				break;
+			}
+			struct protocol_buffer *buffer = find_buffer(client,
+					request->destroy_buffer.buffer_id);
+			if (buffer != NULL) {
+				destroy_buffer(server, client, batch, buffer);
+			}
+			wire_close_fds(fds, nfds);
+			return 0;
+	}
+
+	wire_close_fds(fds, nfds);
+	fprintf(stderr, "warning: ignoring unknown or malformed request "
+			"0x%x\n", request->type);
+	return -1;
+}
 
-	int fb_id;
-	ret = read(data->fd, &fb_id, sizeof(uint32_t));
-	if (ret != sizeof(uint32_t)) {
-		fprintf(stderr, "warning: received non-compliant message from "
-				"client\n");
-		close(data->fd);
+/* like wire_recv on the client's socket, but takes requests from the ring
+ * if the client has one. a ring that ran empty is marked as sleeping */
+static ssize_t recv_request(struct protocol_client_state *client,
+		union wire_request *request, int *fds, int *nfds) {
+	int flags = MSG_DONTWAIT | MSG_TRUNC;
+	if (client->shm == NULL) {
+		return wire_recv(client->fd, request, sizeof(*request), fds,
+				WIRE_MAX_FDS, nfds, flags);
+	}
+
+	struct wire_ring *ring = &client->shm->requests;
+	ssize_t ret;
+	do {
+		ret = wire_ring_pop(ring, request, sizeof(*request));
+	} while (ret == 0 && !wire_ring_sleep(ring));
+
+	*nfds = 0;
+	if (ret <= 0) {
+		errno = ret == 0 ? EAGAIN : EPROTO;
 		return -1;
-	} else if (ret == -1) {
-		perror("handle_unknown_client: read");
-		exit(EXIT_SUCCESS);
+	} else if (ret != sizeof(uint32_t)
+			|| request->type != WIRE_RING_ON_SOCKET) {
+		return ret;
+	}
+
+	/* sent before the entry, so it has to be there already */
+	do {
+		ret = wire_recv(client->fd, request, sizeof(*request), fds,
+				WIRE_MAX_FDS, nfds, flags);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		errno = EPROTO;
 	}
+	return ret;
+}
+
+/* reads everything the client sent since it last woke us up, which edge
+ * triggered epoll won't report again */
+static void drain_client(struct protocol_server *server,
+		struct protocol_client_state *client) {
+	struct protocol_batch batch = {
+		.submitted = false,
+	};
+
+	/* the client may have woken us up because it made room for events */
+	pthread_mutex_lock(&client->event_lock);
+	flush_backlog(client);
+	pthread_mutex_unlock(&client->event_lock);
 
-	assert(server->clients[data->client_id].fd != -1);
-	server->clients[data->client_id].fb_id = fb_id;
+	if (client->shm != NULL) {
+		wire_ring_wake(&client->shm->requests);
+	}
+	while (true) {
+		union wire_request request;
+		int fds[WIRE_MAX_FDS];
+		int nfds;
+		ssize_t ret = recv_request(client, &request, fds, &nfds);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret < (ssize_t) sizeof(uint32_t)) {
+			/* an empty read means the client hung up */
+			if (ret == -1) {
+				perror("drain_client: recvmsg");
+			} else if (ret > 0) {
+				fprintf(stderr, "warning: received "
+						"non-compliant message from "
+						"client\n");
+			}
+			wire_close_fds(fds, nfds);
+			if (batch.submitted) {
+				submission_release(&batch.submission);
+			}
+			disconnect_client(server, client);
+			return;
+		}
+
+		uint64_t start = trace_begin();
+		handle_request(server, client, &request, ret, fds, nfds,
+				&batch);
+		trace_end("request", start, "client", client->id, "type",
+				request.type);
+	}
+
+	flush_batch(server, client, &batch);
+}
+
+/* the page is sealed against writable mappings once ours exists, so
+ * clients can only read it */
+static int create_vblank_page(struct protocol_vblank_page *page) {
+	page->fd = memfd_create("mpc-vblank", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (page->fd == -1) {
+		perror("create_vblank_page: memfd_create");
+		return -1;
+	}
+	if (ftruncate(page->fd, sizeof(struct wire_vblank)) == -1) {
+		perror("create_vblank_page: ftruncate");
+		return -1;
+	}
+
+	page->page = mmap(NULL, sizeof(struct wire_vblank),
+			PROT_READ | PROT_WRITE, MAP_SHARED, page->fd, 0);
+	if (page->page == MAP_FAILED) {
+		perror("create_vblank_page: mmap");
+		return -1;
+	}
+
+	if (fcntl(page->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+				| F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == -1) {
+		perror("create_vblank_page: fcntl");
+		return -1;
+	}
 	return 0;
 }
 
 int protocol_server_init(struct protocol_server *server,
-		const char *socket_path, int max_clients) {
+		const char *socket_path, int noutputs,
+		const struct protocol_buffer_handler *buffer_handler) {
 	int ret;
 
 	/* prepare socket params */
@@ -133,7 +1267,8 @@ int protocol_server_init(struct protocol_server *server,
 	unlink(socket_path);
 
 	/* prepare socket */
-	int socketfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	int socketfd = socket(AF_UNIX,
+			SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (socketfd == -1) {
 		perror("socket");
 		return socketfd;
@@ -143,7 +1278,7 @@ int protocol_server_init(struct protocol_server *server,
 		perror("bind");
 		return ret;
 	}
-	ret = listen(socketfd, max_clients);
+	ret = listen(socketfd, SOMAXCONN);
 	if (ret == -1) {
 		perror("listen");
 		return ret;
@@ -156,7 +1291,7 @@ int protocol_server_init(struct protocol_server *server,
 		return ret;
 	}
 	struct epoll_event ev = {
-		.events = EPOLLIN,
+		.events = EPOLLIN | EPOLLET,
 		.data = {
 			.u64 = event_data_to_u64(socketfd, CLIENTID_SERVER),
 		},
@@ -167,23 +1302,44 @@ int protocol_server_init(struct protocol_server *server,
 		return ret;
 	}
 
+	int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notify_fd == -1) {
+		perror("eventfd");
+		return notify_fd;
+	}
+
 	server->socketfd = socketfd;
 	server->epollfd = epollfd;
-	server->nclients = max_clients;
-	server->clients = calloc(max_clients, sizeof(struct protocol_client_state));
-	for (int i = 0; i < max_clients; i++) {
-		server->clients[i].fd = -1;
-		server->clients[i].fb_id = -1;
+	server->vblank_pages = calloc(noutputs,
+			sizeof(struct protocol_vblank_page));
+	if (server->vblank_pages == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	for (int i = 0; i < noutputs; i++) {
+		if (create_vblank_page(&server->vblank_pages[i]) == -1) {
+			return -1;
+		}
 	}
 
+	server->notify_fd = notify_fd;
+	server->buffer_handler = *buffer_handler;
+	server->nclients = 0;
+	server->noutputs = noutputs;
+	server->wait_fences = false;
+
 	return 0;
 }
 
-int protocol_server_poll(struct protocol_server *server) {
+static int protocol_server_poll(struct protocol_server *server, int timeout) {
 	int ret;
 	struct epoll_event events[MAX_EVENTS];
 
-	int nevents = epoll_wait(server->epollfd, events, MAX_EVENTS, 0);
+	int nevents;
+	do {
+		nevents = epoll_wait(server->epollfd, events, MAX_EVENTS,
+				timeout);
+	} while (nevents == -1 && errno == EINTR);
 	if (nevents == -1) {
 		perror("epoll_wait");
 		return nevents;
@@ -191,45 +1347,231 @@ int protocol_server_poll(struct protocol_server *server) {
 
 	for (int i = 0; i < nevents; i++) {
 		struct event_data data = u64_to_event_data(events[i].data.u64);
-		/* handle clients closing gracefully */
-		if (events[i].events & EPOLLHUP) {
-			ret = close(data.fd);
+		if (data.client_id == CLIENTID_SERVER) {
+			ret = accept_clients(server);
 			if (ret == -1) {
-				perror("close");
+				fprintf(stderr, "fatal: error occured while "
+						"accepting new connection\n");
+				exit(EXIT_FAILURE);
 			}
+			continue;
+		}
 
-			server->clients[data.client_id].fd = -1;
-			server->clients[data.client_id].fb_id = -1;
+		if (data.client_id == CLIENTID_UNKNOWNCLIENT) {
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+				close(data.fd);
+			} else {
+				handle_unknown_client(server, data.fd);
+			}
 			continue;
 		}
 
-		switch (data.client_id) {
-			case CLIENTID_SERVER:
-				ret = accept_client(server->socketfd, server->epollfd);
-				if (ret == -1) {
-					fprintf(stderr, "fatal: error occured while "
-							"accepting new connection\n");
-					exit(EXIT_FAILURE);
-				}
-				break;
-			case CLIENTID_UNKNOWNCLIENT:
-				ret = handle_unknown_client(server, data.fd);
-				break;
-			default:
-				ret = handle_client_message(server, &data);
-				break;
+		/* a client's socket and doorbell can both show up in one
+		 * batch, after it was disconnected because of the first */
+		struct protocol_client_state *client =
+			protocol_server_client(server, data.client_id);
+		if (!protocol_client_connected(client)) {
+			continue;
+		}
+
+		/* events of a fence that was replaced in the meantime and whose
+		 * number was reused are told apart by polling it */
+		const struct protocol_batch *waiting = &client->waiting;
+		if (waiting->submitted && data.fd
+				== (uint32_t) waiting->submission.fence_fd) {
+			if (fence_signalled(data.fd)) {
+				fence_ready(server, client);
+			}
+			continue;
+		}
+
+		/* handle clients closing, gracefully or not */
+		if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+			disconnect_client(server, client);
+		} else {
+			drain_client(server, client);
+		}
+	}
+
+	return 0;
+}
+
+static void *protocol_thread(void *data) {
+	struct protocol_server *server = data;
+	trace_thread_name("protocol");
+
+	while (true) {
+		if (protocol_server_poll(server, -1) == -1) {
+			fprintf(stderr, "fatal: protocol thread failed\n");
+			exit(EXIT_FAILURE);
 		}
 	}
+	return NULL;
+}
+
+/* reads client messages on a thread of its own from now on, so neither a
+ * slow commit nor a burst of messages holds up the other */
+int protocol_server_start(struct protocol_server *server) {
+	int ret = pthread_create(&server->thread, NULL, protocol_thread,
+			server);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+/* catches up with the protocol thread after notify_fd became readable:
+ * lets go of clients that hung up so their slots can be reused */
+void protocol_server_dispatch(struct protocol_server *server) {
+	uint64_t count;
+	if (read(server->notify_fd, &count, sizeof(count)) == -1
+			&& errno != EAGAIN) {
+		perror("protocol_server_dispatch: read");
+	}
+
+	int nclients = protocol_server_nclients(server);
+	for (int i = 0; i < nclients; i++) {
+		struct protocol_client_state *client =
+			protocol_server_client(server, i);
+		if (__atomic_load_n(&client->status, __ATOMIC_ACQUIRE)
+				!= PROTOCOL_CLIENT_CLOSING) {
+			continue;
+		}
+
+		struct protocol_latch latch;
+		if (protocol_client_latch(client, &latch)
+				&& latch.submitted) {
+			submission_release(&latch.submission);
+		}
+		clear_backlog(client);
+		close(client->fd);
+		if (client->shm != NULL) {
+			munmap(client->shm, sizeof(struct wire_shm));
+			close(client->doorbell_fd);
+			close(client->wake_fd);
+			client->shm = NULL;
+		}
+
+		client->latched_layer_seq = 0;
+		client->frame_state = PROTOCOL_FRAME_IDLE;
+		__atomic_store_n(&client->queued_buffer_id, 0,
+				__ATOMIC_RELEASE);
+		store_id(&client->latched_buffer_id, 0);
+		store_id(&client->inflight_buffer_id, 0);
+		store_id(&client->scanout_buffer_id, 0);
+		__atomic_store_n(&client->status, PROTOCOL_CLIENT_FREE,
+				__ATOMIC_RELEASE);
+	}
+}
 
+/* marks everything latched as part of the commit that was just queued and
+ * hands its out fence (if any) to the clients involved */
+int protocol_server_frame_queued(struct protocol_server *server,
+		uint32_t output, int out_fence) {
+	uint32_t event = WIRE_EVENT_OUT_FENCE;
+
+	int nclients = protocol_server_nclients(server);
+	for (int i = 0; i < nclients; i++) {
+		struct protocol_client_state *client =
+			protocol_server_client(server, i);
+		if (!protocol_client_connected(client)
+				|| client->output != output
+				|| client->frame_state
+				!= PROTOCOL_FRAME_LATCHED) {
+			continue;
+		}
+
+		client->frame_state = PROTOCOL_FRAME_INFLIGHT;
+		store_id(&client->inflight_buffer_id,
+				load_id(&client->latched_buffer_id));
+		store_id(&client->latched_buffer_id, 0);
+		if (out_fence >= 0) {
+			send_event(client, &event, sizeof(uint32_t),
+					out_fence);
+		}
+	}
 	return 0;
 }
 
-int protocol_server_broadcast(struct protocol_server *server) {
-	uint32_t dummy = 0xCDCDCDCD;
-	for (int i = 0; i < server->nclients; i++) {
-		if (server->clients[i].fd != -1) {
-			write(server->clients[i].fd, &dummy, sizeof(uint32_t));
+/* answers the latched frames of the output, which went down with a commit
+ * the kernel rejected, and releases their buffers. the layers latched
+ * with them are taken again by the next latch of an update */
+void protocol_server_frame_discarded(struct protocol_server *server,
+		uint32_t output) {
+	int nclients = protocol_server_nclients(server);
+	for (int i = 0; i < nclients; i++) {
+		struct protocol_client_state *client =
+			protocol_server_client(server, i);
+		if (!protocol_client_connected(client)
+				|| client->output != output) {
+			continue;
+		}
+
+		client->latched_layer_seq = 0;
+		if (client->frame_state != PROTOCOL_FRAME_LATCHED) {
+			continue;
 		}
+		uint32_t latched = load_id(&client->latched_buffer_id);
+		discard_submission(client, latched);
+		trace_instant("discarded", "client", client->id, "buffer",
+				latched);
+		client->frame_state = PROTOCOL_FRAME_IDLE;
+		store_id(&client->latched_buffer_id, 0);
+		release_if_unused(client, latched);
+	}
+}
+
+/* tells every client of the output with a frame in flight that it was
+ * presented, and releases the buffer it replaced on screen */
+int protocol_server_broadcast(struct protocol_server *server,
+		uint32_t output, const struct wire_presentation *presentation) {
+	struct wire_presentation event = *presentation;
+	event.type = WIRE_EVENT_PRESENTATION;
+
+	int nclients = protocol_server_nclients(server);
+	for (int i = 0; i < nclients; i++) {
+		struct protocol_client_state *client =
+			protocol_server_client(server, i);
+		if (!protocol_client_connected(client)
+				|| client->output != output
+				|| client->frame_state
+				!= PROTOCOL_FRAME_INFLIGHT) {
+			continue;
+		}
+
+		uint32_t inflight = load_id(&client->inflight_buffer_id);
+		event.buffer_id = inflight;
+		send_event(client, &event, sizeof(event), -1);
+		trace_instant("presentation", "client", client->id, "buffer",
+				inflight);
+		client->frame_state = PROTOCOL_FRAME_IDLE;
+
+		/* a discarded frame leaves the old buffer on screen */
+		uint32_t released = inflight;
+		if ((event.flags & WIRE_PRESENTATION_DISCARDED) == 0) {
+			released = load_id(&client->scanout_buffer_id);
+			store_id(&client->scanout_buffer_id, inflight);
+		}
+		store_id(&client->inflight_buffer_id, 0);
+		release_if_unused(client, released);
 	}
 	return 0;
 }
+
+/* publishes the latest vblank of an output to its clients, which read it
+ * without asking us, and wakes up the ones waiting for it */
+void protocol_server_vblank(struct protocol_server *server, uint32_t output,
+		uint32_t sequence, uint64_t timestamp_ns, uint32_t refresh_ns) {
+	struct wire_vblank *page = server->vblank_pages[output].page;
+	uint32_t count = page->count;
+
+	__atomic_store_n(&page->count, count + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&page->sequence, sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->timestamp_ns, timestamp_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->refresh_ns, refresh_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->count, count + 2, __ATOMIC_RELEASE);
+
+	syscall(SYS_futex, &page->count, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
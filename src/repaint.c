@@ -0,0 +1,100 @@
+#include "repaint.h"
+
+#include "trace.h"
+
+/* how much slack a late flip adds, and a quarter of it is taken back
+ * after REPAINT_CALM flips in a row made it */
+#define REPAINT_SLACK_STEP_NS 250000
+#define REPAINT_CALM 120
+
+void repaint_scheduler_init(struct repaint_scheduler *scheduler,
+		bool immediate, uint64_t min_margin_ns) {
+	*scheduler = (struct repaint_scheduler) {
+		.immediate = immediate,
+		.min_margin_ns = min_margin_ns,
+	};
+}
+
+/* without a flip to count from, or when told to, that's now. so it is with
+ * variable refresh: the display waits for the commit instead of the other
+ * way around */
+uint64_t repaint_schedule(struct repaint_scheduler *scheduler,
+		const struct output *output, uint64_t now_ns) {
+	uint64_t refresh = output->refresh_ns;
+	uint64_t last = output->flip_time_ns;
+
+	scheduler->scheduled = true;
+	scheduler->has_target = false;
+	scheduler->deadline_ns = now_ns;
+	if (scheduler->immediate || output->vrr || refresh == 0 || last == 0
+			|| last > now_ns) {
+		return now_ns;
+	}
+
+	uint64_t margin = scheduler->cost_ns + scheduler->slack_ns
+		+ scheduler->min_margin_ns;
+	margin = margin < refresh ? margin : refresh;
+
+	/* the first vblank after the last flip whose deadline is still
+	 * ahead */
+	uint64_t k = (now_ns + margin - last + refresh - 1) / refresh;
+	k = k > 0 ? k : 1;
+	scheduler->has_target = true;
+	scheduler->target_sequence = output->flip_sequence + k;
+	scheduler->deadline_ns = last + k * refresh - margin;
+	trace_instant_at("deadline", scheduler->deadline_ns, "output",
+			output->index, "sequence",
+			scheduler->target_sequence);
+	return scheduler->deadline_ns;
+}
+
+/* schedules another try a refresh from now, for a frame that couldn't be
+ * committed and has no event coming to wake us up */
+void repaint_retry(struct repaint_scheduler *scheduler,
+		const struct output *output, uint64_t now_ns) {
+	scheduler->scheduled = true;
+	scheduler->has_target = false;
+	scheduler->deadline_ns = now_ns + output->refresh_ns;
+}
+
+/* learns the repaint cost from a frame that was just committed. frames
+ * that needed no commit don't aim for a vblank */
+void repaint_committed(struct repaint_scheduler *scheduler,
+		const struct output *output, uint64_t start_ns) {
+	if (output->commit_end_ns == 0 || !output->flip_pending) {
+		scheduler->has_target = false;
+		return;
+	}
+
+	uint64_t cost = output->commit_end_ns - start_ns;
+	if (cost > scheduler->cost_ns) {
+		scheduler->cost_ns = cost;
+	} else {
+		scheduler->cost_ns -= (scheduler->cost_ns - cost) / 16;
+	}
+}
+
+bool repaint_flipped(struct repaint_scheduler *scheduler,
+		const struct output *output) {
+	if (!scheduler->has_target) {
+		return false;
+	}
+	scheduler->has_target = false;
+
+	bool late = (int32_t) (output->flip_sequence
+			- scheduler->target_sequence) > 0;
+	if (late) {
+		uint64_t max_slack = output->refresh_ns / 2;
+		scheduler->slack_ns += REPAINT_SLACK_STEP_NS;
+		if (scheduler->slack_ns > max_slack) {
+			scheduler->slack_ns = max_slack;
+		}
+		scheduler->on_time = 0;
+	} else if (++scheduler->on_time >= REPAINT_CALM) {
+		scheduler->slack_ns -= scheduler->slack_ns
+			< REPAINT_SLACK_STEP_NS / 4 ? scheduler->slack_ns
+			: REPAINT_SLACK_STEP_NS / 4;
+		scheduler->on_time = 0;
+	}
+	return late;
+}
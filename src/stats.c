@@ -0,0 +1,196 @@
+#include "stats.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "compositor.h"
+#include "shared/wire.h"
+
+_Static_assert(STATS_MAX_OUTPUTS >= COMPOSITOR_MAX_OUTPUTS,
+		"every output needs its stats");
+
+/* like the vblank pages, sealed against writable mappings once ours
+ * exists */
+static void destroy_page(struct stats *stats) {
+	if (stats->page != MAP_FAILED) {
+		munmap(stats->page, sizeof(struct stats_page));
+	}
+	close(stats->page_fd);
+}
+
+static int create_page(struct stats *stats, int noutputs) {
+	stats->page = MAP_FAILED;
+	stats->page_fd = memfd_create("mpc-stats",
+			MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (stats->page_fd == -1) {
+		perror("stats: memfd_create");
+		return -1;
+	}
+	if (ftruncate(stats->page_fd, sizeof(struct stats_page)) == -1) {
+		perror("stats: ftruncate");
+		goto err;
+	}
+
+	stats->page = mmap(NULL, sizeof(struct stats_page),
+			PROT_READ | PROT_WRITE, MAP_SHARED, stats->page_fd, 0);
+	if (stats->page == MAP_FAILED) {
+		perror("stats: mmap");
+		goto err;
+	}
+
+	if (fcntl(stats->page_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+				| F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == -1) {
+		perror("stats: fcntl");
+		goto err;
+	}
+
+	stats->page->magic = STATS_MAGIC;
+	stats->page->version = STATS_VERSION;
+	stats->page->noutputs = noutputs;
+	stats->page->start_ns = stats_now_ns();
+	return 0;
+
+err:
+	destroy_page(stats);
+	return -1;
+}
+
+struct stats *stats_create(const char *socket_path, int noutputs) {
+	struct stats *ini = calloc(1, sizeof(struct stats));
+	if (create_page(ini, noutputs) == -1) {
+		free(ini);
+		return NULL;
+	}
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	unlink(socket_path);
+
+	ini->socketfd = socket(AF_UNIX,
+			SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ini->socketfd == -1) {
+		perror("stats: socket");
+		destroy_page(ini);
+		free(ini);
+		return NULL;
+	}
+	if (bind(ini->socketfd, (struct sockaddr *) &addr,
+				sizeof(addr)) == -1
+			|| listen(ini->socketfd, SOMAXCONN) == -1) {
+		perror("stats: bind");
+		close(ini->socketfd);
+		destroy_page(ini);
+		free(ini);
+		return NULL;
+	}
+	return ini;
+}
+
+/* the page is all there is to it, nobody is kept connected */
+void stats_accept(struct stats *stats) {
+	while (true) {
+		int fd = accept4(stats->socketfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("stats: accept4");
+			}
+			return;
+		}
+
+		const uint32_t hello[2] = { STATS_MAGIC, STATS_VERSION };
+		if (wire_send_fd(fd, hello, sizeof(hello),
+					stats->page_fd) == -1) {
+			perror("stats: send");
+		}
+		close(fd);
+	}
+}
+
+/* there's only one writer, so an atomic store is enough for readers to
+ * never see half a value */
+void stats_add(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void stats_record(struct stats_histogram *histogram, uint64_t ns) {
+	stats_add(&histogram->buckets[stats_bucket(ns)], 1);
+	stats_add(&histogram->sum_ns, ns);
+	if (ns > histogram->max_ns) {
+		__atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+	}
+	/* last, so the buckets never add up to less than count */
+	stats_add(&histogram->count, 1);
+}
+
+static struct stats_client *client_stats(struct stats *stats, int id) {
+	return id < STATS_MAX_CLIENTS ? &stats->page->clients[id] : NULL;
+}
+
+/* replaced is set if it took the place of a frame that was latched but
+ * never committed */
+void stats_client_latched(struct stats *stats, int id, uint32_t output,
+		bool replaced) {
+	struct stats_client *client = client_stats(stats, id);
+	if (client == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&client->output, output, __ATOMIC_RELAXED);
+	__atomic_store_n(&client->active, 1, __ATOMIC_RELAXED);
+	stats_add(&client->latched, 1);
+	if (replaced) {
+		stats_add(&client->discarded, 1);
+	}
+}
+
+/* a frame of the client was scanned out latency_ns after it arrived */
+void stats_client_presented(struct stats *stats, int id, uint32_t output,
+		uint64_t latency_ns, uint32_t refresh_ns) {
+	stats_record(&stats->page->outputs[output].latency, latency_ns);
+
+	struct stats_client *client = client_stats(stats, id);
+	if (client == NULL) {
+		return;
+	}
+	stats_add(&client->presented, 1);
+	stats_record(&client->latency, latency_ns);
+	/* anything that arrived in time is shown within a refresh */
+	if (refresh_ns > 0) {
+		stats_add(&client->missed_vblanks, latency_ns / refresh_ns);
+	}
+}
+
+/* a latched frame of the client went down with a rejected commit */
+void stats_client_discarded(struct stats *stats, int id) {
+	struct stats_client *client = client_stats(stats, id);
+	if (client != NULL) {
+		stats_add(&client->discarded, 1);
+	}
+}
+
+void stats_client_reset(struct stats *stats, int id) {
+	struct stats_client *client = client_stats(stats, id);
+	if (client == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&client->active, 0, __ATOMIC_RELAXED);
+	uint64_t *values = (uint64_t *) &client->latched;
+	size_t nvalues = (sizeof(struct stats_client)
+			- offsetof(struct stats_client, latched))
+		/ sizeof(uint64_t);
+	for (size_t i = 0; i < nvalues; i++) {
+		__atomic_store_n(&values[i], 0, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,174 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool trace_enabled;
+
+struct trace_thread {
+	int32_t tid;
+	const char *name;
+};
+
+/* a ring every thread records into, claiming entries with an atomic
+ * increment */
+static struct {
+	const char *path;
+	struct trace_event *events;
+	uint64_t head;
+
+	/* protects the thread names */
+	pthread_mutex_t lock;
+	int nthreads;
+	struct trace_thread threads[TRACE_MAX_THREADS];
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread int32_t thread_id;
+
+static int32_t current_tid(void) {
+	if (thread_id == 0) {
+		thread_id = syscall(SYS_gettid);
+	}
+	return thread_id;
+}
+
+/* the ring is allocated and touched up front, so recording never faults
+ * a page in */
+int trace_init(const char *path) {
+	trace.events = malloc(TRACE_EVENTS * sizeof(struct trace_event));
+	if (trace.events == NULL) {
+		perror("trace: malloc");
+		return -1;
+	}
+	memset(trace.events, 0, TRACE_EVENTS * sizeof(struct trace_event));
+	trace.path = path;
+	trace_enabled = true;
+	return 0;
+}
+
+void trace_thread_name(const char *name) {
+	if (!trace_enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.nthreads < TRACE_MAX_THREADS) {
+		trace.threads[trace.nthreads++] = (struct trace_thread) {
+			.tid = current_tid(),
+			.name = name,
+		};
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void trace_record(const char *name, uint64_t ts_ns, uint64_t dur_ns,
+		const char *arg0, uint64_t value0, const char *arg1,
+		uint64_t value1) {
+	uint64_t index = __atomic_fetch_add(&trace.head, 1, __ATOMIC_RELAXED);
+	struct trace_event *event = &trace.events[index % TRACE_EVENTS];
+
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	event->ts_ns = ts_ns;
+	event->dur_ns = dur_ns;
+	event->name = name;
+	event->tid = current_tid();
+	event->arg_names[0] = arg0;
+	event->args[0] = value0;
+	event->arg_names[1] = arg1;
+	event->args[1] = value1;
+	__atomic_store_n(&event->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+/* copies an event unless it is being written, like a seqlock */
+static bool read_event(uint64_t index, struct trace_event *copy) {
+	const struct trace_event *event = &trace.events[index % TRACE_EVENTS];
+	if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != index + 1) {
+		return false;
+	}
+	*copy = *event;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == index + 1;
+}
+
+static void write_event(FILE *file, const struct trace_event *event,
+		int pid) {
+	fprintf(file, ",\n{\"name\": \"%s\", \"pid\": %d, \"tid\": %d, "
+			"\"ts\": %llu.%03llu", event->name, pid, event->tid,
+			(unsigned long long) event->ts_ns / 1000,
+			(unsigned long long) event->ts_ns % 1000);
+	if (event->dur_ns != 0) {
+		fprintf(file, ", \"ph\": \"X\", \"dur\": %llu.%03llu",
+				(unsigned long long) event->dur_ns / 1000,
+				(unsigned long long) event->dur_ns % 1000);
+	} else {
+		fprintf(file, ", \"ph\": \"i\", \"s\": \"t\"");
+	}
+
+	fprintf(file, ", \"args\": {");
+	for (int i = 0, n = 0; i < 2; i++) {
+		if (event->arg_names[i] != NULL) {
+			fprintf(file, "%s\"%s\": %lld", n++ > 0 ? ", " : "",
+					event->arg_names[i],
+					(long long) event->args[i]);
+		}
+	}
+	fprintf(file, "}}");
+}
+
+/* writes what is in the ring, oldest first. it keeps recording meanwhile,
+ * so the newest events may be missing. the file is replaced in one go */
+int trace_dump(void) {
+	if (!trace_enabled) {
+		return 0;
+	}
+
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", trace.path);
+	FILE *file = fopen(tmp_path, "w");
+	if (file == NULL) {
+		perror("trace: fopen");
+		return -1;
+	}
+
+	int pid = getpid();
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+			"{\"name\": \"process_name\", \"ph\": \"M\", "
+			"\"pid\": %d, \"args\": {\"name\": "
+			"\"kms-composite\"}}", pid);
+	pthread_mutex_lock(&trace.lock);
+	for (int i = 0; i < trace.nthreads; i++) {
+		fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+				"\"pid\": %d, \"tid\": %d, \"args\": "
+				"{\"name\": \"%s\"}}", pid,
+				trace.threads[i].tid, trace.threads[i].name);
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+	uint64_t start = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+	uint64_t nevents = 0;
+	for (uint64_t i = start; i < head; i++) {
+		struct trace_event event;
+		if (read_event(i, &event)) {
+			write_event(file, &event, pid);
+			nevents++;
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	if (fclose(file) != 0 || rename(tmp_path, trace.path) == -1) {
+		perror("trace: write");
+		unlink(tmp_path);
+		return -1;
+	}
+	fprintf(stderr, "trace: wrote %llu events to %s\n",
+			(unsigned long long) nevents, trace.path);
+	return 0;
+}
@@ -0,0 +1,267 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shared/stats.h"
+#include "shared/wire.h"
+
+/* maps the stats page of the compositor listening on path */
+static const struct stats_page *connect_stats(const char *path) {
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return NULL;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("connect");
+		close(fd);
+		return NULL;
+	}
+
+	uint32_t hello[2];
+	int page_fd = -1;
+	ssize_t len = wire_recv_fd(fd, hello, sizeof(hello), &page_fd, 0);
+	close(fd);
+	if (len != sizeof(hello) || page_fd < 0 || hello[0] != STATS_MAGIC
+			|| hello[1] != STATS_VERSION) {
+		fprintf(stderr, "unexpected answer from %s\n", path);
+		if (page_fd >= 0) {
+			close(page_fd);
+		}
+		return NULL;
+	}
+
+	const struct stats_page *page = mmap(NULL, sizeof(struct stats_page),
+			PROT_READ, MAP_SHARED, page_fd, 0);
+	close(page_fd);
+	if (page == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	return page;
+}
+
+_Static_assert(sizeof(struct stats_page) % 8 == 0,
+		"the page is copied in 64 bit words");
+
+/* the fields are written atomically and 32 bit ones come in pairs, so
+ * copying 64 bits at a time never sees half of one */
+static void snapshot(struct stats_page *dst, const struct stats_page *src) {
+	const uint64_t *from = (const uint64_t *) src;
+	uint64_t *to = (uint64_t *) dst;
+	for (size_t i = 0; i < sizeof(struct stats_page) / 8; i++) {
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	}
+}
+
+static void histogram_sub(struct stats_histogram *h,
+		const struct stats_histogram *prev) {
+	h->count -= prev->count;
+	h->sum_ns -= prev->sum_ns;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		h->buckets[i] -= prev->buckets[i];
+	}
+}
+
+/* what happened since prev, except for the maximums. client slots that
+ * were reused in between are left as they are */
+static void page_sub(struct stats_page *page, const struct stats_page *prev) {
+	for (int i = 0; i < STATS_MAX_OUTPUTS; i++) {
+		struct stats_output *o = &page->outputs[i];
+		const struct stats_output *p = &prev->outputs[i];
+		o->commits -= p->commits;
+		o->failed_commits -= p->failed_commits;
+		o->busy_commits -= p->busy_commits;
+		o->idle_frames -= p->idle_frames;
+		o->late_flips -= p->late_flips;
+		histogram_sub(&o->build, &p->build);
+		histogram_sub(&o->commit, &p->commit);
+		histogram_sub(&o->flip, &p->flip);
+		histogram_sub(&o->latency, &p->latency);
+	}
+	for (int i = 0; i < STATS_MAX_CLIENTS; i++) {
+		struct stats_client *c = &page->clients[i];
+		const struct stats_client *p = &prev->clients[i];
+		if (c->latched < p->latched) {
+			continue;
+		}
+		c->latched -= p->latched;
+		c->presented -= p->presented;
+		c->discarded -= p->discarded;
+		c->missed_vblanks -= p->missed_vblanks;
+		histogram_sub(&c->latency, &p->latency);
+	}
+}
+
+/* the upper end of the bucket the percentile falls into, or the maximum
+ * if that's less */
+static uint64_t percentile_us(const struct stats_histogram *h, int p) {
+	uint64_t rank = (h->count * p + 99) / 100;
+	uint64_t max_us = h->max_ns / 1000;
+	uint64_t seen = 0;
+	for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			return (2ull << i) < max_us ? 2ull << i : max_us;
+		}
+	}
+	return max_us;
+}
+
+static void print_histogram(const char *name,
+		const struct stats_histogram *h, bool json) {
+	uint64_t mean = h->count > 0 ? h->sum_ns / h->count / 1000 : 0;
+	uint64_t p50 = percentile_us(h, 50);
+	uint64_t p99 = percentile_us(h, 99);
+	if (json) {
+		printf(", \"%s\": {\"count\": %llu, \"mean_us\": %llu, "
+				"\"p50_us\": %llu, \"p99_us\": %llu, "
+				"\"max_us\": %llu}", name,
+				(unsigned long long) h->count,
+				(unsigned long long) mean,
+				(unsigned long long) p50,
+				(unsigned long long) p99,
+				(unsigned long long) h->max_ns / 1000);
+		return;
+	}
+	if (h->count == 0) {
+		printf("  %-8s -\n", name);
+		return;
+	}
+	printf("  %-8s %8llu  mean %6lluus  p50 %6lluus  p99 %6lluus  "
+			"max %6lluus\n", name, (unsigned long long) h->count,
+			(unsigned long long) mean, (unsigned long long) p50,
+			(unsigned long long) p99,
+			(unsigned long long) h->max_ns / 1000);
+}
+
+static void print_page(const struct stats_page *page, bool json) {
+	for (uint32_t i = 0; i < page->noutputs && i < STATS_MAX_OUTPUTS;
+			i++) {
+		const struct stats_output *o = &page->outputs[i];
+		if (json) {
+			printf("{\"output\": %u, \"commits\": %llu, "
+					"\"failed_commits\": %llu, "
+					"\"busy_commits\": %llu, "
+					"\"idle_frames\": %llu, "
+					"\"late_flips\": %llu", i,
+					(unsigned long long) o->commits,
+					(unsigned long long) o->failed_commits,
+					(unsigned long long) o->busy_commits,
+					(unsigned long long) o->idle_frames,
+					(unsigned long long) o->late_flips);
+		} else {
+			printf("output %u: %llu commits, %llu failed, "
+					"%llu busy, %llu idle, %llu late\n", i,
+					(unsigned long long) o->commits,
+					(unsigned long long) o->failed_commits,
+					(unsigned long long) o->busy_commits,
+					(unsigned long long) o->idle_frames,
+					(unsigned long long) o->late_flips);
+		}
+		print_histogram("build", &o->build, json);
+		print_histogram("commit", &o->commit, json);
+		print_histogram("flip", &o->flip, json);
+		print_histogram("latency", &o->latency, json);
+		if (json) {
+			printf("}\n");
+		}
+	}
+
+	for (int i = 0; i < STATS_MAX_CLIENTS; i++) {
+		const struct stats_client *c = &page->clients[i];
+		if (!c->active) {
+			continue;
+		}
+		if (json) {
+			printf("{\"client\": %d, \"output\": %u, "
+					"\"latched\": %llu, "
+					"\"presented\": %llu, "
+					"\"discarded\": %llu, "
+					"\"missed_vblanks\": %llu", i,
+					c->output,
+					(unsigned long long) c->latched,
+					(unsigned long long) c->presented,
+					(unsigned long long) c->discarded,
+					(unsigned long long) c->missed_vblanks);
+		} else {
+			printf("client %d on output %u: %llu latched, "
+					"%llu presented, %llu discarded, "
+					"%llu missed vblanks\n", i, c->output,
+					(unsigned long long) c->latched,
+					(unsigned long long) c->presented,
+					(unsigned long long) c->discarded,
+					(unsigned long long) c->missed_vblanks);
+		}
+		print_histogram("latency", &c->latency, json);
+		if (json) {
+			printf("}\n");
+		}
+	}
+	fflush(stdout);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-j] [-i seconds] [stats.sock]\n", name);
+}
+
+/* prints the compositor's frame statistics since it started, or with -i
+ * over each interval. -j prints one JSON object per output and client */
+int main(int argc, char *argv[]) {
+	bool json = false;
+	int interval = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "ji:")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = true;
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				if (interval <= 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	const char *path = optind < argc ? argv[optind]
+		: "/home/pi/mpc-stats.sock";
+
+	const struct stats_page *page = connect_stats(path);
+	if (page == NULL) {
+		return 1;
+	}
+
+	struct stats_page *prev = calloc(1, sizeof(struct stats_page));
+	struct stats_page *now = calloc(1, sizeof(struct stats_page));
+	struct stats_page *delta = calloc(1, sizeof(struct stats_page));
+	snapshot(prev, page);
+	if (interval == 0) {
+		print_page(prev, json);
+		return 0;
+	}
+
+	while (true) {
+		sleep(interval);
+		snapshot(now, page);
+		memcpy(delta, now, sizeof(struct stats_page));
+		page_sub(delta, prev);
+		print_page(delta, json);
+		memcpy(prev, now, sizeof(struct stats_page));
+	}
+}